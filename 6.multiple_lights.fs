@@ -51,6 +51,7 @@ in vec2 TexCoords;
 uniform vec3 viewPos;
 uniform DirLight dirLight;
 uniform PointLight pointLights[NR_POINT_LIGHTS];
+uniform int activePointLights; // set by the quality governor, <= NR_POINT_LIGHTS
 uniform SpotLight spotLight;
 uniform Material material;
 
@@ -67,7 +68,7 @@ void main()
     vec3 result = CalcDirLight(dirLight, norm, viewDir);
     
     // point lights
-    for(int i = 0; i < NR_POINT_LIGHTS; i++)
+    for(int i = 0; i < activePointLights; i++)
         result += CalcPointLight(pointLights[i], norm, FragPos, viewDir);
 
     // optional: if not using spot light, comment this out
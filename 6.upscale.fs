@@ -0,0 +1,50 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+uniform sampler2D scene;
+uniform vec2 uvScale;
+
+// Catmull-Rom bicubic from 9 bilinear taps: sharper than plain bilinear
+// when the scene was rendered below output resolution. taps are clamped to
+// the rendered part, the rest of the texture holds stale pixels
+void main()
+{
+    vec2 size = vec2(textureSize(scene, 0));
+    vec2 texel = 1.0 / size;
+    vec2 uvMin = 0.5 * texel;
+    vec2 uvMax = uvScale - 0.5 * texel;
+
+    vec2 samplePos = TexCoords * size;
+    vec2 texPos1 = floor(samplePos - 0.5) + 0.5;
+    vec2 f = samplePos - texPos1;
+
+    vec2 w0 = f * (-0.5 + f * (1.0 - 0.5 * f));
+    vec2 w1 = 1.0 + f * f * (-2.5 + 1.5 * f);
+    vec2 w2 = f * (0.5 + f * (2.0 - 1.5 * f));
+    vec2 w3 = f * f * (-0.5 + 0.5 * f);
+
+    // the middle two taps of each axis merge into one bilinear fetch
+    vec2 w12 = w1 + w2;
+    vec2 offset12 = w2 / w12;
+
+    vec2 texPos0 = clamp((texPos1 - 1.0) * texel, uvMin, uvMax);
+    vec2 texPos3 = clamp((texPos1 + 2.0) * texel, uvMin, uvMax);
+    vec2 texPos12 = clamp((texPos1 + offset12) * texel, uvMin, uvMax);
+
+    vec3 result = vec3(0.0);
+    result += texture(scene, vec2(texPos0.x,  texPos0.y)).rgb * w0.x * w0.y;
+    result += texture(scene, vec2(texPos12.x, texPos0.y)).rgb * w12.x * w0.y;
+    result += texture(scene, vec2(texPos3.x,  texPos0.y)).rgb * w3.x * w0.y;
+
+    result += texture(scene, vec2(texPos0.x,  texPos12.y)).rgb * w0.x * w12.y;
+    result += texture(scene, vec2(texPos12.x, texPos12.y)).rgb * w12.x * w12.y;
+    result += texture(scene, vec2(texPos3.x,  texPos12.y)).rgb * w3.x * w12.y;
+
+    result += texture(scene, vec2(texPos0.x,  texPos3.y)).rgb * w0.x * w3.y;
+    result += texture(scene, vec2(texPos12.x, texPos3.y)).rgb * w12.x * w3.y;
+    result += texture(scene, vec2(texPos3.x,  texPos3.y)).rgb * w3.x * w3.y;
+
+    FragColor = vec4(max(result, 0.0), 1.0);
+}
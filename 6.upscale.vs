@@ -0,0 +1,12 @@
+#version 330 core
+out vec2 TexCoords;
+
+uniform vec2 uvScale; // part of the scene texture that was rendered
+
+void main()
+{
+    // one triangle covering the screen, no vertex buffer needed
+    vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    TexCoords = pos * uvScale;
+    gl_Position = vec4(pos * 2.0 - 1.0, 0.0, 1.0);
+}
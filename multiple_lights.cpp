@@ -1,5 +1,8 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <stb_image.h>
 
 #include <glm/glm.hpp>
@@ -13,6 +16,45 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <cstdint>
+#include <coroutine>
+#include <stop_token>
+#include <optional>
+#include <unordered_map>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <climits>
+#include <cstdlib>
+#include <cassert>
+#include <sstream>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define STB_PERLIN_IMPLEMENTATION
 #include "stb_perlin.h"
@@ -20,334 +62,7680 @@
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
-void processInput(GLFWwindow *window);
+void window_refresh_callback(GLFWwindow* window);
+struct InputFrame;
+InputFrame processInput(GLFWwindow *window);
+unsigned readMoveKeys(GLFWwindow* window);
+void readBrushInput(GLFWwindow* window, InputFrame& input);
+void applyInput(const InputFrame& input, float dt);
+void applyMovement(unsigned keys, float dt);
 unsigned int loadTexture(const char *path);
 
 // terrain helpers
 void generateTerrain(std::vector<float>& vertices, std::vector<unsigned int>& indices, int N, float scale, float offsetX, float offsetZ, float amplitude, float freq);
 float sampleHeight(float x, float z, float offsetX, float offsetZ, float amplitude, float freq);
+float sampleOctaves(float x, float z, float freq, int firstOctave, int lastOctave);
+float shapeHeight(float raw, float amplitude);
+void buildTerrainVertices(const float* heights, int N, float scale, std::vector<float>& vertices);
+void buildTerrainIndices(int N, std::vector<unsigned int>& indices);
+void buildLodIndices(int N, int stride, std::vector<unsigned int>& indices);
+
+// linear allocator for per-frame scratch memory; ArenaScope rewinds it.
+// requests beyond capacity fall back to the heap until the next rewind
+class FrameArena
+{
+public:
+    explicit FrameArena(size_t capacity) : capacity(capacity) {}
+    ~FrameArena();
+
+    template <typename T>
+    T* alloc(size_t count) { return static_cast<T*>(allocBytes(count * sizeof(T), alignof(T))); }
+    void* allocBytes(size_t bytes, size_t align);
+    size_t mark() const { return used; }
+    void rewind(size_t mark);
+
+private:
+    struct Overflow
+    {
+        void* p;
+        size_t tag;     // position past capacity, so rewinds can tell scopes apart
+    };
+    char* memory = nullptr;
+    size_t capacity;
+    size_t used = 0;
+    std::vector<Overflow> overflow;
+};
+FrameArena& threadArena();
+
+struct ArenaScope
+{
+    FrameArena& arena;
+    size_t start;
+    explicit ArenaScope(FrameArena& arena) : arena(arena), start(arena.mark()) {}
+    ~ArenaScope() { arena.rewind(start); }
+};
+
+// allocation accounting: every operator new is counted; inside a
+// HotPathScope (once armed after warm-up) allocations are reported and, in
+// debug builds, asserted on. AllowAllocations carves out bounded streaming
+// work such as tile loads
+class HotPathScope
+{
+public:
+    explicit HotPathScope(const char* name);
+    ~HotPathScope();
+private:
+    const char* name;
+    bool outermost;
+};
+
+struct AllowAllocations
+{
+    AllowAllocations();
+    ~AllowAllocations();
+};
+
+extern std::atomic<unsigned long long> totalAllocations;
+extern std::atomic<unsigned long long> hotPathAllocations;
+extern std::atomic<bool> allocChecksArmed;
+
+// memory budgets: subsystems charge and release what they hold, owners
+// enforce their budget by evicting lowest-priority resources first. counters
+// are lock-free so any thread may report
+enum MemorySubsystem
+{
+    MEM_TILE_CACHE,         // resident height tiles
+    MEM_TERRAIN_MESHES,     // pooled CPU-side terrain meshes
+    MEM_GPU_TERRAIN,        // terrain vertex/index heap
+    MEM_TEXTURES,
+    MEM_EDITS,              // sculpted height deltas
+    MEM_SUBSYSTEM_COUNT
+};
+
+struct MemoryStats
+{
+    const char* name;
+    bool gpu;
+    size_t used, peak, budget;              // budget 0 = unlimited
+    unsigned long long evictions;
+};
+
+class MemoryBudget
+{
+public:
+    void charge(MemorySubsystem s, size_t bytes);
+    void release(MemorySubsystem s, size_t bytes);
+    void countEvictions(MemorySubsystem s, unsigned long long count) { counters[s].evictions.fetch_add(count, std::memory_order_relaxed); }
+    void setBudget(MemorySubsystem s, size_t bytes) { counters[s].budget.store(bytes, std::memory_order_relaxed); }
+    size_t budget(MemorySubsystem s) const { return counters[s].budget.load(std::memory_order_relaxed); }
+    size_t used(MemorySubsystem s) const { return counters[s].used.load(std::memory_order_relaxed); }
+    size_t excess(MemorySubsystem s) const;
+    void snapshot(MemoryStats out[MEM_SUBSYSTEM_COUNT]) const;
+    bool configure(const char* spec);
+
+private:
+    struct Counter
+    {
+        std::atomic<size_t> used{0}, peak{0}, budget{0};
+        std::atomic<unsigned long long> evictions{0};
+    };
+    Counter counters[MEM_SUBSYSTEM_COUNT];
+};
+void setDefaultMemoryBudgets();
+void printMemoryStats();
+
+// scoped-zone profiler: completed zones go into per-thread rings (no locks,
+// no allocation after a thread's first zone) and can be exported as a
+// Chrome trace (chrome://tracing, Perfetto). build with -DTERRAIN_PROFILE=0
+// to compile every zone out
+#ifndef TERRAIN_PROFILE
+#define TERRAIN_PROFILE 1
+#endif
+
+struct ProfileEvent
+{
+    const char* name;                   // string literal
+    uint64_t startNs, endNs;
+    double value;                       // counters only
+    bool counter;
+};
+
+// single writer (the owning thread or, for the gpu track, the render
+// thread); snapshots from other threads drop entries overwritten meanwhile
+class ProfileRing
+{
+public:
+    static const size_t CAPACITY = 1 << 14;
+
+    void record(const char* name, uint64_t startNs, uint64_t endNs);
+    void recordCounter(const char* name, uint64_t timeNs, double value);
+    void snapshot(std::vector<ProfileEvent>& out, uint64_t sinceNs) const;
+    char name[32] = {};
+    int id = 0;
+
+private:
+    struct Entry
+    {
+        std::atomic<const char*> name{nullptr};
+        std::atomic<uint64_t> startNs{0}, endNs{0};
+        std::atomic<double> value{0.0};
+        std::atomic<bool> counter{false};
+    };
+    void write(const char* name, uint64_t startNs, uint64_t endNs, double value, bool counter);
+    Entry entries[CAPACITY];
+    std::atomic<uint64_t> head{0};
+};
+
+class Profiler
+{
+public:
+    static const int MAX_RINGS = 64;
+
+    ~Profiler();
+    uint64_t now() const;
+    ProfileRing* threadRing();
+    ProfileRing* createRing(const char* name);
+    void releaseRing(ProfileRing* ring);
+    void setThreadName(const char* name);
+    bool writeChromeTrace(const char* path, uint64_t sinceNs = 0, const std::string& otherData = std::string()) const;
+    void counter(const char* name, double value);
+
+private:
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    mutable std::mutex ringMutex;
+    ProfileRing* rings[MAX_RINGS] = {};
+    int ringCount = 0;                  // guarded by ringMutex
+    ProfileRing* released[MAX_RINGS] = {};
+    int releasedCount = 0;              // guarded by ringMutex
+};
+
+class ProfileZone
+{
+public:
+    explicit ProfileZone(const char* name);
+    ~ProfileZone();
+private:
+    const char* name;
+    uint64_t startNs;
+};
+
+// GL_TIME_ELAPSED zones on the render thread. queries cannot nest, so gpu
+// zones are sequential; results are collected frames later without
+// stalling and recorded on a "gpu" track at their CPU submission time
+class GpuProfiler
+{
+public:
+    void create();
+    void destroy();
+    void begin(const char* name);
+    void end();
+    void collect();
+
+private:
+    static const int QUERY_COUNT = 64;
+    struct Query
+    {
+        GLuint id = 0;
+        const char* name = nullptr;
+        uint64_t submitNs = 0;
+        bool pending = false;
+    };
+    Query queries[QUERY_COUNT];
+    int next = 0, oldest = 0;
+    int active = -1;
+    ProfileRing* ring = nullptr;
+};
+
+struct GpuZone
+{
+    GpuProfiler& profiler;
+    GpuZone(GpuProfiler& profiler, const char* name) : profiler(profiler) { profiler.begin(name); }
+    ~GpuZone() { profiler.end(); }
+};
+
+// hardware counters around selected zones (Linux perf_event_open, one
+// group per thread, user space only). opt-in with --perf; per-stage totals
+// are printed at exit and each zone adds counter tracks to the trace
+enum PerfCounter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_COUNT
+};
+
+struct PerfStage
+{
+    std::string name, ipcTrack, cacheTrack, branchTrack;
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> totals[PERF_COUNTER_COUNT] = {};
+};
+
+class PerfCounters
+{
+public:
+    ~PerfCounters();
+    static PerfCounters* thread();      // nullptr when counters are unavailable
+    bool read(uint64_t values[PERF_COUNTER_COUNT]);
+private:
+    bool open();
+    int fds[PERF_COUNTER_COUNT] = { -1, -1, -1, -1 };
+};
+
+class PerfZone
+{
+public:
+    explicit PerfZone(PerfStage& stage);
+    ~PerfZone();
+private:
+    PerfStage& stage;
+    PerfCounters* counters;
+    uint64_t start[PERF_COUNTER_COUNT];
+};
+
+PerfStage& registerPerfStage(const char* name);
+void printPerfStats(std::ostream& out);
+void printLatencyStats(std::ostream& out);
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#if TERRAIN_PROFILE
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_GPU_ZONE(name) GpuZone PROFILE_CONCAT(gpuZone, __LINE__)(gpuProfiler, name)
+#define PROFILE_THREAD(name) profiler.setThreadName(name)
+#define PROFILE_COUNTER(name, value) profiler.counter(name, (double)(value))
+#define PROFILE_PERF_ZONE(name) \
+    ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name); \
+    static PerfStage& PROFILE_CONCAT(perfStage, __LINE__) = registerPerfStage(name); \
+    PerfZone PROFILE_CONCAT(perfZone, __LINE__)(PROFILE_CONCAT(perfStage, __LINE__))
+#else
+#define PROFILE_ZONE(name) ((void)0)
+#define PROFILE_GPU_ZONE(name) ((void)0)
+#define PROFILE_THREAD(name) ((void)0)
+#define PROFILE_COUNTER(name, value) ((void)0)
+#define PROFILE_PERF_ZONE(name) ((void)0)
+#endif
+
+// live metrics: lock-free counters and log-linear histograms (eight linear
+// sub-buckets per power of two, so quantiles are within 12.5%), exposed as
+// Prometheus text on 127.0.0.1 and optionally in the window title
+class Histogram
+{
+public:
+    static const int SUB_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS) * SUB_BUCKETS + SUB_BUCKETS;
+
+    void record(uint64_t value);
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return valueSum.load(std::memory_order_relaxed); }
+    void snapshot(uint64_t counts[BUCKETS]) const;
+    static uint64_t percentile(const uint64_t counts[BUCKETS], double p);
+    static int bucketOf(uint64_t value);
+    static uint64_t bucketUpper(int bucket);
+
+private:
+    std::atomic<uint64_t> buckets[BUCKETS] = {};
+    std::atomic<uint64_t> total{0}, valueSum{0};
+};
+
+struct Metrics
+{
+    Histogram simFrameUs, renderFrameUs;    // CPU time per frame
+    Histogram tileGenerateUs, chunkBuildUs;
+    Histogram inputToSimUs, inputToSubmitUs, inputToSwapUs, inputToGpuUs;  // input-to-photon stages
+    std::atomic<uint64_t> frames{0}, framesSkipped{0};
+    std::atomic<uint64_t> uploadBytes{0}, drawCalls{0}, triangles{0};
+    std::atomic<uint64_t> tileMemoryHits{0}, tileDiskHits{0}, tilesGenerated{0};
+};
+
+class MetricsServer
+{
+public:
+    bool start(int port);
+    void stop();
+private:
+    void serve();
+    int listenFd = -1;
+    std::thread thread;
+    std::atomic<bool> quit{false};
+};
+
+std::string formatMetrics();
+void updateMetricsOverlay(GLFWwindow* window);
+
+// benchmarks (--bench): every case is warmed up, then timed in repeated
+// samples; results carry a 95% confidence interval and can be compared with
+// a stored JSON baseline
+struct BenchCase
+{
+    std::string name;
+    double items;                       // work items per body() call
+    std::function<void()> body;
+};
+
+struct BenchResult
+{
+    std::string name;
+    double nsPerItem = 0.0, ci95 = 0.0, minNsPerItem = 0.0;
+    int samples = 0;
+    bool counters = false;              // hardware counters below are valid
+    double ipc = 0.0, cacheMissesPerItem = 0.0, branchMissesPerItem = 0.0;
+};
+
+void collectBenchmarks(std::vector<BenchCase>& cases);
+BenchResult measureBenchmark(const BenchCase& bench);
+int runBenchmarks();
+
+// noise backends: every stb_perlin entry point behind one signature, as a
+// scalar call per sample and as a batch call per row; the batch form is also
+// built for AVX2 where the compiler allows it
+typedef float (*NoiseFn)(float x, float y, float z);
+typedef void (*NoiseBatchFn)(const float* x, const float* z, int count, float y, float* out);
+
+struct NoiseBackend
+{
+    const char* name;
+    NoiseFn sample;
+    NoiseBatchFn batch;
+    NoiseBatchFn batchAvx2;             // nullptr when not built or not supported
+    float rangeMin, rangeMax;           // documented output range
+};
+
+// quality of a backend over a fixed grid: a faster replacement must keep
+// range, spectrum and isotropy, or the terrain changes with it
+const int NOISE_BANDS = 6;              // octave bands of the row spectrum
+
+struct NoiseQuality
+{
+    std::string name;
+    float minValue = 0.0f, maxValue = 0.0f, mean = 0.0f, stddev = 0.0f;
+    float isotropy = 0.0f;              // weakest / strongest directional gradient energy
+    float bands[NOISE_BANDS] = {};      // fraction of spectral energy per octave band
+    std::string problem;                // empty when the checks pass
+};
+
+extern const NoiseBackend noiseBackends[];
+extern const int noiseBackendCount;
+NoiseQuality measureNoiseQuality(const NoiseBackend& backend);
+
+// host calibration (--calibrate): times tile generation for each noise path
+// and worker count, chunk meshing, and a short headless render sweep over
+// the LOD pixel error, then stores the winners in a profile named after a
+// hardware fingerprint (CPU model, cores, AVX2). later startups on the same
+// hardware apply it before any thread starts. the GL renderer is kept as a
+// note only: --calibrate runs in a surfaceless context, whose renderer
+// string need not match the windowed one
+struct CalibrationProfile
+{
+    unsigned workerThreads = 0;         // 0 = cores - 2
+    std::string noise = "scalar";       // tile generation path: scalar, batch or avx2
+    int gridN = 0;                      // 0 = GRID_MAX_N
+    float lodPixelError = 0.0f;         // governor's starting LOD error, 0 = best
+    std::string renderer;               // GL renderer it was measured on, not matched
+
+    bool load(const std::string& path, const std::string& fingerprint);
+    bool save(const std::string& path, const std::string& fingerprint) const;
+};
+
+std::string hardwareFingerprint();
+std::string calibrationPath(const std::string& fingerprint);
+void applyCalibration(const CalibrationProfile& profile);
+void calibrateGeneration(CalibrationProfile& profile);     // before the job system starts
+int calibrationSweepFrames();
+int calibrationLodLevel(unsigned long long frame);
+float pickCalibratedLod(double budgetMs);                  // after the render sweep
+
+// always-on flight recorder: the profiler rings keep the last few seconds,
+// and a sim or render frame over the hitch threshold dumps them (with the
+// camera, offsets and terrain parameters that frame used) to hitch_N.json
+// without stalling the frame loop
+struct CameraState;
+void checkHitch(const char* thread, unsigned long long frame, float frameSeconds, const CameraState& view);
+
+// progressive refinement: a coarse lattice (few octaves) first, then finer
+// lattices that reuse the partial octave sums of the samples already taken.
+// lattices are aligned to world samples, so a grid that moves by a few
+// samples keeps its sums and only the strip it uncovers is sampled anew
+struct TerrainRefinement
+{
+    bool active = false;
+    int level = 0;
+    int row = 0;                        // next lattice row of the current level
+    int N = 0;
+    int originX = 0, originZ = 0;        // world sample index of grid point (0, 0)
+    float scale = 0.0f, amplitude = 0.0f, freq = 0.0f;
+    std::vector<float> raw;             // partial octave sums per grid point
+    std::vector<unsigned char> octaves; // octaves accumulated in raw
+    std::vector<float> heights;
+    std::vector<int> latticeX, latticeZ;    // grid coordinates of the current level's lattice
+};
+void beginTerrainRefinement(TerrainRefinement& r, int N, float scale, int originX, int originZ, float amplitude, float freq);
+void shiftTerrainRefinement(TerrainRefinement& r, int originX, int originZ);
+bool refineTerrain(TerrainRefinement& r, double budgetMs);
+
+// worker pool for terrain jobs; parallelFor lets the caller help out
+class JobSystem
+{
+public:
+    void start(unsigned threadCount);
+    void stop();
+    void submit(std::function<void()> job);
+    void parallelFor(int count, const std::function<void(int)>& fn);
+    unsigned threadCount() const { return (unsigned)workers.size(); }
+
+private:
+    void workerMain();
+
+    std::vector<std::thread> workers;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::deque<std::function<void()>> queue;
+    bool quit = false;
+};
+
+// epoch-based reclamation: readers pin the global epoch while they hold raw
+// pointers into shared structures; retired memory is freed only once every
+// pinned reader has moved past the epoch it was retired in
+class EpochManager
+{
+public:
+    static const int MAX_THREADS = 64;
+
+    ~EpochManager();
+    void enter();
+    void exit();
+    void retire(void* p, void (*deleter)(void*));
+    void collect();
+
+private:
+    struct alignas(64) ThreadSlot
+    {
+        std::atomic<bool> used{false};
+        std::atomic<uint64_t> epoch{0};     // 0 = not inside a critical section
+        int depth = 0;                      // only touched by the owning thread
+    };
+    struct Retired
+    {
+        void* p;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+    ThreadSlot& threadSlot();
+
+    std::atomic<uint64_t> globalEpoch{1};
+    ThreadSlot slots[MAX_THREADS];
+    std::mutex retiredMutex;
+    std::vector<Retired> retired;
+};
+
+struct EpochGuard
+{
+    EpochGuard();
+    ~EpochGuard();
+};
+
+// world-aligned block of final heights; tile (tx, tz) at level L holds
+// world samples [tx * TILE_N, tx * TILE_N + TILE_N) << L along each axis,
+// spaced 2^L grid cells apart
+const int TILE_N = 64;
+
+struct HeightTile
+{
+    int level = 0, tileX = 0, tileZ = 0;
+    std::atomic<int> refs{1};           // the table's reference plus any TileRefs
+    float heights[TILE_N * TILE_N];
+};
+void releaseTile(HeightTile* tile);
+
+// counted reference that keeps a tile alive outside an EpochGuard
+class TileRef
+{
+public:
+    TileRef() = default;
+    TileRef(const TileRef& other);
+    TileRef(TileRef&& other) noexcept : tile(other.tile) { other.tile = nullptr; }
+    TileRef& operator=(TileRef other) { std::swap(tile, other.tile); return *this; }
+    ~TileRef() { if (tile) releaseTile(tile); }
+
+    // caller holds an EpochGuard that covers the lookup of tile
+    static TileRef acquire(const HeightTile* tile);
+
+    const HeightTile* get() const { return tile; }
+    const HeightTile* operator->() const { return tile; }
+    explicit operator bool() const { return tile != nullptr; }
+
+private:
+    HeightTile* tile = nullptr;
+};
+
+// resident tile map: open addressing with linear probing. lookups are
+// lock-free (callers hold an EpochGuard); writers serialize among
+// themselves and retire evicted tiles and outgrown slot arrays via epochs
+class TileTable
+{
+public:
+    TileTable();
+    ~TileTable();
+    const HeightTile* find(int level, int tileX, int tileZ) const;
+    const HeightTile* insert(HeightTile* tile);
+    bool replace(HeightTile* tile);
+    size_t evictFarthest(int centerX, int centerZ, int minX, int minZ, int maxX, int maxZ, size_t count);
+    size_t size() const { return liveCount.load(std::memory_order_relaxed); }
+    static uint64_t packKey(int level, int tileX, int tileZ);
+
+private:
+    static const uint64_t EMPTY_KEY = ~0ull;
+    static const uint64_t TOMBSTONE_KEY = ~0ull - 1;
+    struct Slot
+    {
+        std::atomic<uint64_t> key{EMPTY_KEY};
+        std::atomic<HeightTile*> tile{nullptr};
+    };
+    struct SlotArray
+    {
+        size_t mask = 0;
+        std::unique_ptr<Slot[]> slots;
+    };
+    static size_t hashKey(uint64_t key);
+    static SlotArray* makeSlots(size_t capacity);
+    void rebuild(size_t capacity);
+    void evictSlot(Slot& slot);
+
+    std::atomic<SlotArray*> current{nullptr};
+    std::mutex writeMutex;
+    std::atomic<size_t> liveCount{0};
+    size_t usedSlots = 0;                   // live + tombstones, guarded by writeMutex
+};
+
+HeightTile* generateHeightTile(int level, int tileX, int tileZ);
+void sampleHeightRow(NoiseBatchFn batch, const float* x, float z, float* heights);
+
+inline int floorDiv(int a, int b)
+{
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+// fire-and-forget coroutine; the frame frees itself when it finishes
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+class TerrainTiles;
+
+// awaitable returned by TerrainTiles::tile; resumes with an empty TileRef
+// when cancelled through its stop token
+class TileRequest
+{
+public:
+    TileRequest(TerrainTiles& tiles, int level, int tileX, int tileZ, std::stop_token stop)
+        : tiles(tiles), level(level), tileX(tileX), tileZ(tileZ), stop(std::move(stop)) {}
+    TileRequest(const TileRequest&) = delete;
+    TileRequest& operator=(const TileRequest&) = delete;
+
+    bool await_ready();
+    bool await_suspend(std::coroutine_handle<> handle);
+    TileRef await_resume() { return std::move(result); }
+
+private:
+    friend class TerrainTiles;
+    struct CancelRequest
+    {
+        TileRequest* request;
+        void operator()() const;
+    };
+
+    TerrainTiles& tiles;
+    int level, tileX, tileZ;
+    std::stop_token stop;
+    std::coroutine_handle<> handle;
+    TileRef result;
+    bool registered = false;            // guarded by TerrainTiles::pendingMutex
+    bool cancelled = false;             // guarded by TerrainTiles::pendingMutex
+    std::optional<std::stop_callback<CancelRequest>> onStop;
+};
+
+// async tile source: memory cache (tileTable), then the on-disk cache, then
+// generation on the job system. concurrent requests for one tile share a
+// single job, which is skipped if every requester cancelled before it ran.
+// at shutdown, drain() after cancelling waits until every suspended
+// requester has been resumed and run to its end, so no frame is left behind
+class TerrainTiles
+{
+public:
+    TileRequest tile(int level, int tileX, int tileZ, std::stop_token stop = {})
+    {
+        return TileRequest(*this, level, tileX, tileZ, std::move(stop));
+    }
+    void drain();
+
+private:
+    friend class TileRequest;
+    struct Pending
+    {
+        std::vector<TileRequest*> waiters;
+    };
+    bool enqueue(TileRequest* request);
+    void cancel(TileRequest* request);
+    void run(int level, int tileX, int tileZ);
+    void resumed();
+
+    std::mutex pendingMutex;
+    std::unordered_map<uint64_t, Pending> pending;
+    int suspended = 0;                  // registered requesters not yet resumed and finished
+    std::condition_variable drained;
+};
+
+HeightTile* readCachedTile(int level, int tileX, int tileZ);
+void writeCachedTile(const HeightTile& tile);
+DetachedTask prefetchTile(int level, int tileX, int tileZ, std::stop_token stop);
+
+// sculpted terrain as a sparse overlay on the procedural heights: per
+// level-0 tile, edited minus generated height, kept only for tiles that
+// were edited. tile loads add it after the disk cache (which stays
+// procedural), so edits survive eviction, regeneration and scrolling.
+// --edits FILE loads it at startup and saves it, compressed, at exit
+class EditLayer
+{
+public:
+    void record(int tileX, int tileZ, const float* before, const float* after);    // adds after - before
+    void apply(float* heights, int N, int originX, int originZ) const;              // N x N world samples
+    size_t tileCount() const;
+    bool get(int tileX, int tileZ, float* delta) const;                            // false, and zeros, if unedited
+    void set(int tileX, int tileZ, const float* delta);
+    bool save(const char* path, size_t& bytes) const;
+    bool load(const char* path);
+
+    // one tile's deltas: zero runs, then the rest as varints of each value's
+    // bits XORed with the previous value's, which share sign, exponent and
+    // high mantissa bits across a smooth edit
+    static void encode(const float* delta, std::vector<uint8_t>& out);
+    static bool decode(const uint8_t* data, size_t size, float* delta);
+
+private:
+    struct Block
+    {
+        float delta[TILE_N * TILE_N];
+    };
+    mutable std::mutex mutex;           // the sim thread writes, tile jobs read
+    std::unordered_map<uint64_t, std::unique_ptr<Block>> blocks;
+};
+
+// heightmap stamps: source patches placed on the procedural heights at any
+// position, rotation and scale. a stamp is resampled a target row at a time
+// (bilinear, zero outside the patch), then blended by a row kernel: AVX2
+// intrinsics where the CPU has them, a scalar loop otherwise. with
+// --stamps N, tile loads and the preview scatter N stamps over every
+// STAMP_CELL square and apply them after the disk cache (which stays
+// procedural), before edits
+enum StampShape : uint8_t
+{
+    STAMP_MOUNTAIN,
+    STAMP_CRATER,
+    STAMP_VALLEY,
+    STAMP_MESA,
+    STAMP_SHAPE_COUNT
+};
+
+// each mode moves a height towards its target by the sample's weight:
+// add h + value, max/min of h and value, lerp value; max, min and lerp
+// fade out towards the patch edge, lerp over the whole radius
+enum StampBlend : uint8_t
+{
+    STAMP_ADD,
+    STAMP_MAX,
+    STAMP_MIN,
+    STAMP_LERP,
+    STAMP_BLEND_COUNT
+};
+
+const int STAMP_N = 64;                 // source samples per side
+
+struct Stamp
+{
+    StampShape shape = STAMP_MOUNTAIN;
+    StampBlend blend = STAMP_ADD;
+    float x = 0.0f, z = 0.0f;           // centre, level-0 world samples
+    float rotation = 0.0f;              // radians
+    float scale = 1.0f;                 // world samples per source sample
+    float level = 0.0f;                 // base height of max, min and lerp
+    float height = 1.0f;                // height units per source unit
+};
+
+typedef void (*StampBlendFn)(float* dst, const float* value, const float* weight, int count);
+
+class StampLibrary
+{
+public:
+    StampLibrary();                     // builds the source patches
+    // heights is N x N, sample (i, j) at world sample (originX + i * step,
+    // originZ + j * step), so coarser tile levels take the same stamps
+    void apply(float* heights, int N, int originX, int originZ, int step, const Stamp* stamps, int count) const;
+
+private:
+    float shapes[STAMP_SHAPE_COUNT][STAMP_N * STAMP_N];
+    StampBlendFn blendRow[STAMP_BLEND_COUNT];
+};
+int scatterStamps(int x0, int z0, int x1, int z1, Stamp* out, int capacity);
+void applyTerrainStamps(float* heights, int N, int originX, int originZ, int step);
+void assembleTerrainHeights(float* heights, int N, int originX, int originZ);
+float terrainHeightAt(float x, float z);
+void buildChunkVertices(const float* halo, int N, float scale, std::vector<float>& vertices);
+
+// frame pipeline: input and simulation run on the main thread and hand
+// immutable frame packets through a triple buffer to the render thread. the
+// camera is not part of a packet; the render thread late-latches it
+const int NR_POINT_LIGHTS = 4;   // must match 6.multiple_lights.fs
+
+struct TerrainMesh
+{
+    std::vector<float> vertices;        // pos(3), normal(3), tex(2)
+    unsigned long long version = 0;     // unique per build, identifies the GPU copy
+    unsigned long long baseVersion = 0; // version this one is an edit of, 0 = built from scratch
+    int dirtyX0 = 0, dirtyZ0 = 0, dirtyX1 = -1, dirtyZ1 = -1;  // vertices changed since baseVersion, inclusive
+    int size = 0;                       // vertices per side
+    int originX = 0, originZ = 0;       // world sample index of local position (0, 0)
+    float lodError[3] = {};             // worst height error drawn at each LOD_STRIDES entry
+    float minY = 0.0f, maxY = 0.0f;
+    std::atomic<int> refs{0};           // 0 = free in the mesh pool
+};
+
+// chunk LOD: coarser index patterns over the same vertices. chunk edges
+// always keep every vertex, so neighbours at any level meet without cracks
+const int LOD_LEVELS = 3;
+const int LOD_STRIDES[LOD_LEVELS] = { 1, 2, 4 };
+void computeLodErrors(TerrainMesh& mesh);
+void updateChunkVertices(TerrainMesh& mesh, const float* heights, int P, int originX, int originZ, int x0, int z0, int x1, int z1, float scale);
+
+// counted handle to a pooled mesh; the last release returns it to the pool
+class MeshRef
+{
+public:
+    MeshRef() = default;
+    explicit MeshRef(TerrainMesh* mesh) : mesh(mesh) { if (mesh) mesh->refs.fetch_add(1); }
+    MeshRef(const MeshRef& other) : MeshRef(other.mesh) {}
+    MeshRef& operator=(MeshRef other) { std::swap(mesh, other.mesh); return *this; }
+    ~MeshRef() { if (mesh) mesh->refs.fetch_sub(1, std::memory_order_release); }
+
+    TerrainMesh* get() const { return mesh; }
+    TerrainMesh* operator->() const { return mesh; }
+    explicit operator bool() const { return mesh != nullptr; }
+
+private:
+    TerrainMesh* mesh = nullptr;
+};
+
+// fixed set of meshes whose vertex storage is reserved up front and reused.
+// previews need one being built, one current and one per triple buffer slot;
+// chunks need the visible set plus the sets still held by packets in flight
+const int PREVIEW_POOL_SIZE = 6;
+const int CHUNK_POOL_SIZE = 64;
+const int MAX_FRAME_MESHES = 32;
+
+template <int SIZE>
+class MeshPool
+{
+public:
+    explicit MeshPool(int verticesPerSide);
+    MeshRef acquire();
+private:
+    TerrainMesh meshes[SIZE];
+};
+
+// sim-side terrain: the progressive preview after a jump (until the tiles of
+// the new grid are resident), otherwise one mesh per visible chunk. chunk
+// (cx, cz) spans world samples [cx * TILE_N, cx * TILE_N + TILE_N] per axis
+struct TerrainView
+{
+    int originX = INT_MIN, originZ = INT_MIN;   // world sample index of grid point (0, 0)
+    MeshRef preview;
+    int chunkCount = 0;
+    int chunkX[MAX_FRAME_MESHES], chunkZ[MAX_FRAME_MESHES];
+    MeshRef chunks[MAX_FRAME_MESHES];
+};
+bool updateTerrain(TerrainView& view);
+
+// terrain sculpting: a brush edits copies of the level-0 tiles it covers,
+// which replace the resident ones (the old tiles are retired like evicted
+// ones), and adds the change to the edit layer. visible chunks get a copy of their mesh with only the vertices
+// within a sample of a changed height rewritten, and the render thread
+// patches just those rows of the resident GPU copy
+enum BrushMode : uint8_t
+{
+    BRUSH_RAISE,
+    BRUSH_LOWER,
+    BRUSH_SMOOTH,
+    BRUSH_FLATTEN,
+    BRUSH_MODE_COUNT
+};
+
+struct BrushStroke
+{
+    BrushMode mode = BRUSH_RAISE;
+    float radius = 0.0f;                // world units
+    float centerX = 0.0f, centerZ = 0.0f;   // world sample coordinates
+    float flattenHeight = 0.0f;
+};
+bool applyBrush(TerrainView& view, const BrushStroke& stroke, float dt);
+bool raycastTerrain(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, glm::vec3& hit);
+bool sculptTerrain(TerrainView& view, const InputFrame& input, float dt);
+
+// undo and redo of whole strokes (sim thread). a step holds, per tile the
+// stroke changed, the tile's edit layer deltas before XOR after, compressed
+// like the edit file: a stroke leaves most of a tile's bits alone, so that
+// is mostly zero runs. XOR is its own inverse, so undo and redo apply the
+// same step; resident tiles and visible chunks follow through the brush's
+// copy-on-write and dirty-row path. the oldest steps are dropped past
+// UNDO_MAX_STEPS or UNDO_MAX_BYTES
+class EditHistory
+{
+public:
+    void touch(int tileX, int tileZ);   // before a stroke first changes a tile
+    void endStroke();
+    bool undo(TerrainView& view);
+    bool redo(TerrainView& view);
+    size_t steps() const { return history.size(); }
+    size_t bytes() const { return historyBytes; }
+
+private:
+    struct TileStep
+    {
+        int tileX, tileZ;
+        std::vector<uint8_t> bits;      // encoded deltas before XOR after
+    };
+    struct Step
+    {
+        std::vector<TileStep> tiles;
+        size_t bytes = 0;
+    };
+    struct Snapshot
+    {
+        int tileX, tileZ;
+        std::vector<float> delta;
+    };
+    void apply(TerrainView& view, const Step& step);
+    void drop(bool oldest);
+
+    std::unordered_map<uint64_t, Snapshot> snapshots;  // deltas as the current stroke found them
+    std::deque<Step> history;
+    size_t cursor = 0;                  // steps before it are applied, the rest undone
+    size_t historyBytes = 0;
+};
+
+struct CameraState
+{
+    glm::vec3 position;
+    glm::vec3 front;
+    glm::vec3 up;
+    float zoom = 45.0f;
+    float terrainOffsetX = 0.0f, terrainOffsetZ = 0.0f;     // move with the camera
+    uint64_t inputNs = 0;               // oldest input not yet presented (profiler clock), 0 = none
+};
+
+struct FramePacket
+{
+    unsigned long long frame = 0;
+    glm::vec3 dirLightDirection;
+    glm::vec3 pointLightPositions[NR_POINT_LIGHTS];
+    MeshRef terrain[MAX_FRAME_MESHES];              // visible terrain meshes
+    int terrainCount = 0;
+};
+
+// single producer/single consumer: the writer and reader each own one slot,
+// the third is exchanged atomically together with a "fresh" flag
+template <typename T>
+class TripleBuffer
+{
+public:
+    T& writeBuffer() { return buffers[back]; }
+    const T& readBuffer() const { return buffers[front]; }
+
+    void publish()
+    {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    bool hasFresh() const { return (middle.load(std::memory_order_acquire) & FRESH) != 0; }
+
+    // swaps in the newest published packet; false if nothing new arrived
+    bool consume()
+    {
+        if (!hasFresh())
+            return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+
+private:
+    static const unsigned FRESH = 4;
+    static const unsigned INDEX_MASK = 3;
+    T buffers[3];
+    std::atomic<unsigned> middle{1};
+    unsigned back = 0;
+    unsigned front = 2;
+};
+
+// uniform locations resolved once, so the frame loop never builds names
+struct LightingUniforms
+{
+    GLint viewPos, projection, view, model;
+    GLint dirDirection, dirAmbient, dirDiffuse, dirSpecular;
+    GLint pointPosition[NR_POINT_LIGHTS], pointAmbient[NR_POINT_LIGHTS], pointDiffuse[NR_POINT_LIGHTS], pointSpecular[NR_POINT_LIGHTS];
+    GLint pointConstant[NR_POINT_LIGHTS], pointLinear[NR_POINT_LIGHTS], pointQuadratic[NR_POINT_LIGHTS];
+    GLint materialDiffuse, materialSpecular, materialShininess;
+    GLint activePointLights;
+};
+
+// first-fit allocator over [0, capacity) units of a GPU buffer; the free
+// list stays sorted by offset and neighbours merge when a range is freed
+class RangeAllocator
+{
+public:
+    void reset(size_t capacity);
+    bool allocate(size_t count, size_t& offset);
+    void free(size_t offset, size_t count);
+    size_t freeUnits() const;
+private:
+    struct Range
+    {
+        size_t offset, count;
+    };
+    std::vector<Range> freeRanges;
+};
+
+// terrain geometry on the GPU: every mesh's vertices are carved out of one
+// large VBO and every mesh size shares an index pattern in one EBO, so a
+// single VAO and base-vertex draws cover all of them. owned by the render
+// thread; idle frames compact the VBO by moving the highest block down
+class TerrainBuffers
+{
+public:
+    struct DrawRange
+    {
+        GLsizei indexCount;
+        size_t indexOffset;                 // in indices
+        GLint baseVertex;
+    };
+
+    void create();
+    void destroy();
+    bool prepare(const TerrainMesh& mesh, int stride, unsigned long long frame, DrawRange& range);
+    void endFrame(unsigned long long frame);
+    GLuint vao() const { return vertexArray; }
+
+private:
+    struct GpuMesh
+    {
+        const TerrainMesh* mesh = nullptr;  // identity only, never dereferenced
+        unsigned long long version = 0;
+        size_t vertexOffset = 0, vertexCount = 0;
+        unsigned long long lastUsed = 0;
+    };
+    struct IndexPattern
+    {
+        int size = 0, stride = 0;
+        size_t offset = 0, count = 0;
+    };
+    static const int MAX_GPU_MESHES = 128;
+    static const int MAX_INDEX_PATTERNS = 8;
+
+    const IndexPattern* indexPattern(int size, int stride);
+    void patch(GpuMesh& gpu, const TerrainMesh& mesh);
+    void release(GpuMesh& gpu);
+    void compact(int maxMoves);
+
+    GLuint vertexArray = 0, vertexBuffer = 0, indexBuffer = 0;
+    size_t vertexCapacity = 0;
+    RangeAllocator vertexSpace, indexSpace;
+    GpuMesh meshes[MAX_GPU_MESHES];
+    IndexPattern patterns[MAX_INDEX_PATTERNS];
+    bool uploadedThisFrame = false;
+};
+
+// headless rendering (--headless N): a surfaceless EGL context (Mesa's
+// llvmpipe is enough) stands in for the window, frames go to an FBO
+struct HeadlessContext
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+    GLuint framebuffer = 0, color = 0, depth = 0;
+
+    bool create();                      // main thread; leaves the context current
+    bool makeCurrent(bool current);
+    void createTarget(int width, int height);   // needs the context
+    void destroyTarget();
+    void destroy();
+};
+
+// dynamic resolution: below a render scale of 1 the scene is drawn into the
+// lower-left corner of an output-sized texture and a Catmull-Rom pass
+// (6.upscale.fs) stretches it over the output. the texture is only
+// reallocated when the output size changes, never when the scale moves
+struct SceneTarget
+{
+    GLuint framebuffer = 0, color = 0, depth = 0;
+    GLuint vao = 0;                     // empty, the upscale triangle comes from gl_VertexID
+    GLint uvScale = -1;
+    int width = 0, height = 0;          // allocated size
+
+    void create(const Shader& upscaleShader);   // render thread, with the context
+    void resize(int width, int height);
+    void upscale(const Shader& upscaleShader, GLuint output, int sceneWidth, int sceneHeight);
+    void release();                     // the target only
+    void destroy();
+};
+
+// frame capture (--capture DIR): each frame is read back into a ring of
+// pixel buffer objects behind a fence and mapped once the fence has
+// signalled, normally a frame or two later; copies are encoded to PNG or
+// PPM on the job system, so the render thread never waits on glReadPixels
+class FrameCapture
+{
+public:
+    static const int RING = 3;          // readbacks in flight
+
+    void create(const char* directory, bool png);   // render thread, with the context
+    void capture(unsigned long long frame, int width, int height);
+    void finish();                      // drains the ring and waits for the encoders
+    bool active() const { return directory != nullptr; }
+
+private:
+    struct Slot
+    {
+        GLuint pixelBuffer = 0;
+        GLsync fence = nullptr;         // pending readback
+        size_t capacity = 0;
+        unsigned long long frame = 0;
+        int width = 0, height = 0;
+    };
+    typedef std::vector<unsigned char> Pixels;
+
+    void retire(Slot& slot);            // maps, copies and hands the frame to an encoder
+    void encode(Pixels* pixels, unsigned long long frame, int width, int height);
+
+    const char* directory = nullptr;
+    bool png = true;
+    Slot slots[RING];
+    int next = 0;
+
+    std::mutex poolMutex;
+    std::condition_variable poolReady;
+    std::vector<std::unique_ptr<Pixels>> buffers;
+    std::vector<Pixels*> freeBuffers;   // guarded by poolMutex
+    int encoding = 0;                   // guarded by poolMutex
+    unsigned long long captured = 0, readbackStalls = 0, encoderStalls = 0;
+};
+
+bool writePng(const char* path, const unsigned char* rgb, int width, int height);
+bool writePpm(const char* path, const unsigned char* rgb, int width, int height);
+
+// quality governor (--target-ms N): watches the render thread's CPU time
+// and the GPU time of each frame, and walks a ladder of quality knobs to
+// hold the target. knobs give way in order and come back in reverse; a
+// knob that had to be dropped again right after coming back waits longer
+// before the next try, so the governor does not oscillate. GPU time is
+// first traded for render scale, which moves a little every frame; the
+// ladder only steps once the scale is at its floor or the GPU is not what
+// is over budget
+enum QualityKnob
+{
+    QUALITY_LOD_ERROR,                  // allowed screen-space LOD error, pixels
+    QUALITY_POINT_LIGHTS,               // point lights shaded
+    QUALITY_KNOB_COUNT
+};
+
+class QualityGovernor
+{
+public:
+    void create();                      // render thread, with the context
+    void destroy();
+    void beginFrame();
+    void endFrame(unsigned long long frame, double cpuMs, double finishMs);
+    float value(QualityKnob knob) const;
+    void setLevel(QualityKnob knob, int level);     // before the thread starts, or on it
+    float renderScale() const { return scale; }
+
+private:
+    static const int QUERY_PAIRS = 4;
+    void step(unsigned long long frame, bool degrade);
+    void adjustScale(double gpuEstimateMs);
+
+    GLuint queries[QUERY_PAIRS][2] = {};
+    bool pending[QUERY_PAIRS] = {};
+    int current = 0;
+    double gpuMs = 0.0;                 // latest completed frame
+    double smoothedMs = 0.0;
+    double smoothedGpuMs = 0.0;
+    float scale = 1.0f;                 // render scale, per axis
+    bool dynamicScale = false;
+    int level[QUALITY_KNOB_COUNT] = {};
+    int overFrames = 0, underFrames = 0;
+    int upgradeWait = 0;                // frames under target before the next upgrade
+    unsigned long long lastChange = 0, lastUpgrade = 0;
+    bool upgraded = false;
+};
+
+// on-demand rendering (windowed, unless --continuous): the render thread
+// remembers what its last drawn frame was made of and skips packets that
+// would draw the same picture. the sim thread sleeps in glfwWaitEvents while
+// nothing moves, so an idle viewer wakes only for input and the heartbeat
+class FrameDamage
+{
+public:
+    // true if the packet differs from the last drawn frame, or the heartbeat is due
+    bool needsRedraw(const FramePacket& packet, const CameraState& camera, int width, int height);
+    void drawn(bool complete, const CameraState& camera);  // complete is false if meshes were skipped, so the next packet redraws
+
+private:
+    struct MeshKey
+    {
+        const TerrainMesh* mesh;
+        unsigned long long version;
+    };
+
+    CameraState camera;
+    glm::vec3 dirLightDirection = glm::vec3(0.0f);
+    glm::vec3 pointLightPositions[NR_POINT_LIGHTS] = {};
+    MeshKey meshes[MAX_FRAME_MESHES] = {};
+    int meshCount = 0;
+    float quality[QUALITY_KNOB_COUNT + 1] = {};     // knobs, then render scale
+    int width = 0, height = 0;
+    bool incomplete = true;
+    std::chrono::steady_clock::time_point lastDraw;
+};
+
+// input-to-photon latency: input is stamped where it arrives (the mouse and
+// scroll callbacks, key sampling in processInput) and the oldest stamp of a
+// sim frame rides along with the latched camera. the render thread records
+// it against the frame's submission, the return of the swap and a fence
+// behind the frame. fences are only polled, once a frame, so GPU completion
+// is an upper bound; --low-latency waits on them to bound frames in flight
+class LatencyTracker
+{
+public:
+    static const int RING = 4;          // frames fenced
+
+    void submitted(uint64_t inputNs);   // the frame's commands are issued
+    void presented();                   // after the swap or finish: fences the frame
+    void poll();                        // retires frames whose fence has signalled
+    void throttle(int maxInFlight);     // waits until at most this many frames are unfinished
+    void destroy();                     // waits for the rest
+
+private:
+    struct Frame
+    {
+        GLsync fence = nullptr;
+        uint64_t inputNs = 0;           // 0 = shows no new input
+    };
+    void retire(Frame& frame);
+
+    Frame frames[RING];
+    int next = 0;
+    uint64_t frameInputNs = 0;
+};
+
+// movement keys held in a frame, as a bit mask
+enum MoveKey : unsigned
+{
+    KEY_W = 1, KEY_S = 2, KEY_A = 4, KEY_D = 8,
+    KEY_UP = 16, KEY_DOWN = 32, KEY_LEFT = 64, KEY_RIGHT = 128,
+};
+
+// edit history key presses, at most one per frame
+enum HistoryAction : uint8_t
+{
+    HISTORY_NONE,
+    HISTORY_UNDO,                       // ctrl+z
+    HISTORY_REDO,                       // ctrl+y, ctrl+shift+z
+};
+
+// input of one sim frame; mouse and scroll are summed over the frame
+struct InputFrame
+{
+    uint8_t keys = 0;                   // MoveKey bits
+    float mouseX = 0.0f, mouseY = 0.0f; // camera offsets, as mouse_callback computes them
+    float scroll = 0.0f;
+    uint8_t brush = 0;                  // BrushMode + 1 while a mouse button is held, 0 = none
+    float brushRadius = 0.0f;           // world units
+    uint8_t history = 0;                // HistoryAction
+    float dt = 0.0f;                    // sim step of a recorded frame, seconds; 0 = FIXED_TIMESTEP
+};
+
+// recorded camera path (--record FILE / --replay FILE): the starting state
+// and one InputFrame per sim frame with the step it ran, so a replay flies
+// exactly the recorded path at the recorded speed, whatever rate the window
+// ran at. File layout (little-endian):
+//   "TPTH", u32 version, f32 timestep, f32 x 8 start state, u32 frame count,
+//   per frame: u8 keys, u8 flags (1 = mouse, 2 = scroll, 4 = brush, 8 = history),
+//   f32 dt, f32 x 2 mouse, f32 scroll, u8 brush, f32 brush radius, u8 history.
+//   version 1 files have no brush, version 2 no history, versions before 4
+//   no dt (every frame took the header's timestep)
+struct InputRecording
+{
+    glm::vec3 position = glm::vec3(0.0f);
+    float yaw = 0.0f, pitch = 0.0f, zoom = 0.0f;
+    float offsetX = 0.0f, offsetZ = 0.0f;
+    std::vector<InputFrame> frames;
+
+    void captureStart();
+    void applyStart() const;
+    bool save(const char* path) const;
+    bool load(const char* path);
+};
+
+// per-frame timings (--frame-csv FILE), for comparing runs path-for-path;
+// sized before the threads start, sim and render fill their own fields
+struct FrameTiming
+{
+    float simMs = 0.0f, renderMs = 0.0f;
+    int chunks = 0;
+    unsigned tiles = 0;
+    unsigned long long uploadBytes = 0;
+};
+
+bool writeFrameTimings(const char* path, unsigned long long frames);
+
+GLFWwindow* openWindow();
+void printHeadlessReport(double seconds);
+void renderThreadMain(GLFWwindow* window);
+void resolveLightingUniforms(const Shader& shader, LightingUniforms& u);
+bool renderFrame(Shader& shader, const LightingUniforms& u, const FramePacket& packet, CameraState& camera, TerrainBuffers& terrain, unsigned long long frame);
+CameraState simCamera();
+void latchCamera();
+
+// settings
+const unsigned int SCR_WIDTH = 1280;
+const unsigned int SCR_HEIGHT = 720;
+
+// camera
+Camera camera(glm::vec3(0.0f, 50.0f, 100.0f));
+float lastX = SCR_WIDTH / 2.0f;
+float lastY = SCR_HEIGHT / 2.0f;
+bool firstMouse = true;
+
+// timing
+float deltaTime = 0.0f;
+float lastFrame = 0.0f;
+
+// terrain state
+const int GRID_MAX_N = 256;             // largest grid; pools and frame packets are sized for it
+int gridN = GRID_MAX_N;                 // grid points per side, from the calibration profile
+float terrainScale = 0.5f;              // distance between grid points
+float terrainAmplitude = 30.0f;        // max height
+float terrainFreq = 0.02f;             // base frequency
+float terrainOffsetX = 0.0f;           // moves when pressing WASD/arrows
+float terrainOffsetZ = 0.0f;
+
+// terrain noise
+const int TERRAIN_OCTAVES = 6;
+const float TERRAIN_PERSISTENCE = 0.5f;
+const float TERRAIN_LACUNARITY = 2.0f;
+NoiseBatchFn tileNoiseBatch = nullptr;      // row-at-a-time tile generation (calibration profile); nullptr = per sample
+
+// progressive refinement schedule (lattice step, octaves) and per-frame budget
+const int REFINE_LEVELS = 4;
+const int REFINE_STEP[REFINE_LEVELS] = { 8, 4, 2, 1 };
+const int REFINE_OCTAVES[REFINE_LEVELS] = { 3, 4, 5, TERRAIN_OCTAVES };
+const double REFINE_BUDGET_MS = 4.0;
+const float REFINE_JUMP = 0.25f;            // offset change (world units per grid point) that restarts refinement
+TerrainRefinement terrainRefinement;
+
+// height tile cache
+const int TILE_TABLE_CAPACITY = 1024;       // initial slots, power of two
+const int TILE_KEEP_MARGIN = 2;             // tiles around the grid never evicted for the budget
+const char* const TILE_CACHE_DIR = "tile_cache";
+bool tileDiskCache = true;                  // off for --bench: no tile files read or left behind
+JobSystem jobSystem;
+EpochManager tileEpochs;
+TileTable tileTable;
+TerrainTiles terrainTiles;
+std::stop_source tilePrefetchStop;
+EditLayer editLayer;
+const char* editsPath = nullptr;            // --edits FILE, loaded at startup and written at exit
+std::string editsSavePath;                  // editsPath, or a new file beside one that did not load
+
+// terrain stamps
+StampLibrary stampLibrary;
+int stampDensity = 0;                       // --stamps N: stamps per STAMP_CELL square, 0 = none
+const int STAMP_CELL = 256;                 // world samples per side of a scatter cell
+const float STAMP_MIN_SCALE = 0.25f;        // scattered patches span 16 to 64 samples
+const float STAMP_MAX_SCALE = 1.0f;
+const int STAMP_REACH = (int)(STAMP_MAX_SCALE * (STAMP_N - 1) * 0.5f * 1.4143f) + 1;  // samples from a stamp's centre to its farthest corner
+const float STAMP_EDGE = 2.0f;              // max/min fade over the outer half of the radius squared
+
+// terrain GPU heap (owned by the render thread); the vertex capacity
+// follows the gpu-terrain budget, this is its default
+const size_t TERRAIN_VERTEX_CAPACITY = 1u << 19;
+const size_t TERRAIN_INDEX_CAPACITY = 1u << 19;
+const size_t TERRAIN_MIN_VERTEX_CAPACITY = 1u << 18;    // smaller budgets are raised to this, with a warning
+const unsigned long long GPU_MESH_KEEP_FRAMES = 4;  // unused meshes are freed after this
+const int GPU_COMPACT_MOVES = 2;                    // blocks moved per idle frame
+TerrainBuffers terrainBuffers;
+
+// lights
+glm::vec3 dirLightDirection(-0.2f, -1.0f, -0.3f);
+glm::vec3 pointLightPositions[NR_POINT_LIGHTS] = {
+    glm::vec3( 50.0f,  60.0f,  50.0f),
+    glm::vec3( 100.0f,  80.0f, -40.0f),
+    glm::vec3(-60.0f,  70.0f, -120.0f),
+    glm::vec3( 0.0f,   65.0f, -50.0f)
+};
+
+// frame pipeline state
+MemoryBudget memoryBudget;                  // before the pools, which charge it
+MeshPool<PREVIEW_POOL_SIZE> previewPool(GRID_MAX_N);
+MeshPool<CHUNK_POOL_SIZE> chunkPool(TILE_N + 1);
+unsigned long long terrainMeshVersion = 0;      // sim thread only
+TripleBuffer<FramePacket> framePackets;
+std::mutex frameSyncMutex;
+std::condition_variable packetPublished;    // sim -> render
+std::condition_variable frameRendered;      // render -> sim
+unsigned long long framesRendered = 0;      // guarded by frameSyncMutex
+bool renderThreadQuit = false;              // guarded by frameSyncMutex
+const auto SIM_MAX_WAIT = std::chrono::milliseconds(4);
+
+// headless
+HeadlessContext headless;
+int headlessFrames = 0;                     // --headless N, 0 = windowed
+const float FIXED_TIMESTEP = 1.0f / 60.0f;  // headless runs and replays of version 1-3 recordings
+const unsigned HEADLESS_KEYS = KEY_W;       // fly forward over streaming terrain
+
+// camera paths and per-frame timings
+InputRecording inputRecording;
+InputFrame pendingInput;                    // mouse and scroll since the last sim frame
+const char* recordPath = nullptr;           // --record FILE, written at exit
+const char* replayPath = nullptr;           // --replay FILE, flown headless
+const char* frameCsvPath = nullptr;         // --frame-csv FILE, written at exit
+std::vector<FrameTiming> frameTimings;      // indexed by frame - 1
+const size_t FRAME_LOG_MAX = 1 << 18;       // frames logged by windowed runs
+
+// quality governor (render thread)
+QualityGovernor qualityGovernor;
+float qualityTargetMs = 0.0f;               // --target-ms N, 0 = fixed best quality
+const float GOVERNOR_DEGRADE_RATIO = 1.05f; // smoothed cost above target * this drops quality
+const float GOVERNOR_UPGRADE_RATIO = 0.75f; // and below target * this restores it
+const int GOVERNOR_DEGRADE_FRAMES = 10;
+const int GOVERNOR_UPGRADE_FRAMES = 90;
+const int GOVERNOR_MAX_UPGRADE_FRAMES = 90 * 16;
+const int GOVERNOR_COOLDOWN_FRAMES = 30;    // after any change, let the cost settle
+const float GOVERNOR_SMOOTHING = 0.1f;      // weight of the newest frame
+float fixedRenderScale = 0.0f;              // --render-scale S, 0 = dynamic with --target-ms
+const float DYNRES_MIN_SCALE = 0.5f;        // a quarter of the pixels
+const float DYNRES_HEADROOM = 0.9f;         // aim the GPU at this share of the target
+const float DYNRES_GAIN = 0.2f;             // share of the correction applied per frame
+const float DYNRES_DEADBAND = 0.02f;        // scale changes smaller than this are skipped
+
+// dynamic resolution
+SceneTarget sceneTarget;                    // render thread
+
+// input latency
+LatencyTracker latencyTracker;              // render thread
+uint64_t pendingInputNs = 0;                // first mouse or scroll event since the last sim frame
+uint64_t frameInputNs = 0;                  // the current sim frame's input stamp, 0 = no input
+bool lowLatency = false;                    // --low-latency
+const int LOW_LATENCY_MAX_IN_FLIGHT = 1;    // unfinished frames when the next input is sampled
+
+// on-demand rendering
+bool continuousRendering = false;           // --continuous: redraw every frame
+FrameDamage frameDamage;                    // render thread
+std::atomic<bool> redrawRequested{false};   // window exposed; set by the refresh callback
+std::atomic<bool> redrawPending{false};     // last draw was incomplete, keep the sim awake
+const double REDRAW_HEARTBEAT_S = 1.0;      // idle redraw period, and the longest event wait
+
+// sculpting (sim thread)
+BrushMode brushMode = BRUSH_RAISE;          // keys 1-4
+float brushRadius = 6.0f;                   // [ and ], world units
+const float BRUSH_MIN_RADIUS = 1.0f;
+const float BRUSH_MAX_RADIUS = 24.0f;       // a stroke then edits at most 3 x 3 chunks
+const float BRUSH_RADIUS_STEP = 1.25f;      // per key press
+const float BRUSH_RATE = 8.0f;              // raise/lower, height units per second at the centre
+const float BRUSH_BLEND_RATE = 6.0f;        // smooth/flatten, share of the gap closed per second at the centre
+const float BRUSH_RAY_DISTANCE = 150.0f;    // farthest terrain a brush reaches
+bool brushStroking = false;                 // a mouse button was held last frame
+float brushFlattenHeight = 0.0f;            // taken where the stroke started
+EditHistory editHistory;
+const size_t UNDO_MAX_STEPS = 256;
+const size_t UNDO_MAX_BYTES = 4u << 20;     // encoded steps
+
+// calibration
+bool calibrating = false;                   // --calibrate
+bool useCalibration = true;                 // --no-calibration ignores the stored profile
+unsigned workerThreads = 0;                 // from the profile, 0 = cores - 2
+const char* const CALIBRATION_DIR = "calibration";
+const int CALIBRATE_TILES = 32;             // tiles per generation timing
+const int CALIBRATE_REPEATS = 3;            // timings per candidate, the best counts
+const double CALIBRATE_GRID_BUDGET_MS = 400.0;      // full grid rebuild after a jump
+const double CALIBRATE_FRAME_MS = 1000.0 / 60.0;    // render budget without --target-ms
+const int CALIBRATE_WARMUP_FRAMES = 30;     // render sweep: frames before any timing
+const int CALIBRATE_LEVEL_FRAMES = 20;      // timed frames per LOD level
+std::vector<float> calibrationFrameMs;      // render sweep, indexed by frame - 1
+
+// frame capture
+FrameCapture frameCapture;                  // render thread
+const char* captureDirectory = nullptr;     // --capture DIR
+bool capturePng = true;                     // --capture-format png|ppm
+
+// profiling
+Profiler profiler;
+GpuProfiler gpuProfiler;                    // render thread only
+const char* traceOutputPath = nullptr;      // --trace FILE, written at exit
+float hitchThresholdMs = 50.0f;             // --hitch-ms N, 0 disables dumps
+std::atomic<int> hitchDumps{0};             // sim and render threads
+const int HITCH_MAX_DUMPS = 20;             // per run
+const uint64_t HITCH_WINDOW_NS = 3000000000ull;
+bool perfCountersEnabled = false;           // --perf
+const int MAX_PERF_STAGES = 16;
+
+// benchmarks
+bool benchMode = false;
+const char* benchFilter = nullptr;
+const char* benchOutputPath = nullptr;
+const char* benchBaselinePath = nullptr;
+const double BENCH_WARMUP_SECONDS = 0.2;
+const double BENCH_SAMPLE_SECONDS = 0.02;   // each sample repeats the body at least this long
+const int BENCH_SAMPLES = 15;
+const double BENCH_REGRESSION = 0.05;       // slowdown flagged when confidence intervals also separate
+const int NOISE_QUALITY_N = 128;            // grid side for noise quality checks
+const float NOISE_QUALITY_STEP = 0.125f;    // grid spacing in lattice units
+const float NOISE_MIN_ISOTROPY = 0.8f;
+const float NOISE_MAX_TOP_BAND = 0.1f;      // energy above a quarter of the sample rate hints at aliasing
+const float NOISE_BAND_TOLERANCE = 0.03f;   // allowed band drift against a baseline
+const float NOISE_STDDEV_TOLERANCE = 0.1f;  // allowed relative stddev drift against a baseline
+
+// metrics
+Metrics metrics;
+MetricsServer metricsServer;
+int metricsPort = 0;                        // --metrics-port N, 0 = no endpoint
+bool metricsOverlay = false;                // --overlay, stats in the window title
+const double METRICS_OVERLAY_INTERVAL = 0.5;
+const int METRICS_REQUEST_TIMEOUT_MS = 250; // a client silent for longer is dropped
+
+// memory
+const size_t FRAME_ARENA_BYTES = 8u << 20;  // per thread
+const char* const MEMORY_BUDGET_ENV = "TERRAIN_MEM_BUDGET";
+const unsigned long long ALLOC_WARMUP_FRAMES = 120;
+
+// late-latched camera: published by the sim thread after every input poll,
+// read by the render thread right before it builds the view matrix. its
+// input stamp stays until the frame that latched it has been presented;
+// input arriving in between waits in inputNsAfterLatch
+std::mutex cameraMutex;
+CameraState latchedCamera;
+bool inputLatched = false;                  // guarded by cameraMutex
+uint64_t inputNsAfterLatch = 0;             // guarded by cameraMutex
+std::atomic<int> framebufferWidth{SCR_WIDTH}, framebufferHeight{SCR_HEIGHT};
+
+static void printUsage(const char* program)
+{
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --mem-budget NAME=SIZE[,...]   memory budgets (tiles, gpu-terrain, ...), e.g. tiles=256M\n"
+              << "  --trace FILE                   write a Chrome trace at exit\n"
+              << "  --hitch-ms N                   dump hitch_N.json for frames over N ms (0 = off)\n"
+              << "  --metrics-port N               serve Prometheus metrics on 127.0.0.1:N\n"
+              << "  --overlay                      show frame statistics in the window title\n"
+              << "  --perf                         sample hardware counters (Linux)\n"
+              << "  --bench                        run the benchmarks instead of the viewer\n"
+              << "  --bench-filter TEXT            only benchmarks whose name contains TEXT\n"
+              << "  --bench-out FILE               write benchmark results as JSON\n"
+              << "  --bench-baseline FILE          compare against earlier results, exit 1 on regression\n"
+              << "  --headless N                   render N frames offscreen (surfaceless EGL) and report timings\n"
+              << "  --edits FILE                   load terrain edits from FILE and save them there at exit\n"
+              << "  --stamps N                     scatter N mountains, craters, valleys and mesas per 256 x 256 samples\n"
+              << "  --record FILE                  record the camera path (fixed timestep) to FILE\n"
+              << "  --replay FILE                  fly a recorded path headless and report timings\n"
+              << "  --frame-csv FILE               write per-frame timings as CSV at exit\n"
+              << "  --capture DIR                  save every rendered frame to DIR (read back asynchronously)\n"
+              << "  --capture-format png|ppm       image format for --capture (default png)\n"
+              << "  --target-ms N                  adapt quality to hold N ms per frame\n"
+              << "  --render-scale S               render at S (0.25-1) of the output size and upscale\n"
+              << "  --continuous                   redraw every frame, even when nothing changed\n"
+              << "  --low-latency                  sample input once the GPU is at most a frame behind\n"
+              << "  --calibrate                    benchmark this host and store a settings profile for it\n"
+              << "  --no-calibration               ignore the stored settings profile" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    // memory budgets: defaults from the machine, then the environment, then
+    // the command line (--mem-budget tiles=256M,gpu-terrain=64M)
+    setDefaultMemoryBudgets();
+    if (const char* env = std::getenv(MEMORY_BUDGET_ENV))
+        if (!memoryBudget.configure(env))
+            std::cout << "Ignoring invalid " << MEMORY_BUDGET_ENV << ": " << env << std::endl;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc && memoryBudget.configure(argv[i + 1]))
+        {
+            ++i;
+            continue;
+        }
+        if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            traceOutputPath = argv[++i];
+            continue;
+        }
+        if (std::strcmp(argv[i], "--hitch-ms") == 0 && i + 1 < argc)
+        {
+            hitchThresholdMs = (float)std::atof(argv[++i]);
+            continue;
+        }
+        if (std::strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc)
+        {
+            metricsPort = std::atoi(argv[++i]);
+            continue;
+        }
+        if (std::strcmp(argv[i], "--overlay") == 0)
+        {
+            metricsOverlay = true;
+            continue;
+        }
+        if (std::strcmp(argv[i], "--perf") == 0)
+        {
+            perfCountersEnabled = true;
+            continue;
+        }
+        if (std::strcmp(argv[i], "--bench") == 0)
+        {
+            benchMode = true;
+            continue;
+        }
+        if (std::strcmp(argv[i], "--bench-filter") == 0 && i + 1 < argc)
+        {
+            benchFilter = argv[++i];
+            continue;
+        }
+        if (std::strcmp(argv[i], "--bench-out") == 0 && i + 1 < argc)
+        {
+            benchOutputPath = argv[++i];
+            continue;
+        }
+        if (std::strcmp(argv[i], "--bench-baseline") == 0 && i + 1 < argc)
+        {
+            benchBaselinePath = argv[++i];
+            continue;
+        }
+        if (std::strcmp(argv[i], "--headless") == 0 && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+        {
+            headlessFrames = std::atoi(argv[++i]);
+            continue;
+        }
+        if (std::strcmp(argv[i], "--edits") == 0 && i + 1 < argc)
+        {
+            editsPath = argv[++i];
+            continue;
+        }
+        if (std::strcmp(argv[i], "--stamps") == 0 && i + 1 < argc)
+        {
+            stampDensity = std::max(0, std::atoi(argv[++i]));
+            continue;
+        }
+        if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            recordPath = argv[++i];
+            continue;
+        }
+        if (std::strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            replayPath = argv[++i];
+            continue;
+        }
+        if (std::strcmp(argv[i], "--frame-csv") == 0 && i + 1 < argc)
+        {
+            frameCsvPath = argv[++i];
+            continue;
+        }
+        if (std::strcmp(argv[i], "--target-ms") == 0 && i + 1 < argc)
+        {
+            qualityTargetMs = (float)std::atof(argv[++i]);
+            continue;
+        }
+        if (std::strcmp(argv[i], "--calibrate") == 0)
+        {
+            calibrating = true;
+            continue;
+        }
+        if (std::strcmp(argv[i], "--no-calibration") == 0)
+        {
+            useCalibration = false;
+            continue;
+        }
+        if (std::strcmp(argv[i], "--low-latency") == 0)
+        {
+            lowLatency = true;
+            continue;
+        }
+        if (std::strcmp(argv[i], "--continuous") == 0)
+        {
+            continuousRendering = true;
+            continue;
+        }
+        if (std::strcmp(argv[i], "--render-scale") == 0 && i + 1 < argc)
+        {
+            fixedRenderScale = std::clamp((float)std::atof(argv[++i]), 0.25f, 1.0f);
+            continue;
+        }
+        if (std::strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+        {
+            captureDirectory = argv[++i];
+            continue;
+        }
+        if (std::strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc &&
+            (std::strcmp(argv[i + 1], "png") == 0 || std::strcmp(argv[i + 1], "ppm") == 0))
+        {
+            capturePng = std::strcmp(argv[++i], "png") == 0;
+            continue;
+        }
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (recordPath && (replayPath || headlessFrames > 0))
+    {
+        std::cout << "--record needs the window" << std::endl;
+        return -1;
+    }
+
+    // calibration sweeps the LOD levels headless, camera held still, with
+    // the governor off; its budget is the target frame time
+    double calibrationBudgetMs = qualityTargetMs > 0.0f ? qualityTargetMs : CALIBRATE_FRAME_MS;
+    if (calibrating)
+    {
+        headlessFrames = calibrationSweepFrames();
+        calibrationFrameMs.assign(headlessFrames, 0.0f);
+        qualityTargetMs = 0.0f;
+        replayPath = recordPath = nullptr;
+    }
+
+    // a replay runs headless for exactly the recorded frames
+    if (replayPath)
+    {
+        if (!inputRecording.load(replayPath) || inputRecording.frames.empty())
+        {
+            std::cout << "Cannot read camera path " << replayPath << std::endl;
+            return -1;
+        }
+        headlessFrames = (int)inputRecording.frames.size();
+        inputRecording.applyStart();
+    }
+    if (frameCsvPath)
+        frameTimings.resize(headlessFrames > 0 ? (size_t)headlessFrames : FRAME_LOG_MAX);
+
+    PROFILE_THREAD("main");
+
+    // benchmarks run without a window
+    if (benchMode)
+        return runBenchmarks();
+
+    // a window, or a surfaceless context without one
+    GLFWwindow* window = nullptr;
+    std::string glRenderer;
+    if (headlessFrames > 0)
+    {
+        if (!headless.create())
+        {
+            std::cout << "Failed to create a headless EGL context" << std::endl;
+            return -1;
+        }
+        if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress))
+        {
+            std::cout << "Failed to initialize GLAD" << std::endl;
+            return -1;
+        }
+        glRenderer = (const char*)glGetString(GL_RENDERER);
+        headless.makeCurrent(false);
+    }
+    else
+    {
+        window = openWindow();
+        if (!window)
+            return -1;
+        if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+        {
+            std::cout << "Failed to initialize GLAD" << std::endl;
+            return -1;
+        }
+        glRenderer = (const char*)glGetString(GL_RENDERER);
+        glfwMakeContextCurrent(NULL);
+    }
+    // the GL context belongs to the render thread from here on
+
+    // host settings: measured now, or from this hardware's stored profile
+    std::string fingerprint = hardwareFingerprint();
+    std::string profilePath = calibrationPath(fingerprint);
+    CalibrationProfile profile;
+    if (calibrating)
+    {
+        calibrateGeneration(profile);
+        applyCalibration(profile);
+    }
+    else if (useCalibration && profile.load(profilePath, fingerprint))
+    {
+        applyCalibration(profile);
+        std::cout << "Applied calibration profile " << profilePath;
+        if (!profile.renderer.empty() && profile.renderer != glRenderer)
+            std::cout << " (measured on " << profile.renderer << ")";
+        std::cout << std::endl;
+    }
+
+    // terrain workers; the main and render threads keep a core each
+    unsigned cores = std::thread::hardware_concurrency();
+    jobSystem.start(workerThreads ? workerThreads : cores > 3 ? cores - 2 : 1);
+
+    // earlier sculpting, before any tile is loaded
+    if (editsPath)
+        editsSavePath = editsPath;
+    if (editsPath && std::filesystem::exists(editsPath))
+    {
+        if (editLayer.load(editsPath))
+        {
+            std::cout << "Loaded " << editLayer.tileCount() << " edited tiles from " << editsPath << std::endl;
+        }
+        else
+        {
+            // never overwrite a file we could not read
+            editsSavePath += ".new";
+            std::cout << "Ignoring " << editsPath << ": not an edit file for this terrain; edits will be saved to " << editsSavePath << std::endl;
+        }
+    }
+
+    // initial terrain data: a coarse preview right away, refined in the sim
+    // loop until the chunks' tiles have streamed in
+    TerrainView terrainView;
+    updateTerrain(terrainView);
+
+    latchCamera();
+    std::thread renderThread(renderThreadMain, window);
+    if (metricsPort > 0 && metricsServer.start(metricsPort))
+        std::cout << "Metrics on http://127.0.0.1:" << metricsPort << "/metrics" << std::endl;
+
+    // simulation loop: input, terrain updates and frame packets
+    unsigned long long frame = 0;
+    unsigned long long lastRendered = 0;
+    auto runStart = std::chrono::steady_clock::now();
+    auto runTime = [&] { return window ? static_cast<float>(glfwGetTime())
+                                       : std::chrono::duration<float>(std::chrono::steady_clock::now() - runStart).count(); };
+    if (recordPath)
+        inputRecording.captureStart();
+    bool simIdle = false;
+    while (window ? !glfwWindowShouldClose(window) : frame < (unsigned long long)headlessFrames)
+    {
+        // nothing moved last frame: sleep until input or the redraw
+        // heartbeat instead of spinning; the wait is not frame time
+        if (simIdle)
+        {
+            PROFILE_ZONE("idle wait");
+            glfwWaitEventsTimeout(REDRAW_HEARTBEAT_S);
+            lastFrame = runTime();
+        }
+        float currentFrame = runTime();
+        deltaTime = currentFrame - lastFrame;
+        lastFrame = currentFrame;
+        checkHitch("sim", frame, deltaTime, simCamera());
+        if (frame > 0)
+            metrics.simFrameUs.record((uint64_t)(deltaTime * 1e6f));
+        if (frame > 0 && frame <= frameTimings.size())
+            frameTimings[frame - 1].simMs = deltaTime * 1000.0f;
+        metrics.frames.fetch_add(1, std::memory_order_relaxed);
+        if (metricsOverlay && window)
+            updateMetricsOverlay(window);
+
+        if (window)
+            glfwPollEvents();
+        if (frame == ALLOC_WARMUP_FRAMES)
+            allocChecksArmed = true;
+
+        HotPathScope hotPath("sim frame");
+        PROFILE_ZONE("sim frame");
+        InputFrame input;
+        if (window)
+        {
+            input = processInput(window);
+        }
+        else
+        {
+            if (replayPath)
+                input = inputRecording.frames[frame];
+            else if (!calibrating)
+                input.keys = HEADLESS_KEYS;
+            bool any = input.keys || input.mouseX != 0.0f || input.mouseY != 0.0f || input.scroll != 0.0f || input.brush || input.history;
+            frameInputNs = any ? profiler.now() : 0;
+        }
+        // the window runs at its own rate and a recording keeps each frame's
+        // step; headless runs and old recordings take the fixed step
+        if (!window)
+            deltaTime = input.dt > 0.0f ? input.dt : FIXED_TIMESTEP;
+        if (recordPath)
+        {
+            AllowAllocations recording;
+            input.dt = deltaTime;
+            inputRecording.frames.push_back(input);
+        }
+        applyInput(input, deltaTime);
+        if (frameInputNs)
+            metrics.inputToSimUs.record((profiler.now() - frameInputNs) / 1000);
+        latchCamera();
+
+        bool terrainChanged = updateTerrain(terrainView);
+        if (sculptTerrain(terrainView, input, deltaTime))
+            terrainChanged = true;
+        PROFILE_COUNTER("tiles resident", tileTable.size());
+        PROFILE_COUNTER("tile cache bytes", memoryBudget.used(MEM_TILE_CACHE));
+        PROFILE_COUNTER("visible chunks", terrainView.chunkCount);
+        if (frame < frameTimings.size())
+        {
+            frameTimings[frame].chunks = terrainView.chunkCount;
+            frameTimings[frame].tiles = (unsigned)tileTable.size();
+        }
+
+        FramePacket& packet = framePackets.writeBuffer();
+        packet.frame = ++frame;
+        packet.dirLightDirection = dirLightDirection;
+        for (int i = 0; i < NR_POINT_LIGHTS; ++i)
+            packet.pointLightPositions[i] = pointLightPositions[i];
+        packet.terrainCount = 0;
+        if (terrainView.preview)
+            packet.terrain[packet.terrainCount++] = terrainView.preview;
+        for (int i = 0; i < terrainView.chunkCount; ++i)
+            packet.terrain[packet.terrainCount++] = terrainView.chunks[i];
+        for (int i = packet.terrainCount; i < MAX_FRAME_MESHES && packet.terrain[i]; ++i)
+            packet.terrain[i] = MeshRef();
+        framePackets.publish();
+
+        // wait for the render thread to take a frame, but never so long that
+        // input sampling stalls behind a slow GPU; headless runs go in
+        // lockstep so every simulated frame is rendered. --low-latency waits
+        // too: the render thread answers once the GPU has caught up, so the
+        // next input is sampled as late as it can be
+        std::unique_lock<std::mutex> lock(frameSyncMutex);
+        packetPublished.notify_one();
+        if (window && !lowLatency)
+            frameRendered.wait_for(lock, SIM_MAX_WAIT, [&] { return framesRendered != lastRendered; });
+        else if (window)
+            frameRendered.wait(lock, [&] { return framesRendered != lastRendered; });
+        else
+            frameRendered.wait(lock, [&] { return framesRendered == frame; });
+        lastRendered = framesRendered;
+
+        // idle needs a still camera, settled terrain and a complete last draw
+        bool still = !input.keys && input.mouseX == 0.0f && input.mouseY == 0.0f && input.scroll == 0.0f && !input.brush && !input.history;
+        simIdle = window && !continuousRendering && still && !terrainChanged && !terrainView.preview &&
+                  !redrawPending.load(std::memory_order_relaxed);
+    }
+    if (frame > 0 && frame <= frameTimings.size())
+        frameTimings[frame - 1].simMs = (runTime() - lastFrame) * 1000.0f;
+
+    {
+        std::lock_guard<std::mutex> lock(frameSyncMutex);
+        renderThreadQuit = true;
+    }
+    packetPublished.notify_one();
+    renderThread.join();
+    if (!window)
+        printHeadlessReport(std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count());
+    if (calibrating)
+    {
+        profile.lodPixelError = pickCalibratedLod(calibrationBudgetMs);
+        profile.renderer = glRenderer;
+        if (profile.save(profilePath, fingerprint))
+            std::cout << "Calibration profile written to " << profilePath << std::endl;
+        else
+            std::cout << "Failed to write calibration profile " << profilePath << std::endl;
+    }
+    if (recordPath)
+    {
+        if (inputRecording.save(recordPath))
+            std::cout << "Camera path (" << inputRecording.frames.size() << " frames) written to " << recordPath << std::endl;
+        else
+            std::cout << "Failed to write camera path " << recordPath << std::endl;
+    }
+    if (frameCsvPath && !writeFrameTimings(frameCsvPath, frame))
+        std::cout << "Failed to write " << frameCsvPath << std::endl;
+    metricsServer.stop();
+    tilePrefetchStop.request_stop();
+    terrainTiles.drain();
+    jobSystem.stop();
+    if (editsPath && editLayer.tileCount() > 0)
+    {
+        size_t editBytes = 0;
+        if (editLayer.save(editsSavePath.c_str(), editBytes))
+            std::cout << editLayer.tileCount() << " edited tiles (" << editBytes / 1024 << " KB, " << memoryBudget.used(MEM_EDITS) / 1024
+                      << " KB in memory) written to " << editsSavePath << std::endl;
+        else
+            std::cout << "Failed to write " << editsSavePath << std::endl;
+    }
+    printMemoryStats();
+    printLatencyStats(std::cout);
+    if (perfCountersEnabled)
+        printPerfStats(std::cout);
+    if (traceOutputPath)
+    {
+        if (profiler.writeChromeTrace(traceOutputPath))
+            std::cout << "Trace written to " << traceOutputPath << std::endl;
+        else
+            std::cout << "Failed to write trace " << traceOutputPath << std::endl;
+    }
+
+    if (window)
+        glfwTerminate();
+    else
+        headless.destroy();
+    return 0;
+}
+
+// glfw: initialize and configure
+GLFWwindow* openWindow()
+{
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+    GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "3D Kinetic Terrain", NULL, NULL);
+    if (window == NULL)
+    {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return nullptr;
+    }
+    glfwMakeContextCurrent(window);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetCursorPosCallback(window, mouse_callback);
+    glfwSetScrollCallback(window, scroll_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
+
+    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    return window;
+}
+
+// the sim's camera with the terrain offsets that go with it
+CameraState simCamera()
+{
+    CameraState state;
+    state.position = camera.Position;
+    state.front = camera.Front;
+    state.up = camera.Up;
+    state.zoom = camera.Zoom;
+    state.terrainOffsetX = terrainOffsetX;
+    state.terrainOffsetZ = terrainOffsetZ;
+    return state;
+}
+
+// publish the current camera for late latching on the render thread
+void latchCamera()
+{
+    std::lock_guard<std::mutex> lock(cameraMutex);
+    uint64_t inputNs = latchedCamera.inputNs;
+    latchedCamera = simCamera();
+    latchedCamera.inputNs = inputNs;
+    // input before the render thread latches keeps the older stamp
+    if (frameInputNs && !latchedCamera.inputNs)
+        latchedCamera.inputNs = frameInputNs;
+    else if (frameInputNs && inputLatched && !inputNsAfterLatch)
+        inputNsAfterLatch = frameInputNs;
+}
+
+// the latched stamp is shown; input since the latch is next
+static void inputPresented()
+{
+    std::lock_guard<std::mutex> lock(cameraMutex);
+    if (!inputLatched)
+        return;
+    latchedCamera.inputNs = inputNsAfterLatch;
+    inputNsAfterLatch = 0;
+    inputLatched = false;
+}
+
+static_assert(((GRID_MAX_N - 2) / TILE_N + 2) * ((GRID_MAX_N - 2) / TILE_N + 2) <= MAX_FRAME_MESHES, "visible chunks must fit a frame packet");
+
+// chunks whose cells cover the grid starting at (originX, originZ)
+static void visibleChunkRange(int originX, int originZ, int& minX, int& minZ, int& maxX, int& maxZ)
+{
+    minX = floorDiv(originX, TILE_N);
+    minZ = floorDiv(originZ, TILE_N);
+    maxX = floorDiv(originX + gridN - 2, TILE_N);
+    maxZ = floorDiv(originZ + gridN - 2, TILE_N);
+}
+
+// chunk meshes read a one-sample halo, so they need the surrounding tiles too
+static bool chunkTilesResident(int originX, int originZ)
+{
+    int minX, minZ, maxX, maxZ;
+    visibleChunkRange(originX, originZ, minX, minZ, maxX, maxZ);
+    EpochGuard guard;
+    for (int tz = minZ - 1; tz <= maxZ + 1; ++tz)
+        for (int tx = minX - 1; tx <= maxX + 1; ++tx)
+            if (!tileTable.find(0, tx, tz))
+                return false;
+    return true;
+}
+
+static void prefetchChunkTiles(int originX, int originZ, std::stop_token stop)
+{
+    int minX, minZ, maxX, maxZ;
+    visibleChunkRange(originX, originZ, minX, minZ, maxX, maxZ);
+    for (int tz = minZ - 1; tz <= maxZ + 1; ++tz)
+        for (int tx = minX - 1; tx <= maxX + 1; ++tx)
+            prefetchTile(0, tx, tz, stop);
+}
+
+// tiles stay resident (for revisits) until the tile cache exceeds its
+// budget; then the ones farthest from the grid go first. the grid and a
+// margin around it are never evicted
+static void enforceTileBudget(int originX, int originZ)
+{
+    size_t excess = memoryBudget.excess(MEM_TILE_CACHE);
+    if (excess == 0)
+        return;
+    PROFILE_ZONE("evict tiles");
+    AllowAllocations streaming;
+    size_t count = (excess + sizeof(HeightTile) - 1) / sizeof(HeightTile);
+    int minX = floorDiv(originX, TILE_N) - TILE_KEEP_MARGIN, maxX = floorDiv(originX + gridN - 1, TILE_N) + TILE_KEEP_MARGIN;
+    int minZ = floorDiv(originZ, TILE_N) - TILE_KEEP_MARGIN, maxZ = floorDiv(originZ + gridN - 1, TILE_N) + TILE_KEEP_MARGIN;
+    int centerX = floorDiv(originX + gridN / 2, TILE_N), centerZ = floorDiv(originZ + gridN / 2, TILE_N);
+    memoryBudget.countEvictions(MEM_TILE_CACHE, tileTable.evictFarthest(centerX, centerZ, minX, minZ, maxX, maxZ, count));
+    tileEpochs.collect();
+}
+
+static MeshRef buildChunkMesh(int chunkX, int chunkZ)
+{
+    PROFILE_ZONE("build chunk");
+    auto start = std::chrono::steady_clock::now();
+    const int H = TILE_N + 3;
+    MeshRef mesh = chunkPool.acquire();
+    ArenaScope scratch(threadArena());
+    float* halo = threadArena().alloc<float>(H * H);
+    assembleTerrainHeights(halo, H, chunkX * TILE_N - 1, chunkZ * TILE_N - 1);
+    buildChunkVertices(halo, TILE_N + 1, terrainScale, mesh->vertices);
+    mesh->version = ++terrainMeshVersion;
+    mesh->size = TILE_N + 1;
+    computeLodErrors(*mesh.get());
+    mesh->originX = chunkX * TILE_N;
+    mesh->originZ = chunkZ * TILE_N;
+    metrics.chunkBuildUs.record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    return mesh;
+}
+
+// chunks that stay visible keep their meshes; only new ones are built
+static void updateVisibleChunks(TerrainView& view)
+{
+    int minX, minZ, maxX, maxZ;
+    visibleChunkRange(view.originX, view.originZ, minX, minZ, maxX, maxZ);
+    int chunkX[MAX_FRAME_MESHES], chunkZ[MAX_FRAME_MESHES];
+    MeshRef chunks[MAX_FRAME_MESHES];
+    int count = 0;
+    for (int cz = minZ; cz <= maxZ; ++cz)
+    {
+        for (int cx = minX; cx <= maxX; ++cx)
+        {
+            for (int i = 0; i < view.chunkCount && !chunks[count]; ++i)
+                if (view.chunkX[i] == cx && view.chunkZ[i] == cz)
+                    chunks[count] = view.chunks[i];
+            if (!chunks[count])
+                chunks[count] = buildChunkMesh(cx, cz);
+            chunkX[count] = cx;
+            chunkZ[count] = cz;
+            ++count;
+        }
+    }
+    for (int i = 0; i < MAX_FRAME_MESHES; ++i)
+    {
+        view.chunkX[i] = chunkX[i];
+        view.chunkZ[i] = chunkZ[i];
+        view.chunks[i] = chunks[i];
+    }
+    view.chunkCount = count;
+}
+
+static void buildPreviewMesh(TerrainView& view)
+{
+    PROFILE_ZONE("build preview");
+    MeshRef mesh = previewPool.acquire();
+    // the lattice is procedural; stamps and edits go on top of a copy
+    ArenaScope scratch(threadArena());
+    float* heights = threadArena().alloc<float>(gridN * gridN);
+    std::copy(terrainRefinement.heights.begin(), terrainRefinement.heights.begin() + gridN * gridN, heights);
+    applyTerrainStamps(heights, gridN, terrainRefinement.originX, terrainRefinement.originZ, 1);
+    editLayer.apply(heights, gridN, terrainRefinement.originX, terrainRefinement.originZ);
+    buildTerrainVertices(heights, gridN, terrainScale, mesh->vertices);
+    mesh->version = ++terrainMeshVersion;
+    mesh->size = gridN;
+    mesh->originX = terrainRefinement.originX + gridN / 2;    // the preview is built centered
+    mesh->originZ = terrainRefinement.originZ + gridN / 2;
+    view.preview = mesh;
+}
+
+// tracks the grid cell under the terrain offsets; sub-cell movement is a
+// model translation. after a jump (or at startup) a progressive preview is
+// shown while the tiles of the new grid stream in, then the view switches
+// to per-chunk meshes built from cached height tiles. returns true when the
+// set of meshes changed
+bool updateTerrain(TerrainView& view)
+{
+    PROFILE_ZONE("updateTerrain");
+    if (view.originX != INT_MIN)
+        enforceTileBudget(view.originX, view.originZ);
+
+    int originX = (int)std::floor(terrainOffsetX / terrainScale);
+    int originZ = (int)std::floor(terrainOffsetZ / terrainScale);
+    if (originX != view.originX || originZ != view.originZ)
+    {
+        bool bigJump = view.originX == INT_MIN || std::abs(originX - view.originX) * terrainScale > gridN * REFINE_JUMP || std::abs(originZ - view.originZ) * terrainScale > gridN * REFINE_JUMP;
+        view.originX = originX;
+        view.originZ = originZ;
+        if ((bigJump || view.preview) && !chunkTilesResident(originX, originZ))
+        {
+            // a small move keeps the refined lattice and goes on refining
+            if (bigJump || !view.preview)
+            {
+                beginTerrainRefinement(terrainRefinement, gridN, terrainScale, originX, originZ, terrainAmplitude, terrainFreq);
+                while (!refineTerrain(terrainRefinement, REFINE_BUDGET_MS)) {}
+            }
+            else
+            {
+                shiftTerrainRefinement(terrainRefinement, originX, originZ);
+            }
+            buildPreviewMesh(view);
+            for (int i = 0; i < view.chunkCount; ++i)
+                view.chunks[i] = MeshRef();
+            view.chunkCount = 0;
+        }
+        else
+        {
+            terrainRefinement.active = false;
+            view.preview = MeshRef();
+            updateVisibleChunks(view);
+        }
+
+        AllowAllocations streaming;
+        tileEpochs.collect();
+
+        // prefetch the ring of tiles just outside the grid; requests for
+        // the previous ring are cancelled when the grid enters a new tile
+        static int lastTileX = INT32_MIN, lastTileZ = INT32_MIN;
+        int tileX = floorDiv(originX, TILE_N), tileZ = floorDiv(originZ, TILE_N);
+        if (tileX != lastTileX || tileZ != lastTileZ)
+        {
+            tilePrefetchStop.request_stop();
+            tilePrefetchStop = std::stop_source();
+            int tilesX = floorDiv(originX + gridN - 1, TILE_N) - tileX;
+            int tilesZ = floorDiv(originZ + gridN - 1, TILE_N) - tileZ;
+            for (int tz = tileZ - 1; tz <= tileZ + tilesZ + 1; ++tz)
+                for (int tx = tileX - 1; tx <= tileX + tilesX + 1; ++tx)
+                    if (tz == tileZ - 1 || tz == tileZ + tilesZ + 1 || tx == tileX - 1 || tx == tileX + tilesX + 1)
+                        prefetchTile(0, tx, tz, tilePrefetchStop.get_token());
+            lastTileX = tileX;
+            lastTileZ = tileZ;
+        }
+
+        // the preview is replaced as soon as these are resident
+        if (view.preview)
+            prefetchChunkTiles(originX, originZ, tilePrefetchStop.get_token());
+        return true;
+    }
+    if (view.preview && chunkTilesResident(originX, originZ))
+    {
+        terrainRefinement.active = false;
+        view.preview = MeshRef();
+        updateVisibleChunks(view);
+        return true;
+    }
+    if (view.preview && refineTerrain(terrainRefinement, REFINE_BUDGET_MS))
+    {
+        buildPreviewMesh(view);
+        return true;
+    }
+    return false;
+}
+
+
+// --- render thread ---------------------------------------------------------
+void renderThreadMain(GLFWwindow* window)
+{
+    PROFILE_THREAD("render");
+    if (window)
+    {
+        glfwMakeContextCurrent(window);
+    }
+    else
+    {
+        headless.makeCurrent(true);
+        headless.createTarget(SCR_WIDTH, SCR_HEIGHT);
+    }
+    glEnable(GL_DEPTH_TEST);
+
+    // shaders
+    Shader lightingShader("6.multiple_lights.vs", "6.multiple_lights.fs");
+    Shader upscaleShader("6.upscale.vs", "6.upscale.fs");
+
+    // terrain buffers: meshes are uploaded into them as packets bring them
+    terrainBuffers.create();
+#if TERRAIN_PROFILE
+    gpuProfiler.create();
+#endif
+    if (captureDirectory)
+        frameCapture.create(captureDirectory, capturePng);
+    qualityGovernor.create();
+    sceneTarget.create(upscaleShader);
+
+    // shader configuration
+    lightingShader.use();
+    lightingShader.setFloat("material.shininess", 32.0f);
+    LightingUniforms uniforms;
+    resolveLightingUniforms(lightingShader, uniforms);
+
+    unsigned long long renderedFrames = 0;
+    int viewportWidth = SCR_WIDTH, viewportHeight = SCR_HEIGHT;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(frameSyncMutex);
+            packetPublished.wait(lock, [] { return renderThreadQuit || framePackets.hasFresh(); });
+            if (renderThreadQuit)
+                break;
+        }
+        HotPathScope hotPath("render frame");
+        PROFILE_ZONE("render frame");
+        framePackets.consume();
+        const FramePacket& packet = framePackets.readBuffer();
+
+        // the damage check looks at the camera as it is now; renderFrame
+        // latches it again right before the view upload
+        CameraState cameraState;
+        {
+            std::lock_guard<std::mutex> lock(cameraMutex);
+            cameraState = latchedCamera;
+        }
+        viewportWidth = framebufferWidth.load();
+        viewportHeight = framebufferHeight.load();
+
+        // an unchanged frame is not drawn; the sim still gets its ack
+        bool onDemand = window && !continuousRendering && !frameCapture.active();
+        if (onDemand && !frameDamage.needsRedraw(packet, cameraState, viewportWidth, viewportHeight))
+        {
+            metrics.framesSkipped.fetch_add(1, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(frameSyncMutex);
+                ++framesRendered;
+            }
+            frameRendered.notify_one();
+            continue;
+        }
+
+        // below full scale the scene goes to the offscreen target first
+        GLuint output = window ? 0 : headless.framebuffer;
+        float scale = qualityGovernor.renderScale();
+        bool scaled = scale < 1.0f && viewportWidth > 0 && viewportHeight > 0;
+        int sceneWidth = viewportWidth, sceneHeight = viewportHeight;
+        if (scaled)
+        {
+            sceneWidth = std::max(1, (int)std::lround(viewportWidth * scale));
+            sceneHeight = std::max(1, (int)std::lround(viewportHeight * scale));
+            sceneTarget.resize(viewportWidth, viewportHeight);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, scaled ? sceneTarget.framebuffer : output);
+        glViewport(0, 0, sceneWidth, sceneHeight);
+
+        unsigned long long frame = renderedFrames + 1;
+        if (calibrating)
+            qualityGovernor.setLevel(QUALITY_LOD_ERROR, calibrationLodLevel(packet.frame));
+        auto renderStart = std::chrono::steady_clock::now();
+        uint64_t uploadsBefore = metrics.uploadBytes.load(std::memory_order_relaxed);
+        qualityGovernor.beginFrame();
+        bool complete = renderFrame(lightingShader, uniforms, packet, cameraState, terrainBuffers, frame);
+        if (onDemand)
+            frameDamage.drawn(complete, cameraState);
+        if (scaled)
+        {
+            PROFILE_GPU_ZONE("upscale");
+            sceneTarget.upscale(upscaleShader, output, sceneWidth, sceneHeight);
+        }
+        terrainBuffers.endFrame(frame);
+        if (frameCapture.active())
+            frameCapture.capture(packet.frame, viewportWidth, viewportHeight);
+        latencyTracker.submitted(cameraState.inputNs);
+        auto renderUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - renderStart).count();
+        metrics.renderFrameUs.record((uint64_t)renderUs);
+        if (packet.frame <= frameTimings.size())
+        {
+            frameTimings[packet.frame - 1].renderMs = renderUs / 1000.0f;
+            frameTimings[packet.frame - 1].uploadBytes = metrics.uploadBytes.load(std::memory_order_relaxed) - uploadsBefore;
+        }
+        PROFILE_COUNTER("gpu terrain bytes", memoryBudget.used(MEM_GPU_TERRAIN));
+#if TERRAIN_PROFILE
+        gpuProfiler.collect();
+#endif
+
+        if (window)
+        {
+            PROFILE_ZONE("swap buffers");
+            glfwSwapBuffers(window);
+        }
+        else
+        {
+            // no present to pace us: wait for the frame instead, so render
+            // times include the (software) GPU work
+            PROFILE_ZONE("finish frame");
+            glFinish();
+        }
+        latencyTracker.presented();
+        latencyTracker.poll();
+        inputPresented();
+        // swaps may wait for vsync and are not a cost; a headless finish is,
+        // and is the GPU's share of it
+        auto frameEnd = std::chrono::steady_clock::now();
+        double frameCpuMs = std::chrono::duration<double, std::milli>(frameEnd - renderStart).count();
+        double finishMs = window ? 0.0 : frameCpuMs - renderUs / 1000.0;
+        if (packet.frame <= calibrationFrameMs.size())
+            calibrationFrameMs[packet.frame - 1] = (float)frameCpuMs;
+        qualityGovernor.endFrame(packet.frame, window ? renderUs / 1000.0 : frameCpuMs, finishMs);
+        checkHitch("render", packet.frame, (float)((window ? renderUs / 1000.0 : frameCpuMs) / 1000.0), cameraState);
+        if (lowLatency)
+        {
+            PROFILE_ZONE("latency throttle");
+            latencyTracker.throttle(LOW_LATENCY_MAX_IN_FLIGHT);
+        }
+        if (++renderedFrames == ALLOC_WARMUP_FRAMES)
+            allocChecksArmed = true;
+        {
+            std::lock_guard<std::mutex> lock(frameSyncMutex);
+            ++framesRendered;
+        }
+        frameRendered.notify_one();
+    }
+
+    // cleanup
+    latencyTracker.destroy();
+    sceneTarget.destroy();
+    qualityGovernor.destroy();
+    frameCapture.finish();
+    terrainBuffers.destroy();
+#if TERRAIN_PROFILE
+    gpuProfiler.destroy();
+#endif
+    if (window)
+    {
+        glfwMakeContextCurrent(NULL);
+    }
+    else
+    {
+        headless.destroyTarget();
+        headless.makeCurrent(false);
+    }
+}
+
+// --- frame capture ---------------------------------------------------------
+void FrameCapture::create(const char* dir, bool asPng)
+{
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    directory = dir;
+    png = asPng;
+    for (Slot& slot : slots)
+        glGenBuffers(1, &slot.pixelBuffer);
+
+    // enough copies for every worker to encode one while the ring refills
+    int count = (int)jobSystem.threadCount() + RING;
+    for (int i = 0; i < count; ++i)
+    {
+        buffers.push_back(std::make_unique<Pixels>());
+        freeBuffers.push_back(buffers.back().get());
+    }
+}
+
+void FrameCapture::capture(unsigned long long frame, int width, int height)
+{
+    PROFILE_ZONE("capture");
+
+    // take every readback that has landed, oldest first
+    for (int i = 0; i < RING; ++i)
+    {
+        Slot& slot = slots[(next + i) % RING];
+        if (slot.fence && glClientWaitSync(slot.fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+            retire(slot);
+    }
+
+    // the slot to reuse is RING frames old; waiting on it means the GPU is behind
+    Slot& slot = slots[next];
+    next = (next + 1) % RING;
+    if (slot.fence)
+    {
+        ++readbackStalls;
+        glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        retire(slot);
+    }
+
+    size_t bytes = (size_t)width * height * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pixelBuffer);
+    if (slot.capacity < bytes)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+        slot.capacity = bytes;
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.frame = frame;
+    slot.width = width;
+    slot.height = height;
+}
+
+void FrameCapture::retire(Slot& slot)
+{
+    Pixels* pixels;
+    {
+        // all copies busy: the encoders are behind, wait for one
+        std::unique_lock<std::mutex> lock(poolMutex);
+        if (freeBuffers.empty())
+        {
+            ++encoderStalls;
+            poolReady.wait(lock, [&] { return !freeBuffers.empty(); });
+        }
+        pixels = freeBuffers.back();
+        freeBuffers.pop_back();
+        ++encoding;
+    }
+
+    size_t bytes = (size_t)slot.width * slot.height * 4;
+    {
+        AllowAllocations resize;        // once, or after the window grew
+        pixels->resize(bytes);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pixelBuffer);
+    if (const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT))
+    {
+        std::memcpy(pixels->data(), mapped, bytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glDeleteSync(slot.fence);
+    slot.fence = nullptr;
+
+    unsigned long long frame = slot.frame;
+    int width = slot.width, height = slot.height;
+    AllowAllocations submit;
+    jobSystem.submit([this, pixels, frame, width, height] { encode(pixels, frame, width, height); });
+    ++captured;
+}
+
+void FrameCapture::encode(Pixels* pixels, unsigned long long frame, int width, int height)
+{
+    PROFILE_ZONE("encode frame");
+    // RGBA rows come bottom-up from GL; images want RGB top-down
+    static thread_local std::vector<unsigned char> rgb;
+    rgb.resize((size_t)width * height * 3);
+    for (int y = 0; y < height; ++y)
+    {
+        const unsigned char* src = pixels->data() + (size_t)(height - 1 - y) * width * 4;
+        unsigned char* dst = rgb.data() + (size_t)y * width * 3;
+        for (int x = 0; x < width; ++x)
+        {
+            dst[x * 3 + 0] = src[x * 4 + 0];
+            dst[x * 3 + 1] = src[x * 4 + 1];
+            dst[x * 3 + 2] = src[x * 4 + 2];
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        freeBuffers.push_back(pixels);
+    }
+    poolReady.notify_all();
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "frame_%06llu.%s", frame, png ? "png" : "ppm");
+    std::string path = (std::filesystem::path(directory) / name).string();
+    bool written = png ? writePng(path.c_str(), rgb.data(), width, height) : writePpm(path.c_str(), rgb.data(), width, height);
+    if (!written)
+        std::cout << "[capture] failed to write " << path << std::endl;
+
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        --encoding;
+    }
+    poolReady.notify_all();
+}
+
+void FrameCapture::finish()
+{
+    if (!active())
+        return;
+    for (int i = 0; i < RING; ++i)
+    {
+        Slot& slot = slots[(next + i) % RING];
+        if (slot.fence)
+        {
+            glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            retire(slot);
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(poolMutex);
+        poolReady.wait(lock, [&] { return encoding == 0; });
+    }
+    for (Slot& slot : slots)
+        glDeleteBuffers(1, &slot.pixelBuffer);
+    std::cout << "[capture] " << captured << " frames written to " << directory << " (" << readbackStalls
+              << " readback stalls, " << encoderStalls << " encoder stalls)" << std::endl;
+    directory = nullptr;
+}
+
+bool writePpm(const char* path, const unsigned char* rgb, int width, int height)
+{
+    std::ofstream file(path, std::ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    file.write(reinterpret_cast<const char*>(rgb), (std::streamsize)width * height * 3);
+    return (bool)file;
+}
+
+// 8-bit RGB PNG with stored (uncompressed) deflate blocks: no zlib needed
+// and cheap to write; recompress offline if size matters
+bool writePng(const char* path, const unsigned char* rgb, int width, int height)
+{
+    // slicing-by-4 CRC tables: the checksums are most of the encoding cost
+    static uint32_t crcTable[4][256];
+    static std::once_flag crcInit;
+    std::call_once(crcInit, []
+    {
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            crcTable[0][n] = c;
+        }
+        for (uint32_t n = 0; n < 256; ++n)
+            for (int t = 1; t < 4; ++t)
+                crcTable[t][n] = crcTable[0][crcTable[t - 1][n] & 0xff] ^ (crcTable[t - 1][n] >> 8);
+    });
+
+    std::ofstream file(path, std::ios::binary);
+    auto be32 = [](unsigned char* p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = (unsigned char)v; };
+    uint32_t crc = 0;
+    auto put = [&](const unsigned char* data, size_t size)
+    {
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4)
+        {
+            crc ^= (uint32_t)data[i] | (uint32_t)data[i + 1] << 8 | (uint32_t)data[i + 2] << 16 | (uint32_t)data[i + 3] << 24;
+            crc = crcTable[3][crc & 0xff] ^ crcTable[2][(crc >> 8) & 0xff] ^ crcTable[1][(crc >> 16) & 0xff] ^ crcTable[0][crc >> 24];
+        }
+        for (; i < size; ++i)
+            crc = crcTable[0][(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        file.write(reinterpret_cast<const char*>(data), (std::streamsize)size);
+    };
+    auto beginChunk = [&](const char* type, uint32_t length)
+    {
+        unsigned char header[4];
+        be32(header, length);
+        file.write(reinterpret_cast<const char*>(header), 4);
+        crc = 0xffffffffu;
+        put(reinterpret_cast<const unsigned char*>(type), 4);
+    };
+    auto endChunk = [&]
+    {
+        unsigned char footer[4];
+        be32(footer, crc ^ 0xffffffffu);
+        file.write(reinterpret_cast<const char*>(footer), 4);
+    };
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    file.write(reinterpret_cast<const char*>(signature), 8);
+
+    unsigned char ihdr[13] = {};
+    be32(ihdr, width);
+    be32(ihdr + 4, height);
+    ihdr[8] = 8;                        // bit depth
+    ihdr[9] = 2;                        // truecolour
+    beginChunk("IHDR", 13);
+    put(ihdr, 13);
+    endChunk();
+
+    // zlib stream of stored blocks over the rows, each prefixed by filter 0
+    const size_t rowBytes = (size_t)width * 3 + 1;
+    const size_t raw = rowBytes * height;
+    const size_t BLOCK = 65535;
+    const size_t blocks = (raw + BLOCK - 1) / BLOCK;
+    beginChunk("IDAT", (uint32_t)(2 + raw + blocks * 5 + 4));
+    const unsigned char zlibHeader[2] = { 0x78, 0x01 };
+    put(zlibHeader, 2);
+    uint32_t a = 1, b = 0;
+    size_t row = 0, column = 0;         // position in the filtered image
+    for (size_t left = raw; left > 0;)
+    {
+        size_t size = std::min(left, BLOCK);
+        left -= size;
+        unsigned char header[5] = { (unsigned char)(left == 0 ? 1 : 0), (unsigned char)size, (unsigned char)(size >> 8),
+                                    (unsigned char)~size, (unsigned char)(~size >> 8) };
+        put(header, 5);
+        while (size > 0)
+        {
+            if (column == 0)
+            {
+                const unsigned char filter = 0;
+                put(&filter, 1);
+                b = (b + a) % 65521;
+                column = 1;
+                --size;
+                continue;
+            }
+            size_t span = std::min(size, rowBytes - column);
+            const unsigned char* data = rgb + row * (rowBytes - 1) + (column - 1);
+            put(data, span);
+            // 5552 bytes is the most Adler-32 can sum before 32 bits overflow
+            for (size_t i = 0; i < span;)
+            {
+                size_t end = std::min(span, i + 5552);
+                for (; i < end; ++i)
+                {
+                    a += data[i];
+                    b += a;
+                }
+                a %= 65521;
+                b %= 65521;
+            }
+            column += span;
+            size -= span;
+            if (column == rowBytes)
+            {
+                column = 0;
+                ++row;
+            }
+        }
+    }
+    unsigned char adler[4];
+    be32(adler, (b << 16) | a);
+    put(adler, 4);
+    endChunk();
+
+    beginChunk("IEND", 0);
+    endChunk();
+    return (bool)file;
+}
+
+
+// --- quality governor ------------------------------------------------------
+struct QualityLadder
+{
+    const char* name;
+    int levels;
+    float values[4];                    // best first
+};
+static const QualityLadder QUALITY_LADDERS[QUALITY_KNOB_COUNT] =
+{
+    { "lod pixel error", 4, { 1.0f, 2.0f, 4.0f, 8.0f } },
+    { "point lights", 3, { (float)NR_POINT_LIGHTS, 2.0f, 0.0f } },
+};
+
+void QualityGovernor::create()
+{
+    for (auto& pair : queries)
+        glGenQueries(2, pair);
+    upgradeWait = GOVERNOR_UPGRADE_FRAMES;
+    scale = fixedRenderScale > 0.0f ? fixedRenderScale : 1.0f;
+    dynamicScale = qualityTargetMs > 0.0f && fixedRenderScale <= 0.0f;
+}
+
+void QualityGovernor::destroy()
+{
+    for (auto& pair : queries)
+        glDeleteQueries(2, pair);
+}
+
+// timestamps rather than GL_TIME_ELAPSED, which the profiler's zones use
+void QualityGovernor::beginFrame()
+{
+    if (qualityTargetMs <= 0.0f || pending[current])
+        return;
+    glQueryCounter(queries[current][0], GL_TIMESTAMP);
+}
+
+// finishMs is time spent waiting for the GPU on this thread (headless
+// glFinish), a floor for the GPU cost when timestamps lag or undercount
+void QualityGovernor::endFrame(unsigned long long frame, double cpuMs, double finishMs)
+{
+    if (qualityTargetMs <= 0.0f)
+        return;
+    if (!pending[current])
+    {
+        glQueryCounter(queries[current][1], GL_TIMESTAMP);
+        pending[current] = true;
+    }
+    current = (current + 1) % QUERY_PAIRS;
+
+    // newest completed GPU measurement; never waits
+    for (int i = 0; i < QUERY_PAIRS; ++i)
+    {
+        int slot = (current + i) % QUERY_PAIRS;
+        if (!pending[slot])
+            continue;
+        GLint available = 0;
+        glGetQueryObjectiv(queries[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(queries[slot][0], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(queries[slot][1], GL_QUERY_RESULT, &end);
+        gpuMs = (end - begin) * 1e-6;
+        pending[slot] = false;
+    }
+
+    double gpuEstimate = std::max(gpuMs, finishMs);
+    double cost = std::max(cpuMs, gpuEstimate);
+    smoothedMs = smoothedMs == 0.0 ? cost : smoothedMs + (cost - smoothedMs) * GOVERNOR_SMOOTHING;
+    smoothedGpuMs = smoothedGpuMs == 0.0 ? gpuEstimate : smoothedGpuMs + (gpuEstimate - smoothedGpuMs) * GOVERNOR_SMOOTHING;
+    PROFILE_COUNTER("governor cost ms", smoothedMs);
+    if (dynamicScale)
+        adjustScale(smoothedGpuMs);
+    overFrames = smoothedMs > qualityTargetMs * GOVERNOR_DEGRADE_RATIO ? overFrames + 1 : 0;
+    underFrames = smoothedMs < qualityTargetMs * GOVERNOR_UPGRADE_RATIO ? underFrames + 1 : 0;
+    if (frame < lastChange + GOVERNOR_COOLDOWN_FRAMES)
+        return;
+
+    // resolution goes first and comes back last: the ladder degrades only
+    // once the scale cannot absorb the overrun, and upgrades at full scale
+    bool scaleCanDrop = dynamicScale && scale > DYNRES_MIN_SCALE + DYNRES_DEADBAND &&
+                        smoothedGpuMs > qualityTargetMs * DYNRES_HEADROOM;
+    bool scaleAtFull = !dynamicScale || scale >= 1.0f;
+    if (overFrames >= GOVERNOR_DEGRADE_FRAMES && !scaleCanDrop)
+        step(frame, true);
+    else if (underFrames >= upgradeWait && scaleAtFull)
+        step(frame, false);
+}
+
+// fragment cost goes with the pixel count, the square of the scale; each
+// frame moves part of the way to the scale that would land the GPU on
+// target, so a spike is absorbed over a few frames instead of in one jump
+void QualityGovernor::adjustScale(double gpuEstimateMs)
+{
+    if (gpuEstimateMs <= 0.0)
+        return;
+    float ideal = scale * (float)std::sqrt(qualityTargetMs * DYNRES_HEADROOM / gpuEstimateMs);
+    ideal = std::clamp(ideal, DYNRES_MIN_SCALE, 1.0f);
+    float next = scale + (ideal - scale) * DYNRES_GAIN;
+    if (ideal == 1.0f && 1.0f - next < DYNRES_DEADBAND)
+        next = 1.0f;
+    if (std::abs(next - scale) < DYNRES_DEADBAND * DYNRES_GAIN && next != 1.0f)
+        return;
+    scale = next;
+    PROFILE_COUNTER("render scale", scale);
+}
+
+void QualityGovernor::step(unsigned long long frame, bool degrade)
+{
+    // degrade the first knob with room left; upgrade the last one lowered
+    int knob = -1;
+    if (degrade)
+    {
+        for (int k = 0; k < QUALITY_KNOB_COUNT && knob < 0; ++k)
+            if (level[k] + 1 < QUALITY_LADDERS[k].levels)
+                knob = k;
+    }
+    else
+    {
+        for (int k = QUALITY_KNOB_COUNT - 1; k >= 0 && knob < 0; --k)
+            if (level[k] > 0)
+                knob = k;
+    }
+    overFrames = underFrames = 0;
+    if (knob < 0)
+        return;
+
+    // an upgrade that did not hold makes the next attempt wait longer
+    if (degrade && upgraded && frame < lastUpgrade + GOVERNOR_UPGRADE_FRAMES)
+        upgradeWait = std::min(upgradeWait * 2, GOVERNOR_MAX_UPGRADE_FRAMES);
+    else if (!degrade)
+        lastUpgrade = frame;
+    upgraded = !degrade;
+    lastChange = frame;
+
+    const QualityLadder& ladder = QUALITY_LADDERS[knob];
+    float from = ladder.values[level[knob]];
+    level[knob] += degrade ? 1 : -1;
+    char line[200];
+    std::snprintf(line, sizeof(line), "[governor] frame %llu: %.2f ms %s %.2f ms target, %s %g -> %g",
+                  frame, smoothedMs, degrade ? ">" : "<", qualityTargetMs, ladder.name, from, ladder.values[level[knob]]);
+    std::cout << line << std::endl;
+    PROFILE_COUNTER(ladder.name, ladder.values[level[knob]]);
+}
+
+float QualityGovernor::value(QualityKnob knob) const
+{
+    return QUALITY_LADDERS[knob].values[level[knob]];
+}
+
+void QualityGovernor::setLevel(QualityKnob knob, int to)
+{
+    level[knob] = std::clamp(to, 0, QUALITY_LADDERS[knob].levels - 1);
+}
+
+
+// --- input latency ---------------------------------------------------------
+void LatencyTracker::submitted(uint64_t inputNs)
+{
+    frameInputNs = inputNs;
+    if (inputNs)
+        metrics.inputToSubmitUs.record((profiler.now() - inputNs) / 1000);
+}
+
+void LatencyTracker::presented()
+{
+    if (frameInputNs)
+        metrics.inputToSwapUs.record((profiler.now() - frameInputNs) / 1000);
+
+    // a full ring means the GPU is RING frames behind; wait for the oldest
+    Frame& frame = frames[next];
+    next = (next + 1) % RING;
+    if (frame.fence)
+    {
+        glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        retire(frame);
+    }
+    frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame.inputNs = frameInputNs;
+    frameInputNs = 0;
+}
+
+// fences signal in submission order, so the first pending one ends the scan
+void LatencyTracker::poll()
+{
+    for (int i = 0; i < RING; ++i)
+    {
+        Frame& frame = frames[(next + i) % RING];
+        if (!frame.fence)
+            continue;
+        if (glClientWaitSync(frame.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            break;
+        retire(frame);
+    }
+}
+
+void LatencyTracker::throttle(int maxInFlight)
+{
+    int inFlight = 0;
+    for (const Frame& frame : frames)
+        inFlight += frame.fence != nullptr;
+    for (int i = 0; i < RING && inFlight > maxInFlight; ++i)
+    {
+        Frame& frame = frames[(next + i) % RING];
+        if (!frame.fence)
+            continue;
+        glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        retire(frame);
+        --inFlight;
+    }
+}
+
+void LatencyTracker::retire(Frame& frame)
+{
+    if (frame.inputNs)
+        metrics.inputToGpuUs.record((profiler.now() - frame.inputNs) / 1000);
+    glDeleteSync(frame.fence);
+    frame.fence = nullptr;
+    frame.inputNs = 0;
+}
+
+void LatencyTracker::destroy()
+{
+    throttle(0);
+}
+
+
+// --- on-demand rendering ---------------------------------------------------
+bool FrameDamage::needsRedraw(const FramePacket& packet, const CameraState& view, int w, int h)
+{
+    bool damaged = incomplete || redrawRequested.exchange(false) ||
+                   std::chrono::steady_clock::now() - lastDraw >= std::chrono::duration<double>(REDRAW_HEARTBEAT_S);
+    auto update = [&](auto& kept, const auto& value)
+    {
+        if (std::memcmp(&kept, &value, sizeof(value)) != 0)
+        {
+            std::memcpy(&kept, &value, sizeof(value));
+            damaged = true;
+        }
+    };
+
+    // every field is compared, so each one is brought up to date
+    update(camera.position, view.position);
+    update(camera.front, view.front);
+    update(camera.up, view.up);
+    update(camera.zoom, view.zoom);
+    update(dirLightDirection, packet.dirLightDirection);
+    update(pointLightPositions, packet.pointLightPositions);
+    update(camera.terrainOffsetX, view.terrainOffsetX);
+    update(camera.terrainOffsetZ, view.terrainOffsetZ);
+    update(width, w);
+    update(height, h);
+
+    float knobs[QUALITY_KNOB_COUNT + 1];
+    for (int k = 0; k < QUALITY_KNOB_COUNT; ++k)
+        knobs[k] = qualityGovernor.value((QualityKnob)k);
+    knobs[QUALITY_KNOB_COUNT] = qualityGovernor.renderScale();
+    update(quality, knobs);
+
+    // a rebuilt mesh has a new version even where the pool reuses the slot
+    MeshKey keys[MAX_FRAME_MESHES] = {};
+    for (int i = 0; i < packet.terrainCount; ++i)
+        keys[i] = { packet.terrain[i].get(), packet.terrain[i]->version };
+    update(meshCount, packet.terrainCount);
+    update(meshes, keys);
+    return damaged;
+}
+
+// the late latch may have drawn a newer camera than the check saw
+void FrameDamage::drawn(bool complete, const CameraState& view)
+{
+    camera = view;
+    incomplete = !complete;
+    redrawPending.store(incomplete, std::memory_order_relaxed);
+    lastDraw = std::chrono::steady_clock::now();
+}
+
+
+// --- headless rendering ----------------------------------------------------
+bool HeadlessContext::create()
+{
+    // prefer the surfaceless platform; fall back to the default display
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr))
+        return false;
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(display, configAttribs, &config, 1, &configCount) || configCount == 0)
+        return false;
+
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE };
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    return context != EGL_NO_CONTEXT && makeCurrent(true);
+}
+
+bool HeadlessContext::makeCurrent(bool current)
+{
+    // no surface at all (EGL_KHR_surfaceless_context)
+    return eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, current ? context : EGL_NO_CONTEXT);
+}
+
+void HeadlessContext::createTarget(int width, int height)
+{
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "Headless framebuffer is incomplete" << std::endl;
+    glViewport(0, 0, width, height);
+}
+
+// --- dynamic resolution ----------------------------------------------------
+void SceneTarget::create(const Shader& upscaleShader)
+{
+    glGenVertexArrays(1, &vao);
+    glUseProgram(upscaleShader.ID);
+    glUniform1i(glGetUniformLocation(upscaleShader.ID, "scene"), 0);
+    uvScale = glGetUniformLocation(upscaleShader.ID, "uvScale");
+}
+
+void SceneTarget::resize(int w, int h)
+{
+    if (framebuffer && w == width && h == height)
+        return;
+    release();
+    width = w;
+    height = h;
+
+    // linear, so the bicubic's merged taps can use the bilinear hardware
+    glGenTextures(1, &color);
+    glBindTexture(GL_TEXTURE_2D, color);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "Scene framebuffer is incomplete" << std::endl;
+    memoryBudget.charge(MEM_TEXTURES, (size_t)width * height * 8);
+}
+
+void SceneTarget::upscale(const Shader& upscaleShader, GLuint output, int sceneWidth, int sceneHeight)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, output);
+    glViewport(0, 0, width, height);
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(upscaleShader.ID);
+    glUniform2f(uvScale, (float)sceneWidth / width, (float)sceneHeight / height);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, color);
+    glBindVertexArray(vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glEnable(GL_DEPTH_TEST);
+}
+
+void SceneTarget::release()
+{
+    if (!framebuffer)
+        return;
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(1, &color);
+    glDeleteRenderbuffers(1, &depth);
+    memoryBudget.release(MEM_TEXTURES, (size_t)width * height * 8);
+    framebuffer = color = depth = 0;
+    width = height = 0;
+}
+
+void SceneTarget::destroy()
+{
+    release();
+    glDeleteVertexArrays(1, &vao);
+    vao = 0;
+}
+
+void HeadlessContext::destroyTarget()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &color);
+    glDeleteRenderbuffers(1, &depth);
+    framebuffer = color = depth = 0;
+}
+
+void HeadlessContext::destroy()
+{
+    if (context != EGL_NO_CONTEXT)
+        eglDestroyContext(display, context);
+    if (display != EGL_NO_DISPLAY)
+        eglTerminate(display);
+    context = EGL_NO_CONTEXT;
+    display = EGL_NO_DISPLAY;
+}
+
+// frame time percentiles of a headless run
+void printHeadlessReport(double seconds)
+{
+    unsigned long long rendered;
+    {
+        std::lock_guard<std::mutex> lock(frameSyncMutex);
+        rendered = framesRendered;
+    }
+    char line[256];
+    std::snprintf(line, sizeof(line), "Headless: %d frames simulated, %llu rendered in %.2f s (%.1f fps)",
+                  headlessFrames, rendered, seconds, rendered / seconds);
+    std::cout << line << std::endl;
+
+    auto report = [&](const char* name, const Histogram& histogram)
+    {
+        uint64_t counts[Histogram::BUCKETS];
+        histogram.snapshot(counts);
+        std::snprintf(line, sizeof(line), "  %-13s p50 %8.2f ms  p95 %8.2f ms  p99 %8.2f ms  max %8.2f ms", name,
+                      Histogram::percentile(counts, 0.5) * 1e-3, Histogram::percentile(counts, 0.95) * 1e-3,
+                      Histogram::percentile(counts, 0.99) * 1e-3, Histogram::percentile(counts, 1.0) * 1e-3);
+        std::cout << line << std::endl;
+    };
+    report("sim frame", metrics.simFrameUs);
+    report("render frame", metrics.renderFrameUs);
+    report("chunk build", metrics.chunkBuildUs);
+    report("tile generate", metrics.tileGenerateUs);
+}
+
+
+// --- camera paths ----------------------------------------------------------
+void InputRecording::captureStart()
+{
+    position = camera.Position;
+    yaw = camera.Yaw;
+    pitch = camera.Pitch;
+    zoom = camera.Zoom;
+    offsetX = terrainOffsetX;
+    offsetZ = terrainOffsetZ;
+}
+
+void InputRecording::applyStart() const
+{
+    camera.Position = position;
+    camera.Zoom = zoom;
+    // set the angles through the camera so its basis vectors follow
+    camera.Yaw = yaw;
+    camera.Pitch = pitch;
+    camera.ProcessMouseMovement(0.0f, 0.0f);
+    terrainOffsetX = offsetX;
+    terrainOffsetZ = offsetZ;
+}
+
+bool InputRecording::save(const char* path) const
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    auto put = [&](const void* data, size_t bytes) { file.write(static_cast<const char*>(data), bytes); };
+    const uint32_t version = 4, count = (uint32_t)frames.size();
+    const float start[8] = { position.x, position.y, position.z, yaw, pitch, zoom, offsetX, offsetZ };
+    put("TPTH", 4);
+    put(&version, 4);
+    put(&FIXED_TIMESTEP, 4);
+    put(start, sizeof(start));
+    put(&count, 4);
+    for (const InputFrame& f : frames)
+    {
+        uint8_t flags = (f.mouseX != 0.0f || f.mouseY != 0.0f ? 1 : 0) | (f.scroll != 0.0f ? 2 : 0) | (f.brush ? 4 : 0) | (f.history ? 8 : 0);
+        const float dt = f.dt > 0.0f ? f.dt : FIXED_TIMESTEP;
+        put(&f.keys, 1);
+        put(&flags, 1);
+        put(&dt, 4);
+        if (flags & 1)
+        {
+            put(&f.mouseX, 4);
+            put(&f.mouseY, 4);
+        }
+        if (flags & 2)
+            put(&f.scroll, 4);
+        if (flags & 4)
+        {
+            put(&f.brush, 1);
+            put(&f.brushRadius, 4);
+        }
+        if (flags & 8)
+            put(&f.history, 1);
+    }
+    return (bool)file;
+}
+
+bool InputRecording::load(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+    auto get = [&](void* data, size_t bytes) { return (bool)file.read(static_cast<char*>(data), bytes); };
+    char magic[4];
+    uint32_t version = 0, count = 0;
+    float timestep = 0.0f, start[8];
+    if (!get(magic, 4) || std::memcmp(magic, "TPTH", 4) != 0 || !get(&version, 4) || version < 1 || version > 4 ||
+        !get(&timestep, 4) || !get(start, sizeof(start)) || !get(&count, 4))
+        return false;
+    // every frame takes at least keys, flags and (from version 4) dt; a
+    // count the rest of the file cannot hold is a damaged file, not a
+    // reason to allocate
+    const std::streamoff header = file.tellg();
+    file.seekg(0, std::ios::end);
+    const std::streamoff remaining = file.tellg() - header;
+    file.seekg(header);
+    if ((uint64_t)count * (version >= 4 ? 6 : 2) > (uint64_t)remaining)
+        return false;
+    if (version < 4 && timestep != FIXED_TIMESTEP)
+        std::cout << "Camera path was recorded at " << 1.0f / timestep << " Hz, replaying at " << 1.0f / FIXED_TIMESTEP << " Hz" << std::endl;
+
+    position = glm::vec3(start[0], start[1], start[2]);
+    yaw = start[3];
+    pitch = start[4];
+    zoom = start[5];
+    offsetX = start[6];
+    offsetZ = start[7];
+    frames.assign(count, InputFrame());
+    for (InputFrame& f : frames)
+    {
+        uint8_t flags = 0;
+        if (!get(&f.keys, 1) || !get(&flags, 1))
+            return false;
+        if (version >= 4 && !get(&f.dt, 4))
+            return false;
+        if ((flags & 1) && !(get(&f.mouseX, 4) && get(&f.mouseY, 4)))
+            return false;
+        if ((flags & 2) && !get(&f.scroll, 4))
+            return false;
+        if ((flags & 4) && !(get(&f.brush, 1) && get(&f.brushRadius, 4)))
+            return false;
+        if ((flags & 8) && !get(&f.history, 1))
+            return false;
+    }
+    return true;
+}
+
+bool writeFrameTimings(const char* path, unsigned long long frames)
+{
+    std::ofstream file(path);
+    if (!file)
+        return false;
+    file << "frame,sim_ms,render_ms,chunks,tiles,upload_bytes\n";
+    for (unsigned long long i = 0; i < frames && i < frameTimings.size(); ++i)
+    {
+        const FrameTiming& t = frameTimings[i];
+        file << i + 1 << "," << t.simMs << "," << t.renderMs << "," << t.chunks << "," << t.tiles << "," << t.uploadBytes << "\n";
+    }
+    return (bool)file;
+}
+
+void resolveLightingUniforms(const Shader& shader, LightingUniforms& u)
+{
+    auto location = [&](const std::string& name) { return glGetUniformLocation(shader.ID, name.c_str()); };
+    u.viewPos = location("viewPos");
+    u.projection = location("projection");
+    u.view = location("view");
+    u.model = location("model");
+    u.dirDirection = location("dirLight.direction");
+    u.dirAmbient = location("dirLight.ambient");
+    u.dirDiffuse = location("dirLight.diffuse");
+    u.dirSpecular = location("dirLight.specular");
+    for (int i = 0; i < NR_POINT_LIGHTS; ++i)
+    {
+        std::string idx = "pointLights[" + std::to_string(i) + "].";
+        u.pointPosition[i] = location(idx + "position");
+        u.pointAmbient[i] = location(idx + "ambient");
+        u.pointDiffuse[i] = location(idx + "diffuse");
+        u.pointSpecular[i] = location(idx + "specular");
+        u.pointConstant[i] = location(idx + "constant");
+        u.pointLinear[i] = location(idx + "linear");
+        u.pointQuadratic[i] = location(idx + "quadratic");
+    }
+    u.materialDiffuse = location("material.diffuse");
+    u.materialSpecular = location("material.specular");
+    u.materialShininess = location("material.shininess");
+    u.activePointLights = location("activePointLights");
+}
+
+// false if some mesh could not be placed in the GPU heap and was skipped
+// cameraState is replaced by the late-latched camera the frame is drawn with
+bool renderFrame(Shader& lightingShader, const LightingUniforms& u, const FramePacket& packet, CameraState& cameraState, TerrainBuffers& terrain, unsigned long long frame)
+{
+    // render
+    {
+        PROFILE_GPU_ZONE("clear");
+        glClearColor(0.2f, 0.25f, 0.3f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // use lighting shader
+    {
+        PROFILE_ZONE("uniforms");
+        lightingShader.use();
+
+        // directional light
+        glUniform3fv(u.dirDirection, 1, glm::value_ptr(packet.dirLightDirection));
+        glUniform3f(u.dirAmbient, 0.05f, 0.05f, 0.05f);
+        glUniform3f(u.dirDiffuse, 0.4f, 0.4f, 0.4f);
+        glUniform3f(u.dirSpecular, 0.5f, 0.5f, 0.5f);
+
+        // point lights
+        glUniform1i(u.activePointLights, (int)qualityGovernor.value(QUALITY_POINT_LIGHTS));
+        for (int i = 0; i < NR_POINT_LIGHTS; ++i) {
+            glUniform3fv(u.pointPosition[i], 1, glm::value_ptr(packet.pointLightPositions[i]));
+            glUniform3f(u.pointAmbient[i], 0.05f, 0.05f, 0.05f);
+            glUniform3f(u.pointDiffuse[i], 0.8f, 0.8f, 0.8f);
+            glUniform3f(u.pointSpecular[i], 1.0f, 1.0f, 1.0f);
+            glUniform1f(u.pointConstant[i], 1.0f);
+            glUniform1f(u.pointLinear[i], 0.002f);
+            glUniform1f(u.pointQuadratic[i], 0.0002f);
+        }
+
+        // late latch: the newest camera the sim has published (it polls
+        // input while this thread draws), and the stamp of its input
+        {
+            std::lock_guard<std::mutex> lock(cameraMutex);
+            cameraState = latchedCamera;
+            inputLatched = cameraState.inputNs != 0;
+        }
+
+        // view/projection
+        glUniform3fv(u.viewPos, 1, glm::value_ptr(cameraState.position));
+        glm::mat4 projection = glm::perspective(glm::radians(cameraState.zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 200.0f);
+        glm::mat4 view = glm::lookAt(cameraState.position, cameraState.position + cameraState.front, cameraState.up);
+        glUniformMatrix4fv(u.projection, 1, GL_FALSE, glm::value_ptr(projection));
+        glUniformMatrix4fv(u.view, 1, GL_FALSE, glm::value_ptr(view));
+
+        // terrain material
+        glUniform3f(u.materialDiffuse, 0.2f, 0.7f, 0.2f);
+        glUniform3f(u.materialSpecular, 0.2f, 0.2f, 0.2f);
+        glUniform1f(u.materialShininess, 32.0f);
+    }
+
+    // draw terrain: one base-vertex draw per mesh. meshes sit on whole grid
+    // cells and grid point N/2 is the world origin; the remaining sub-cell
+    // offset is part of the model translation
+    PROFILE_ZONE("draw terrain");
+    PROFILE_GPU_ZONE("terrain");
+    glBindVertexArray(terrain.vao());
+    uint64_t draws = 0, triangles = 0;
+    bool complete = true;
+    float maxPixelError = qualityGovernor.value(QUALITY_LOD_ERROR);
+    float pixelsPerUnit = framebufferHeight.load() * qualityGovernor.renderScale() / (2.0f * std::tan(glm::radians(cameraState.zoom) * 0.5f));
+    for (int i = 0; i < packet.terrainCount; ++i)
+    {
+        const TerrainMesh& mesh = *packet.terrain[i].get();
+        float shiftX = (mesh.originX - gridN / 2) * terrainScale - cameraState.terrainOffsetX;
+        float shiftZ = (mesh.originZ - gridN / 2) * terrainScale - cameraState.terrainOffsetZ;
+
+        // coarsest stride whose projected error, at the chunk's nearest
+        // point, stays within the allowed pixels
+        float half = (mesh.size - 1) * terrainScale * 0.5f;
+        glm::vec3 center(shiftX + half, (mesh.minY + mesh.maxY) * 0.5f, shiftZ + half);
+        float radius = glm::length(glm::vec3(half, (mesh.maxY - mesh.minY) * 0.5f, half));
+        float distance = std::max(glm::length(cameraState.position - center) - radius, 1.0f);
+        int stride = 1;
+        for (int level = 1; level < LOD_LEVELS; ++level)
+            if (mesh.lodError[level] > 0.0f && mesh.lodError[level] * pixelsPerUnit / distance <= maxPixelError)
+                stride = LOD_STRIDES[level];
+
+        TerrainBuffers::DrawRange range;
+        if (!terrain.prepare(mesh, stride, frame, range))
+        {
+            complete = false;
+            continue;
+        }
+        glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(shiftX, 0.0f, shiftZ));
+        glUniformMatrix4fv(u.model, 1, GL_FALSE, glm::value_ptr(model));
+        glDrawElementsBaseVertex(GL_TRIANGLES, range.indexCount, GL_UNSIGNED_INT, (void*)(range.indexOffset * sizeof(unsigned int)), range.baseVertex);
+        ++draws;
+        triangles += range.indexCount / 3;
+    }
+    metrics.drawCalls.fetch_add(draws, std::memory_order_relaxed);
+    metrics.triangles.fetch_add(triangles, std::memory_order_relaxed);
+    return complete;
+}
+
+
+// --- terrain GPU buffers ---------------------------------------------------
+void RangeAllocator::reset(size_t capacity)
+{
+    // at most one free range more than there are live blocks
+    freeRanges.reserve(256);
+    freeRanges.assign(1, { 0, capacity });
+}
+
+bool RangeAllocator::allocate(size_t count, size_t& offset)
+{
+    for (size_t i = 0; i < freeRanges.size(); ++i)
+    {
+        Range& r = freeRanges[i];
+        if (r.count < count)
+            continue;
+        offset = r.offset;
+        r.offset += count;
+        r.count -= count;
+        if (r.count == 0)
+            freeRanges.erase(freeRanges.begin() + i);
+        return true;
+    }
+    return false;
+}
+
+void RangeAllocator::free(size_t offset, size_t count)
+{
+    auto next = std::lower_bound(freeRanges.begin(), freeRanges.end(), offset, [](const Range& r, size_t o) { return r.offset < o; });
+    bool joinPrev = next != freeRanges.begin() && (next - 1)->offset + (next - 1)->count == offset;
+    bool joinNext = next != freeRanges.end() && offset + count == next->offset;
+    if (joinPrev && joinNext)
+    {
+        (next - 1)->count += count + next->count;
+        freeRanges.erase(next);
+    }
+    else if (joinPrev)
+    {
+        (next - 1)->count += count;
+    }
+    else if (joinNext)
+    {
+        next->offset = offset;
+        next->count += count;
+    }
+    else
+    {
+        freeRanges.insert(next, { offset, count });
+    }
+}
+
+size_t RangeAllocator::freeUnits() const
+{
+    size_t units = 0;
+    for (const Range& r : freeRanges)
+        units += r.count;
+    return units;
+}
+
+// the vertex heap takes whatever the gpu-terrain budget leaves after indices.
+// a budget too small for the minimum heap is raised to what is allocated,
+// so the memory report never shows a heap over its budget
+void TerrainBuffers::create()
+{
+    const size_t stride = 8 * sizeof(float);
+    size_t budget = memoryBudget.budget(MEM_GPU_TERRAIN);
+    size_t indexBytes = TERRAIN_INDEX_CAPACITY * sizeof(unsigned int);
+    vertexCapacity = budget > indexBytes ? (budget - indexBytes) / stride : 0;
+    if (vertexCapacity < TERRAIN_MIN_VERTEX_CAPACITY)
+    {
+        vertexCapacity = TERRAIN_MIN_VERTEX_CAPACITY;
+        size_t heapBytes = vertexCapacity * stride + indexBytes;
+        std::cout << "gpu-terrain budget of " << budget / 1024 << " KB is below the smallest terrain heap, using " << heapBytes / 1024 << " KB" << std::endl;
+        memoryBudget.setBudget(MEM_GPU_TERRAIN, heapBytes);
+    }
+    vertexSpace.reset(vertexCapacity);
+    indexSpace.reset(TERRAIN_INDEX_CAPACITY);
+
+    glGenVertexArrays(1, &vertexArray);
+    glGenBuffers(1, &vertexBuffer);
+    glGenBuffers(1, &indexBuffer);
+
+    glBindVertexArray(vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexCapacity * stride, NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, TERRAIN_INDEX_CAPACITY * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+
+    // layout
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
+    glEnableVertexAttribArray(2);
+}
+
+void TerrainBuffers::destroy()
+{
+    for (GpuMesh& m : meshes)
+        if (m.mesh)
+            release(m);
+    for (IndexPattern& p : patterns)
+    {
+        if (p.size)
+            memoryBudget.release(MEM_GPU_TERRAIN, p.count * sizeof(unsigned int));
+        p = IndexPattern();
+    }
+    glDeleteVertexArrays(1, &vertexArray);
+    glDeleteBuffers(1, &vertexBuffer);
+    glDeleteBuffers(1, &indexBuffer);
+}
+
+// indices only depend on the mesh size; each pattern is built once
+const TerrainBuffers::IndexPattern* TerrainBuffers::indexPattern(int size, int stride)
+{
+    for (const IndexPattern& p : patterns)
+        if (p.size == size && p.stride == stride)
+            return &p;
+    for (IndexPattern& p : patterns)
+    {
+        if (p.size != 0)
+            continue;
+        AllowAllocations once;
+        std::vector<unsigned int> indices;
+        if (stride == 1)
+            buildTerrainIndices(size, indices);
+        else
+            buildLodIndices(size, stride, indices);
+        if (!indexSpace.allocate(indices.size(), p.offset))
+            return nullptr;
+        memoryBudget.charge(MEM_GPU_TERRAIN, indices.size() * sizeof(unsigned int));
+        glBindVertexArray(vertexArray);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, p.offset * sizeof(unsigned int), indices.size() * sizeof(unsigned int), indices.data());
+        p.size = size;
+        p.stride = stride;
+        p.count = indices.size();
+        return &p;
+    }
+    return nullptr;
+}
+
+void TerrainBuffers::release(GpuMesh& gpu)
+{
+    vertexSpace.free(gpu.vertexOffset, gpu.vertexCount);
+    memoryBudget.release(MEM_GPU_TERRAIN, gpu.vertexCount * 8 * sizeof(float));
+    gpu = GpuMesh();
+}
+
+// uploads the mesh unless this version is already resident; an edit of a
+// resident version only patches its dirty rows. false if it cannot be
+// placed (the mesh is then skipped for this frame)
+bool TerrainBuffers::prepare(const TerrainMesh& mesh, int stride, unsigned long long frame, DrawRange& range)
+{
+    const IndexPattern* pattern = indexPattern(mesh.size, stride);
+    if (!pattern)
+        return false;
+
+    GpuMesh* gpu = nullptr;
+    GpuMesh* base = nullptr;
+    for (GpuMesh& m : meshes)
+    {
+        if (m.mesh == &mesh && m.version == mesh.version)
+        {
+            gpu = &m;
+            break;
+        }
+        if (mesh.baseVersion && m.mesh && m.version == mesh.baseVersion && m.vertexCount * 8 == mesh.vertices.size())
+            base = &m;
+    }
+    if (!gpu && base)
+    {
+        patch(*base, mesh);
+        gpu = base;
+    }
+    if (!gpu)
+    {
+        PROFILE_ZONE("upload mesh");
+        const size_t count = mesh.vertices.size() / 8;
+        size_t offset = 0;
+        for (int attempt = 0; attempt < 2 && !gpu; ++attempt)
+        {
+            if (attempt == 1)
+            {
+                // out of space: drop everything this frame has not drawn yet
+                unsigned long long evicted = 0;
+                for (GpuMesh& m : meshes)
+                {
+                    if (m.mesh && m.lastUsed < frame)
+                    {
+                        release(m);
+                        ++evicted;
+                    }
+                }
+                memoryBudget.countEvictions(MEM_GPU_TERRAIN, evicted);
+            }
+            for (GpuMesh& m : meshes)
+            {
+                if (!m.mesh)
+                {
+                    if (vertexSpace.allocate(count, offset))
+                        gpu = &m;
+                    break;
+                }
+            }
+        }
+        if (!gpu)
+            return false;
+
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glBufferSubData(GL_ARRAY_BUFFER, offset * 8 * sizeof(float), count * 8 * sizeof(float), mesh.vertices.data());
+        metrics.uploadBytes.fetch_add(count * 8 * sizeof(float), std::memory_order_relaxed);
+        gpu->mesh = &mesh;
+        gpu->version = mesh.version;
+        gpu->vertexOffset = offset;
+        gpu->vertexCount = count;
+        memoryBudget.charge(MEM_GPU_TERRAIN, count * 8 * sizeof(float));
+        uploadedThisFrame = true;
+    }
+    gpu->lastUsed = frame;
+    range.indexCount = (GLsizei)pattern->count;
+    range.indexOffset = pattern->offset;
+    range.baseVertex = (GLint)gpu->vertexOffset;
+    return true;
+}
+
+// rewrites the dirty rectangle of an edited mesh over the copy of the
+// version it was made from, one range per row (or one for full rows)
+void TerrainBuffers::patch(GpuMesh& gpu, const TerrainMesh& mesh)
+{
+    PROFILE_ZONE("patch mesh");
+    const size_t stride = 8 * sizeof(float);
+    const int N = mesh.size;
+    const int width = mesh.dirtyX1 - mesh.dirtyX0 + 1;
+    size_t bytes = 0;
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    if (width == N)
+    {
+        size_t first = (size_t)mesh.dirtyZ0 * N;
+        bytes = (size_t)(mesh.dirtyZ1 - mesh.dirtyZ0 + 1) * N * stride;
+        glBufferSubData(GL_ARRAY_BUFFER, (gpu.vertexOffset + first) * stride, bytes, &mesh.vertices[first * 8]);
+    }
+    else
+    {
+        for (int z = mesh.dirtyZ0; z <= mesh.dirtyZ1; ++z)
+        {
+            size_t first = (size_t)z * N + mesh.dirtyX0;
+            glBufferSubData(GL_ARRAY_BUFFER, (gpu.vertexOffset + first) * stride, width * stride, &mesh.vertices[first * 8]);
+            bytes += width * stride;
+        }
+    }
+    metrics.uploadBytes.fetch_add(bytes, std::memory_order_relaxed);
+    gpu.mesh = &mesh;
+    gpu.version = mesh.version;
+    uploadedThisFrame = true;
+}
+
+// frees meshes no recent packet referenced; frames without uploads compact
+void TerrainBuffers::endFrame(unsigned long long frame)
+{
+    for (GpuMesh& m : meshes)
+        if (m.mesh && m.lastUsed + GPU_MESH_KEEP_FRAMES < frame)
+            release(m);
+    if (!uploadedThisFrame)
+        compact(GPU_COMPACT_MOVES);
+    uploadedThisFrame = false;
+}
+
+// moves the highest block into the lowest free range that fits, if that
+// range is further down; a copy within the VBO, no CPU round trip
+void TerrainBuffers::compact(int maxMoves)
+{
+    for (int move = 0; move < maxMoves; ++move)
+    {
+        GpuMesh* top = nullptr;
+        for (GpuMesh& m : meshes)
+            if (m.mesh && (!top || m.vertexOffset > top->vertexOffset))
+                top = &m;
+        if (!top)
+            return;
+
+        PROFILE_ZONE("compact terrain heap");
+        size_t offset;
+        if (!vertexSpace.allocate(top->vertexCount, offset))
+            return;
+        if (offset > top->vertexOffset)
+        {
+            vertexSpace.free(offset, top->vertexCount);
+            return;
+        }
+        const size_t stride = 8 * sizeof(float);
+        glBindBuffer(GL_COPY_READ_BUFFER, vertexBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, vertexBuffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, top->vertexOffset * stride, offset * stride, top->vertexCount * stride);
+        vertexSpace.free(top->vertexOffset, top->vertexCount);
+        top->vertexOffset = offset;
+    }
+}
+
+
+// --- terrain generator -----------------------------------------------------
+void generateTerrain(std::vector<float>& vertices, std::vector<unsigned int>& indices, int N, float scale, float offsetX, float offsetZ, float amplitude, float freq)
+{
+    PROFILE_PERF_ZONE("generateTerrain");
+    // heights grid (scratch)
+    ArenaScope scratch(threadArena());
+    float* heights = threadArena().alloc<float>(N * N);
+    for (int z = 0; z < N; ++z)
+    {
+        for (int x = 0; x < N; ++x)
+        {
+            float wx = (float)x;
+            float wz = (float)z;
+            float h = sampleHeight(wx * scale, wz * scale, offsetX, offsetZ, amplitude, freq);
+            heights[z * N + x] = h;
+        }
+    }
+
+    buildTerrainVertices(heights, N, scale, vertices);
+    buildTerrainIndices(N, indices);
+}
+
+void buildTerrainVertices(const float* heights, int N, float scale, std::vector<float>& vertices)
+{
+    PROFILE_PERF_ZONE("build vertices");
+    vertices.clear();
+    vertices.reserve(N * N * 8);
+
+    // build vertices with normals computed via central differences
+    for (int z = 0; z < N; ++z)
+    {
+        for (int x = 0; x < N; ++x)
+        {
+            float px = (x - N/2) * scale; // center grid around origin
+            float pz = (z - N/2) * scale;
+            float py = heights[z * N + x];
+
+            // compute normals by sampling neighbors
+            float hl = (x > 0) ? heights[z * N + (x - 1)] : heights[z * N + x];
+            float hr = (x < N-1) ? heights[z * N + (x + 1)] : heights[z * N + x];
+            float hd = (z > 0) ? heights[(z - 1) * N + x] : heights[z * N + x];
+            float hu = (z < N-1) ? heights[(z + 1) * N + x] : heights[z * N + x];
+
+            glm::vec3 normal;
+            normal.x = hl - hr; // -dh/dx approx
+            normal.y = 2.0f * scale; // arbitrary to keep y positive
+            normal.z = hd - hu; // -dh/dz approx
+            normal = glm::normalize(normal);
+
+            // texcoords
+            float u = (float)x / (N - 1);
+            float v = (float)z / (N - 1);
+
+            // push: pos(3), normal(3), tex(2)
+            vertices.push_back(px);
+            vertices.push_back(py);
+            vertices.push_back(pz);
+            vertices.push_back(normal.x);
+            vertices.push_back(normal.y);
+            vertices.push_back(normal.z);
+            vertices.push_back(u);
+            vertices.push_back(v);
+        }
+    }
+}
+
+void buildTerrainIndices(int N, std::vector<unsigned int>& indices)
+{
+    indices.clear();
+    indices.reserve((N - 1) * (N - 1) * 6);
+
+    // indices (two triangles per quad)
+    for (int z = 0; z < N - 1; ++z)
+    {
+        for (int x = 0; x < N - 1; ++x)
+        {
+            unsigned int i0 = z * N + x;
+            unsigned int i1 = z * N + (x + 1);
+            unsigned int i2 = (z + 1) * N + x;
+            unsigned int i3 = (z + 1) * N + (x + 1);
+
+            // triangle 1
+            indices.push_back(i0);
+            indices.push_back(i2);
+            indices.push_back(i1);
+            // triangle 2
+            indices.push_back(i1);
+            indices.push_back(i2);
+            indices.push_back(i3);
+        }
+    }
+}
+
+// an N x N grid drawn in stride x stride cells (stride even, dividing N - 1).
+// cells on the grid's edge fan out from their centre to every edge vertex,
+// so the outline matches a full-resolution neighbour; winding as above
+void buildLodIndices(int N, int stride, std::vector<unsigned int>& indices)
+{
+    const int cells = (N - 1) / stride;
+    indices.clear();
+    indices.reserve(cells * cells * 6 + cells * 4 * stride * 3);
+    std::vector<unsigned int> rim;
+    for (int cz = 0; cz < cells; ++cz)
+    {
+        for (int cx = 0; cx < cells; ++cx)
+        {
+            int x0 = cx * stride, z0 = cz * stride;
+            int x1 = x0 + stride, z1 = z0 + stride;
+            bool west = cx == 0, east = cx == cells - 1, north = cz == 0, south = cz == cells - 1;
+            if (!(west || east || north || south))
+            {
+                unsigned int i0 = z0 * N + x0, i1 = z0 * N + x1, i2 = z1 * N + x0, i3 = z1 * N + x1;
+                indices.insert(indices.end(), { i0, i2, i1, i1, i2, i3 });
+                continue;
+            }
+
+            // the cell outline from (x0, z0) down the west side, then along
+            // the south, up the east and back along the north side
+            rim.clear();
+            for (int z = z0; z < z1; z += west ? 1 : stride)
+                rim.push_back(z * N + x0);
+            for (int x = x0; x < x1; x += south ? 1 : stride)
+                rim.push_back(z1 * N + x);
+            for (int z = z1; z > z0; z -= east ? 1 : stride)
+                rim.push_back(z * N + x1);
+            for (int x = x1; x > x0; x -= north ? 1 : stride)
+                rim.push_back(z0 * N + x);
+            unsigned int center = (z0 + stride / 2) * N + (x0 + stride / 2);
+            for (size_t k = 0; k < rim.size(); ++k)
+                indices.insert(indices.end(), { center, rim[k], rim[(k + 1) % rim.size()] });
+        }
+    }
+}
+
+// height error of each LOD stride: the largest gap between a vertex and the
+// bilinear surface of the coarse cell it falls in (edges are exact)
+void computeLodErrors(TerrainMesh& mesh)
+{
+    const int N = mesh.size;
+    auto height = [&](int x, int z) { return mesh.vertices[(z * N + x) * 8 + 1]; };
+    mesh.minY = mesh.maxY = height(0, 0);
+    for (int i = 0; i < N * N; ++i)
+    {
+        mesh.minY = std::min(mesh.minY, mesh.vertices[i * 8 + 1]);
+        mesh.maxY = std::max(mesh.maxY, mesh.vertices[i * 8 + 1]);
+    }
+    mesh.lodError[0] = 0.0f;
+    for (int level = 1; level < LOD_LEVELS; ++level)
+    {
+        const int s = LOD_STRIDES[level];
+        float worst = 0.0f;
+        for (int z = 1; z < N - 1; ++z)
+        {
+            int z0 = std::min(z / s * s, N - 1 - s);
+            float tz = (float)(z - z0) / s;
+            for (int x = 1; x < N - 1; ++x)
+            {
+                int x0 = std::min(x / s * s, N - 1 - s);
+                float tx = (float)(x - x0) / s;
+                float h0 = height(x0, z0) + (height(x0 + s, z0) - height(x0, z0)) * tx;
+                float h1 = height(x0, z0 + s) + (height(x0 + s, z0 + s) - height(x0, z0 + s)) * tx;
+                worst = std::max(worst, std::abs(height(x, z) - (h0 + (h1 - h0) * tz)));
+            }
+        }
+        mesh.lodError[level] = std::max(worst, 1e-6f);
+    }
+}
+
+// vertices of an N x N chunk from heights with a one-sample halo on every
+// side ((N + 2) x (N + 2)), so edge normals match the neighbouring chunks
+void buildChunkVertices(const float* halo, int N, float scale, std::vector<float>& vertices)
+{
+    PROFILE_PERF_ZONE("build chunk vertices");
+    const int H = N + 2;
+    vertices.clear();
+    vertices.reserve(N * N * 8);
+
+    for (int z = 0; z < N; ++z)
+    {
+        for (int x = 0; x < N; ++x)
+        {
+            const float* h = &halo[(z + 1) * H + (x + 1)];
+            glm::vec3 normal = glm::normalize(glm::vec3(h[-1] - h[1], 2.0f * scale, h[-H] - h[H]));
+
+            vertices.push_back(x * scale);
+            vertices.push_back(h[0]);
+            vertices.push_back(z * scale);
+            vertices.push_back(normal.x);
+            vertices.push_back(normal.y);
+            vertices.push_back(normal.z);
+            vertices.push_back((float)x / (N - 1));
+            vertices.push_back((float)z / (N - 1));
+        }
+    }
+}
+
+// rewrites height and normal of chunk vertices [x0, x1] x [z0, z1] (local,
+// inclusive) from P x P heights starting at world sample (originX, originZ),
+// which must cover the rectangle plus one sample. same arithmetic as
+// buildChunkVertices, so an edited chunk matches a rebuilt one exactly
+void updateChunkVertices(TerrainMesh& mesh, const float* heights, int P, int originX, int originZ, int x0, int z0, int x1, int z1, float scale)
+{
+    const int N = mesh.size;
+    for (int z = z0; z <= z1; ++z)
+    {
+        for (int x = x0; x <= x1; ++x)
+        {
+            const float* h = &heights[(mesh.originZ + z - originZ) * P + (mesh.originX + x - originX)];
+            glm::vec3 normal = glm::normalize(glm::vec3(h[-1] - h[1], 2.0f * scale, h[-P] - h[P]));
+            float* v = &mesh.vertices[((size_t)z * N + x) * 8];
+            v[1] = h[0];
+            v[3] = normal.x;
+            v[4] = normal.y;
+            v[5] = normal.z;
+        }
+    }
+}
+
+float sampleHeight(float x, float z, float offsetX, float offsetZ, float amplitude, float freq)
+{
+    return shapeHeight(sampleOctaves(x + offsetX, z + offsetZ, freq, 0, TERRAIN_OCTAVES), amplitude);
+}
+
+// raw fbm sum of octaves [firstOctave, lastOctave); sums of adjacent ranges add up
+float sampleOctaves(float x, float z, float freq, int firstOctave, int lastOctave)
+{
+    float height = 0.0f;
+    float amp = std::pow(TERRAIN_PERSISTENCE, (float)firstOctave); // start with 1, scale later
+    float f = freq * std::pow(TERRAIN_LACUNARITY, (float)firstOctave);
+
+    for (int i = firstOctave; i < lastOctave; ++i)
+    {
+        float n = stb_perlin_noise3(x * f, 0.0f, z * f, 0, 0, 0); // [-1,1]
+        height += n * amp;
+        amp *= TERRAIN_PERSISTENCE;
+        f *= TERRAIN_LACUNARITY;
+    }
+    return height;
+}
+
+float shapeHeight(float raw, float amplitude)
+{
+    // normalize to [0,1]
+    float height = (raw + 1.0f) / 2.0f;
+
+    // non-linear shaping: exaggerate peaks
+    height = pow(height, 1.5f); // >1 → taller mountains, <1 → flatter
+
+    return height * amplitude;
+}
+
+
+// --- terrain sculpting -----------------------------------------------------
+// chunks in flight keep their meshes; a visible chunk with a changed height
+// in [ex0, ex1] x [ez0, ez1] (world samples) gets a copy with those heights
+// and the normals around them rewritten. heights (N x N from originX,
+// originZ) cover the chunk's part of the rectangle plus two samples
+static void updateEditedChunk(TerrainView& view, int chunk, const float* heights, int N, int originX, int originZ, int ex0, int ez0, int ex1, int ez1)
+{
+    const TerrainMesh& old = *view.chunks[chunk].get();
+    int lx0 = std::max(ex0 - 1 - old.originX, 0), lx1 = std::min(ex1 + 1 - old.originX, old.size - 1);
+    int lz0 = std::max(ez0 - 1 - old.originZ, 0), lz1 = std::min(ez1 + 1 - old.originZ, old.size - 1);
+    if (lx0 > lx1 || lz0 > lz1)
+        return;
+    MeshRef mesh = chunkPool.acquire();
+    mesh->vertices = old.vertices;
+    mesh->size = old.size;
+    mesh->originX = old.originX;
+    mesh->originZ = old.originZ;
+    updateChunkVertices(*mesh.get(), heights, N, originX, originZ, lx0, lz0, lx1, lz1, terrainScale);
+    mesh->version = ++terrainMeshVersion;
+    mesh->baseVersion = old.version;
+    mesh->dirtyX0 = lx0;
+    mesh->dirtyZ0 = lz0;
+    mesh->dirtyX1 = lx1;
+    mesh->dirtyZ1 = lz1;
+    computeLodErrors(*mesh.get());
+    view.chunks[chunk] = mesh;
+}
+
+// one brush step over the visible chunks; false if no height changed. the
+// cost follows the brush footprint, never the size of the terrain
+bool applyBrush(TerrainView& view, const BrushStroke& stroke, float dt)
+{
+    PROFILE_ZONE("apply brush");
+    if (view.preview)
+        return false;                   // chunk tiles are still streaming in
+
+    // footprint, with two samples around it: the smoothing kernel reads one,
+    // the normals of the vertices next to a changed height read two
+    const float r = stroke.radius / terrainScale;
+    const int x0 = (int)std::ceil(stroke.centerX - r), x1 = (int)std::floor(stroke.centerX + r);
+    const int z0 = (int)std::ceil(stroke.centerZ - r), z1 = (int)std::floor(stroke.centerZ + r);
+    const int B = 2;
+    const int N = std::max(x1 - x0, z1 - z0) + 1 + 2 * B;
+    const int originX = x0 - B, originZ = z0 - B;
+    ArenaScope scratch(threadArena());
+    float* before = threadArena().alloc<float>(N * N);
+    float* after = threadArena().alloc<float>(N * N);
+    assembleTerrainHeights(before, N, originX, originZ);
+    std::copy(before, before + N * N, after);
+
+    int ex0 = INT_MAX, ez0 = INT_MAX, ex1 = INT_MIN, ez1 = INT_MIN;
+    for (int z = z0; z <= z1; ++z)
+    {
+        for (int x = x0; x <= x1; ++x)
+        {
+            float dx = (x - stroke.centerX) / r, dz = (z - stroke.centerZ) / r;
+            float d2 = dx * dx + dz * dz;
+            if (d2 >= 1.0f)
+                continue;
+            float falloff = (1.0f - d2) * (1.0f - d2);
+            int i = (z - originZ) * N + (x - originX);
+            float h = before[i], target = stroke.flattenHeight;
+            if (stroke.mode == BRUSH_RAISE || stroke.mode == BRUSH_LOWER)
+            {
+                after[i] = h + (stroke.mode == BRUSH_RAISE ? 1.0f : -1.0f) * BRUSH_RATE * falloff * dt;
+            }
+            else
+            {
+                if (stroke.mode == BRUSH_SMOOTH)
+                    target = (before[i - 1] + before[i + 1] + before[i - N] + before[i + N] + h) * 0.2f;
+                after[i] = h + (target - h) * std::min(1.0f, BRUSH_BLEND_RATE * falloff * dt);
+            }
+            if (after[i] == h)
+                continue;
+            ex0 = std::min(ex0, x);
+            ex1 = std::max(ex1, x);
+            ez0 = std::min(ez0, z);
+            ez1 = std::max(ez1, z);
+        }
+    }
+    if (ex0 > ex1)
+        return false;
+
+    // copy on write: readers may be inside any resident tile right now. the
+    // change also goes into the edit layer, which outlives the tile
+    {
+        AllowAllocations edit;
+        for (int tz = floorDiv(ez0, TILE_N); tz <= floorDiv(ez1, TILE_N); ++tz)
+        {
+            for (int tx = floorDiv(ex0, TILE_N); tx <= floorDiv(ex1, TILE_N); ++tx)
+            {
+                HeightTile* copy = new HeightTile;
+                copy->tileX = tx;
+                copy->tileZ = tz;
+                {
+                    EpochGuard guard;
+                    const HeightTile* tile = tileTable.find(0, tx, tz);
+                    if (!tile)
+                    {
+                        delete copy;
+                        continue;
+                    }
+                    std::memcpy(copy->heights, tile->heights, sizeof(copy->heights));
+                    int cx0 = std::max(ex0, tx * TILE_N), cx1 = std::min(ex1, tx * TILE_N + TILE_N - 1);
+                    int cz0 = std::max(ez0, tz * TILE_N), cz1 = std::min(ez1, tz * TILE_N + TILE_N - 1);
+                    for (int z = cz0; z <= cz1; ++z)
+                    {
+                        const float* src = &after[(z - originZ) * N + (cx0 - originX)];
+                        std::copy(src, src + (cx1 - cx0 + 1), &copy->heights[(z - tz * TILE_N) * TILE_N + (cx0 - tx * TILE_N)]);
+                    }
+                    editHistory.touch(tx, tz);
+                    editLayer.record(tx, tz, tile->heights, copy->heights);
+                }
+                tileTable.replace(copy);
+            }
+        }
+        tileEpochs.collect();
+    }
+
+    for (int i = 0; i < view.chunkCount; ++i)
+        updateEditedChunk(view, i, after, N, originX, originZ, ex0, ez0, ex1, ez1);
+    return true;
+}
+
+// first terrain hit along a world-space ray: fixed steps of a grid cell,
+// then bisection of the step that crossed the surface
+bool raycastTerrain(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, glm::vec3& hit)
+{
+    const float shiftX = terrainOffsetX + gridN / 2 * terrainScale;
+    const float shiftZ = terrainOffsetZ + gridN / 2 * terrainScale;
+    auto clearance = [&](float t)
+    {
+        glm::vec3 p = origin + direction * t;
+        return p.y - terrainHeightAt(p.x + shiftX, p.z + shiftZ);
+    };
+    if (clearance(0.0f) < 0.0f)
+        return false;
+    for (float t = terrainScale; t <= maxDistance; t += terrainScale)
+    {
+        if (clearance(t) > 0.0f)
+            continue;
+        float lo = t - terrainScale, hi = t;
+        for (int i = 0; i < 12; ++i)
+        {
+            float mid = (lo + hi) * 0.5f;
+            (clearance(mid) > 0.0f ? lo : hi) = mid;
+        }
+        hit = origin + direction * hi;
+        return true;
+    }
+    return false;
+}
+
+// the frame's brush input, aimed through the screen centre (the cursor is
+// captured); flatten holds the height where the stroke started. undo and
+// redo only act between strokes
+bool sculptTerrain(TerrainView& view, const InputFrame& input, float dt)
+{
+    if (!input.brush)
+    {
+        if (brushStroking)
+            editHistory.endStroke();
+        brushStroking = false;
+        if (input.history == HISTORY_UNDO)
+            return editHistory.undo(view);
+        if (input.history == HISTORY_REDO)
+            return editHistory.redo(view);
+        return false;
+    }
+    glm::vec3 hit;
+    if (!raycastTerrain(camera.Position, camera.Front, BRUSH_RAY_DISTANCE, hit))
+        return false;
+    if (!brushStroking)
+        brushFlattenHeight = hit.y;
+    brushStroking = true;
+
+    BrushStroke stroke;
+    stroke.mode = (BrushMode)(input.brush - 1);
+    stroke.radius = std::clamp(input.brushRadius, BRUSH_MIN_RADIUS, BRUSH_MAX_RADIUS);
+    stroke.centerX = (hit.x + terrainOffsetX) / terrainScale + gridN / 2;
+    stroke.centerZ = (hit.z + terrainOffsetZ) / terrainScale + gridN / 2;
+    stroke.flattenHeight = brushFlattenHeight;
+    return applyBrush(view, stroke, dt);
+}
+
+
+// --- progressive refinement ------------------------------------------------
+void beginTerrainRefinement(TerrainRefinement& r, int N, float scale, int originX, int originZ, float amplitude, float freq)
+{
+    r.active = true;
+    r.level = 0;
+    r.row = 0;
+    r.N = N;
+    r.scale = scale;
+    r.originX = originX;
+    r.originZ = originZ;
+    r.amplitude = amplitude;
+    r.freq = freq;
+    r.raw.assign(N * N, 0.0f);
+    r.octaves.assign(N * N, 0);
+    r.heights.resize(N * N);
+    r.latticeX.resize(N);
+    r.latticeZ.resize(N);
+}
+
+// moves the grid to a new origin: samples still inside keep their octave
+// sums, and the last completed level is redone at once, which only samples
+// the uncovered strip, so the preview keeps its detail
+void shiftTerrainRefinement(TerrainRefinement& r, int originX, int originZ)
+{
+    PROFILE_ZONE("shiftTerrainRefinement");
+    const int N = r.N;
+    const int dx = originX - r.originX, dz = originZ - r.originZ;
+    {
+        ArenaScope scratch(threadArena());
+        float* raw = threadArena().alloc<float>(N * N);
+        unsigned char* octaves = threadArena().alloc<unsigned char>(N * N);
+        std::copy(r.raw.begin(), r.raw.end(), raw);
+        std::copy(r.octaves.begin(), r.octaves.end(), octaves);
+        for (int z = 0; z < N; ++z)
+        {
+            int sz = z + dz;
+            for (int x = 0; x < N; ++x)
+            {
+                int sx = x + dx;
+                bool inside = sx >= 0 && sx < N && sz >= 0 && sz < N;
+                r.raw[z * N + x] = inside ? raw[sz * N + sx] : 0.0f;
+                r.octaves[z * N + x] = inside ? octaves[sz * N + sx] : 0;
+            }
+        }
+    }
+    r.originX = originX;
+    r.originZ = originZ;
+    r.level = r.active ? std::max(r.level - 1, 0) : REFINE_LEVELS - 1;
+    r.row = 0;
+    r.active = true;
+    while (!refineTerrain(r, REFINE_BUDGET_MS)) {}
+}
+
+// grid coordinates of the lattice along one axis: the grid lines on world
+// multiples of step, plus both ends so every cell is covered
+static int latticeCoords(int origin, int step, int N, int* out)
+{
+    int count = 0;
+    out[count++] = 0;
+    for (int x = (step - origin % step) % step; x < N - 1; x += step)
+        if (x > 0)
+            out[count++] = x;
+    out[count++] = N - 1;
+    return count;
+}
+
+// advances the current level by whole lattice rows until the time budget is
+// spent; returns true when a level completed and r.heights was refreshed
+bool refineTerrain(TerrainRefinement& r, double budgetMs)
+{
+    if (!r.active)
+        return false;
+    PROFILE_PERF_ZONE("refineTerrain");
+
+    const int N = r.N;
+    const int step = REFINE_STEP[r.level];
+    const int octaves = REFINE_OCTAVES[r.level];
+    const int countX = latticeCoords(r.originX, step, N, r.latticeX.data());
+    const int countZ = latticeCoords(r.originZ, step, N, r.latticeZ.data());
+    auto start = std::chrono::steady_clock::now();
+
+    // accumulate the missing octaves of every lattice point, keeping what
+    // coarser levels already summed
+    for (; r.row < countZ; ++r.row)
+    {
+        int z = r.latticeZ[r.row];
+        for (int k = 0; k < countX; ++k)
+        {
+            int x = r.latticeX[k];
+            int i = z * N + x;
+            if (r.octaves[i] < octaves)
+            {
+                r.raw[i] += sampleOctaves((r.originX + x) * r.scale, (r.originZ + z) * r.scale, r.freq, r.octaves[i], octaves);
+                r.octaves[i] = (unsigned char)octaves;
+            }
+        }
+        std::chrono::duration<double, std::milli> spent = std::chrono::steady_clock::now() - start;
+        if (spent.count() > budgetMs && r.row + 1 < countZ)
+        {
+            ++r.row;
+            return false;
+        }
+    }
+
+    // shape lattice points, then fill the rest bilinearly from their cell
+    for (int j = 0; j < countZ; ++j)
+    {
+        int z = r.latticeZ[j];
+        for (int k = 0; k < countX; ++k)
+        {
+            int x = r.latticeX[k];
+            r.heights[z * N + x] = shapeHeight(r.raw[z * N + x], r.amplitude);
+        }
+    }
+    if (step > 1)
+    {
+        for (int z = 0, j = 0; z < N; ++z)
+        {
+            while (j + 2 < countZ && r.latticeZ[j + 1] <= z)
+                ++j;
+            int z0 = r.latticeZ[j], z1 = r.latticeZ[j + 1];
+            float tz = (float)(z - z0) / (z1 - z0);
+            for (int x = 0, k = 0; x < N; ++x)
+            {
+                while (k + 2 < countX && r.latticeX[k + 1] <= x)
+                    ++k;
+                int x0 = r.latticeX[k], x1 = r.latticeX[k + 1];
+                float tx = (float)(x - x0) / (x1 - x0);
+                float h0 = r.heights[z0 * N + x0] + (r.heights[z0 * N + x1] - r.heights[z0 * N + x0]) * tx;
+                float h1 = r.heights[z1 * N + x0] + (r.heights[z1 * N + x1] - r.heights[z1 * N + x0]) * tx;
+                r.heights[z * N + x] = h0 + (h1 - h0) * tz;
+            }
+        }
+    }
+
+    r.row = 0;
+    if (++r.level == REFINE_LEVELS)
+        r.active = false;
+    return true;
+}
+
+
+// --- memory ----------------------------------------------------------------
+std::atomic<unsigned long long> totalAllocations{0};
+std::atomic<unsigned long long> hotPathAllocations{0};
+std::atomic<bool> allocChecksArmed{false};
+
+// trivially initialized so operator new can touch them at any time
+thread_local int hotPathDepth = 0;
+thread_local int allowAllocDepth = 0;
+thread_local unsigned hotPathCount = 0;
+thread_local size_t hotPathBytes = 0;
+
+static void countAllocation(std::size_t size)
+{
+    totalAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (hotPathDepth > 0 && allowAllocDepth == 0)
+    {
+        ++hotPathCount;
+        hotPathBytes += size;
+    }
+}
+
+void* operator new(std::size_t size)
+{
+    countAllocation(size);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    countAllocation(size);
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void* operator new(std::size_t size, std::align_val_t align)
+{
+    countAllocation(size);
+    std::size_t a = (std::size_t)align;
+#ifdef _WIN32
+    if (void* p = _aligned_malloc(size ? size : 1, a))
+#else
+    if (void* p = std::aligned_alloc(a, (size + a - 1) / a * a + (size ? 0 : a)))
+#endif
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t align)
+{
+    return operator new(size, align);
+}
+
+// gcc flags free() on memory from a (replaced) operator new once these
+// are inlined, although the pairing is exactly what is intended here
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+#ifdef _WIN32
+static void freeAligned(void* p) noexcept { _aligned_free(p); }
+#else
+static void freeAligned(void* p) noexcept { std::free(p); }
+#endif
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { freeAligned(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { freeAligned(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { freeAligned(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { freeAligned(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+HotPathScope::HotPathScope(const char* name) : name(name), outermost(hotPathDepth == 0)
+{
+    if (outermost && allocChecksArmed.load(std::memory_order_relaxed))
+    {
+        hotPathCount = 0;
+        hotPathBytes = 0;
+        hotPathDepth = 1;
+    }
+    else if (!outermost)
+    {
+        ++hotPathDepth;
+    }
+    else
+    {
+        outermost = false;  // not armed yet: behave as a no-op scope
+    }
+}
+
+HotPathScope::~HotPathScope()
+{
+    if (!outermost)
+    {
+        if (hotPathDepth > 0)
+            --hotPathDepth;
+        return;
+    }
+    hotPathDepth = 0;
+    if (hotPathCount == 0)
+        return;
+
+    unsigned count = hotPathCount;
+    size_t bytes = hotPathBytes;
+    hotPathAllocations.fetch_add(count, std::memory_order_relaxed);
+    std::cout << "[alloc] " << count << " heap allocation(s), " << bytes << " bytes, in hot path '" << name << "'" << std::endl;
+    assert(count == 0 && "heap allocation in hot path");
+}
+
+AllowAllocations::AllowAllocations() { ++allowAllocDepth; }
+AllowAllocations::~AllowAllocations() { --allowAllocDepth; }
+
+FrameArena::~FrameArena()
+{
+    rewind(0);
+    std::free(memory);
+}
+
+void* FrameArena::allocBytes(size_t bytes, size_t align)
+{
+    if (!memory)
+        memory = static_cast<char*>(std::malloc(capacity));
+    size_t start = (used + align - 1) / align * align;
+    if (start + bytes <= capacity)
+    {
+        used = start + bytes;
+        return memory + start;
+    }
+
+    // over budget: heap fallback (reported as a hot path allocation)
+    void* p = operator new(bytes, std::align_val_t(std::max(align, sizeof(void*))));
+    used = std::max(used, capacity) + 1;
+    AllowAllocations bookkeeping;
+    overflow.push_back({ p, used });
+    return p;
+}
+
+void FrameArena::rewind(size_t mark)
+{
+    while (!overflow.empty() && overflow.back().tag > mark)
+    {
+        operator delete(overflow.back().p, std::align_val_t(sizeof(void*)));
+        overflow.pop_back();
+    }
+    used = mark;
+}
+
+static const char* const MEMORY_SUBSYSTEM_NAMES[MEM_SUBSYSTEM_COUNT] = { "tiles", "meshes", "gpu-terrain", "textures", "edits" };
+static const bool MEMORY_SUBSYSTEM_GPU[MEM_SUBSYSTEM_COUNT] = { false, false, true, true, false };
+
+void MemoryBudget::charge(MemorySubsystem s, size_t bytes)
+{
+    Counter& c = counters[s];
+    size_t used = c.used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    size_t peak = c.peak.load(std::memory_order_relaxed);
+    while (used > peak && !c.peak.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {}
+}
+
+void MemoryBudget::release(MemorySubsystem s, size_t bytes)
+{
+    counters[s].used.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+// bytes over budget, 0 when within it or unlimited
+size_t MemoryBudget::excess(MemorySubsystem s) const
+{
+    size_t limit = budget(s), inUse = used(s);
+    return (limit != 0 && inUse > limit) ? inUse - limit : 0;
+}
+
+void MemoryBudget::snapshot(MemoryStats out[MEM_SUBSYSTEM_COUNT]) const
+{
+    for (int i = 0; i < MEM_SUBSYSTEM_COUNT; ++i)
+    {
+        const Counter& c = counters[i];
+        out[i] = { MEMORY_SUBSYSTEM_NAMES[i], MEMORY_SUBSYSTEM_GPU[i], c.used.load(std::memory_order_relaxed), c.peak.load(std::memory_order_relaxed),
+                   c.budget.load(std::memory_order_relaxed), c.evictions.load(std::memory_order_relaxed) };
+    }
+}
+
+// "name=size[,name=size...]" with sizes like 512M or 2G; 0 = unlimited
+bool MemoryBudget::configure(const char* spec)
+{
+    std::string text(spec);
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t end = text.find(',', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string item = text.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t eq = item.find('=');
+        if (eq == std::string::npos)
+            return false;
+        std::string name = item.substr(0, eq);
+        char* suffix = nullptr;
+        double value = std::strtod(item.c_str() + eq + 1, &suffix);
+        if (suffix == item.c_str() + eq + 1 || value < 0.0)
+            return false;
+        switch (*suffix)
+        {
+        case 'G': case 'g': value *= 1024.0; [[fallthrough]];
+        case 'M': case 'm': value *= 1024.0; [[fallthrough]];
+        case 'K': case 'k': value *= 1024.0; ++suffix; break;
+        default: break;
+        }
+        if (*suffix != '\0')
+            return false;
+
+        int s = 0;
+        while (s < MEM_SUBSYSTEM_COUNT && name != MEMORY_SUBSYSTEM_NAMES[s])
+            ++s;
+        if (s == MEM_SUBSYSTEM_COUNT)
+            return false;
+        setBudget((MemorySubsystem)s, (size_t)value);
+    }
+    return true;
+}
+
+static size_t physicalMemoryBytes()
+{
+#ifdef _WIN32
+    return (size_t)4 << 30;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGE_SIZE);
+    return (pages > 0 && pageSize > 0) ? (size_t)pages * (size_t)pageSize : (size_t)4 << 30;
+#endif
+}
+
+// scaled to the machine, so one binary suits small and large memory alike
+void setDefaultMemoryBudgets()
+{
+    size_t tiles = physicalMemoryBytes() / 32;
+    tiles = std::min(std::max(tiles, (size_t)32 << 20), (size_t)1 << 30);
+    memoryBudget.setBudget(MEM_TILE_CACHE, tiles);
+    memoryBudget.setBudget(MEM_GPU_TERRAIN, TERRAIN_VERTEX_CAPACITY * 8 * sizeof(float) + TERRAIN_INDEX_CAPACITY * sizeof(unsigned int));
+}
+
+void printMemoryStats()
+{
+    MemoryStats stats[MEM_SUBSYSTEM_COUNT];
+    memoryBudget.snapshot(stats);
+    auto mb = [](size_t bytes) { return bytes / (1024.0 * 1024.0); };
+    for (const MemoryStats& m : stats)
+    {
+        std::cout << "[memory] " << m.name << (m.gpu ? " (gpu)" : " (cpu)") << ": " << mb(m.used) << " MB used, " << mb(m.peak) << " MB peak, ";
+        if (m.budget)
+            std::cout << mb(m.budget) << " MB budget";
+        else
+            std::cout << "no budget";
+        std::cout << ", " << m.evictions << " evictions" << std::endl;
+    }
+}
+
+FrameArena& threadArena()
+{
+    thread_local FrameArena arena(FRAME_ARENA_BYTES);
+    return arena;
+}
+
+template <int SIZE>
+MeshPool<SIZE>::MeshPool(int verticesPerSide)
+{
+    for (TerrainMesh& mesh : meshes)
+    {
+        mesh.vertices.reserve((size_t)verticesPerSide * verticesPerSide * 8);
+        memoryBudget.charge(MEM_TERRAIN_MESHES, mesh.vertices.capacity() * sizeof(float));
+    }
+}
+
+template <int SIZE>
+MeshRef MeshPool<SIZE>::acquire()
+{
+    for (;;)
+    {
+        for (TerrainMesh& mesh : meshes)
+        {
+            int expected = 0;
+            if (mesh.refs.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+            {
+                mesh.baseVersion = 0;       // a rebuild unless the caller says otherwise
+                MeshRef ref(&mesh);
+                mesh.refs.fetch_sub(1, std::memory_order_relaxed);
+                return ref;
+            }
+        }
+        // every mesh is still referenced by packets in flight; the render
+        // thread releases one within a frame
+        std::this_thread::yield();
+    }
+}
+
+
+// --- profiler --------------------------------------------------------------
+void ProfileRing::write(const char* zone, uint64_t startNs, uint64_t endNs, double value, bool counter)
+{
+    uint64_t h = head.load(std::memory_order_relaxed);
+    Entry& e = entries[h % CAPACITY];
+    e.name.store(zone, std::memory_order_relaxed);
+    e.startNs.store(startNs, std::memory_order_relaxed);
+    e.endNs.store(endNs, std::memory_order_relaxed);
+    e.value.store(value, std::memory_order_relaxed);
+    e.counter.store(counter, std::memory_order_relaxed);
+    head.store(h + 1, std::memory_order_release);
+}
+
+void ProfileRing::record(const char* zone, uint64_t startNs, uint64_t endNs)
+{
+    write(zone, startNs, endNs, 0.0, false);
+}
+
+void ProfileRing::recordCounter(const char* counterName, uint64_t timeNs, double value)
+{
+    write(counterName, timeNs, timeNs, value, true);
+}
+
+// appends the zones that ended after sinceNs, oldest first
+void ProfileRing::snapshot(std::vector<ProfileEvent>& out, uint64_t sinceNs) const
+{
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+    size_t first = out.size();
+    for (uint64_t i = begin; i < end; ++i)
+    {
+        const Entry& e = entries[i % CAPACITY];
+        out.push_back({ e.name.load(std::memory_order_relaxed), e.startNs.load(std::memory_order_relaxed), e.endNs.load(std::memory_order_relaxed),
+                        e.value.load(std::memory_order_relaxed), e.counter.load(std::memory_order_relaxed) });
+    }
+
+    // the writer may have lapped the oldest entries while they were read;
+    // index i is safe only while head stays below i + CAPACITY
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t now = head.load(std::memory_order_relaxed);
+    if (now + 1 > begin + CAPACITY)
+    {
+        size_t torn = (size_t)std::min<uint64_t>(now + 1 - (begin + CAPACITY), end - begin);
+        out.erase(out.begin() + first, out.begin() + first + torn);
+    }
+    out.erase(std::remove_if(out.begin() + first, out.end(), [sinceNs](const ProfileEvent& e) { return !e.name || e.endNs < sinceNs; }), out.end());
+}
+
+Profiler::~Profiler()
+{
+    for (int i = 0; i < ringCount; ++i)
+        delete rings[i];
+}
+
+uint64_t Profiler::now() const
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// rings outlive their threads so traces can be written after joins
+ProfileRing* Profiler::createRing(const char* name)
+{
+    AllowAllocations once;
+    std::lock_guard<std::mutex> lock(ringMutex);
+    if (ringCount == MAX_RINGS)
+        return nullptr;
+    ProfileRing* ring = new ProfileRing;
+    ring->id = ringCount + 1;
+    std::snprintf(ring->name, sizeof(ring->name), "%s", name);
+    rings[ringCount++] = ring;
+    return ring;
+}
+
+// a released ring goes to the next new thread, keeping its events, so pools
+// that are started and stopped repeatedly do not run out of rings
+void Profiler::releaseRing(ProfileRing* ring)
+{
+    std::lock_guard<std::mutex> lock(ringMutex);
+    released[releasedCount++] = ring;
+}
+
+ProfileRing* Profiler::threadRing()
+{
+    // hands the ring back when the thread exits
+    struct Owner
+    {
+        Profiler* profiler = nullptr;
+        ProfileRing* ring = nullptr;
+        ~Owner()
+        {
+            if (ring)
+                profiler->releaseRing(ring);
+        }
+    };
+    thread_local Owner owner;
+    if (!owner.profiler)
+    {
+        owner.profiler = this;
+        {
+            std::lock_guard<std::mutex> lock(ringMutex);
+            if (releasedCount > 0)
+            {
+                owner.ring = released[--releasedCount];
+                std::snprintf(owner.ring->name, sizeof(owner.ring->name), "thread");
+            }
+        }
+        if (!owner.ring)
+            owner.ring = createRing("thread");
+    }
+    return owner.ring;
+}
+
+void Profiler::setThreadName(const char* name)
+{
+    if (ProfileRing* ring = threadRing())
+        std::snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+static void writeJsonString(std::ostream& out, const char* text)
+{
+    out << '"';
+    for (const char* c = text; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+            out << '\\';
+        out << *c;
+    }
+    out << '"';
+}
+
+void Profiler::counter(const char* counterName, double value)
+{
+    if (ProfileRing* ring = threadRing())
+        ring->recordCounter(counterName, now(), value);
+}
+
+// Chrome trace event format: complete ("X") and counter ("C") events in
+// microseconds, one track per ring. otherData is a JSON object's members
+bool Profiler::writeChromeTrace(const char* path, uint64_t sinceNs, const std::string& otherData) const
+{
+    std::ofstream file(path);
+    if (!file)
+        return false;
+    file << "{\"traceEvents\":[\n";
+    bool first = true;
+    std::vector<ProfileEvent> events;
+    std::lock_guard<std::mutex> lock(ringMutex);
+    for (int i = 0; i < ringCount; ++i)
+    {
+        const ProfileRing& ring = *rings[i];
+        file << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << ring.id << ",\"args\":{\"name\":";
+        writeJsonString(file, ring.name);
+        file << "}}";
+        first = false;
+
+        events.clear();
+        ring.snapshot(events, sinceNs);
+        for (const ProfileEvent& e : events)
+        {
+            file << ",\n{\"ph\":\"" << (e.counter ? 'C' : 'X') << "\",\"pid\":1,\"tid\":" << ring.id << ",\"name\":";
+            writeJsonString(file, e.name);
+            file << ",\"ts\":" << e.startNs / 1000.0;
+            if (e.counter)
+                file << ",\"args\":{\"value\":" << e.value << "}}";
+            else
+                file << ",\"dur\":" << (e.endNs - e.startNs) / 1000.0 << "}";
+        }
+    }
+    file << "\n]";
+    if (!otherData.empty())
+        file << ",\"otherData\":{" << otherData << "}";
+    file << "}\n";
+    return (bool)file;
+}
+
+ProfileZone::ProfileZone(const char* name) : name(name), startNs(profiler.now()) {}
+
+ProfileZone::~ProfileZone()
+{
+    if (ProfileRing* ring = profiler.threadRing())
+        ring->record(name, startNs, profiler.now());
+}
+
+void GpuProfiler::create()
+{
+    for (Query& q : queries)
+        glGenQueries(1, &q.id);
+    ring = profiler.createRing("gpu");
+}
+
+void GpuProfiler::destroy()
+{
+    for (Query& q : queries)
+    {
+        glDeleteQueries(1, &q.id);
+        q = Query();
+    }
+}
+
+// a zone is dropped when all queries are still waiting for results
+void GpuProfiler::begin(const char* name)
+{
+    Query& q = queries[next];
+    if (!ring || q.pending || active >= 0)
+        return;
+    q.name = name;
+    q.submitNs = profiler.now();
+    q.pending = true;
+    glBeginQuery(GL_TIME_ELAPSED, q.id);
+    active = next;
+    next = (next + 1) % QUERY_COUNT;
+}
+
+void GpuProfiler::end()
+{
+    if (active < 0)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    active = -1;
+}
+
+// records finished queries in submission order, stopping at the first one
+// the GPU has not completed yet
+void GpuProfiler::collect()
+{
+    while (queries[oldest].pending && oldest != active)
+    {
+        Query& q = queries[oldest];
+        GLint available = 0;
+        glGetQueryObjectiv(q.id, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return;
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(q.id, GL_QUERY_RESULT, &elapsed);
+        ring->record(q.name, q.submitNs, q.submitNs + elapsed);
+        q.pending = false;
+        oldest = (oldest + 1) % QUERY_COUNT;
+    }
+}
+
+// the state is captured here; snapshotting the rings and writing the file
+// happen on a worker. the render thread passes the camera it drew with, as
+// the sim's own is moving on meanwhile
+void checkHitch(const char* thread, unsigned long long frame, float frameSeconds, const CameraState& view)
+{
+    if (hitchThresholdMs <= 0.0f || frame < ALLOC_WARMUP_FRAMES || frameSeconds * 1000.0f < hitchThresholdMs || hitchDumps.load() >= HITCH_MAX_DUMPS)
+        return;
+    int index = ++hitchDumps;
+    if (index > HITCH_MAX_DUMPS)
+        return;
+
+    AllowAllocations dump;
+    std::ostringstream state;
+    auto vec3 = [&](const glm::vec3& v) { state << "[" << v.x << "," << v.y << "," << v.z << "]"; };
+    state << "\"thread\":\"" << thread << "\",\"frame\":" << frame << ",\"frameMs\":" << frameSeconds * 1000.0f << ",\"thresholdMs\":" << hitchThresholdMs;
+    state << ",\"cameraPosition\":";
+    vec3(view.position);
+    state << ",\"cameraFront\":";
+    vec3(view.front);
+    state << ",\"cameraZoom\":" << view.zoom;
+    state << ",\"terrainOffset\":[" << view.terrainOffsetX << "," << view.terrainOffsetZ << "]";
+    state << ",\"terrainScale\":" << terrainScale << ",\"terrainAmplitude\":" << terrainAmplitude << ",\"terrainFreq\":" << terrainFreq;
+    state << ",\"gridN\":" << gridN << ",\"octaves\":" << TERRAIN_OCTAVES << ",\"tilesResident\":" << tileTable.size();
+
+    std::string path = "hitch_" + std::to_string(index) + ".json";
+    uint64_t now = profiler.now();
+    uint64_t since = now > HITCH_WINDOW_NS ? now - HITCH_WINDOW_NS : 0;
+    std::cout << "[hitch] " << thread << " frame " << frame << " took " << frameSeconds * 1000.0f << " ms, writing " << path << std::endl;
+    jobSystem.submit([path, since, otherData = state.str()] { profiler.writeChromeTrace(path.c_str(), since, otherData); });
+}
+
+
+// --- hardware counters -----------------------------------------------------
+PerfStage perfStages[MAX_PERF_STAGES];
+std::atomic<int> perfStageCount{0};
+std::mutex perfStageMutex;
+
+// one stage per zone name; called once per zone site (static local)
+PerfStage& registerPerfStage(const char* name)
+{
+    AllowAllocations once;
+    std::lock_guard<std::mutex> lock(perfStageMutex);
+    int count = perfStageCount.load();
+    for (int i = 0; i < count; ++i)
+        if (perfStages[i].name == name)
+            return perfStages[i];
+    // all sites beyond the table share its last entry
+    PerfStage& stage = perfStages[std::min(count, MAX_PERF_STAGES - 1)];
+    if (count < MAX_PERF_STAGES)
+    {
+        stage.name = name;
+        stage.ipcTrack = stage.name + " IPC";
+        stage.cacheTrack = stage.name + " cache misses";
+        stage.branchTrack = stage.name + " branch misses";
+        perfStageCount.store(count + 1);
+    }
+    return stage;
+}
+
+#ifdef __linux__
+static int openPerfEvent(uint32_t type, uint64_t config, int groupFd)
+{
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = groupFd < 0 ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+bool PerfCounters::open()
+{
+    const uint64_t configs[PERF_COUNTER_COUNT] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        fds[i] = openPerfEvent(PERF_TYPE_HARDWARE, configs[i], i == 0 ? -1 : fds[0]);
+        if (fds[i] < 0)
+            return false;
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int fd : fds)
+        if (fd >= 0)
+            close(fd);
+}
+
+// scaled up if the group was multiplexed with other users of the PMU
+bool PerfCounters::read(uint64_t values[PERF_COUNTER_COUNT])
+{
+    uint64_t data[3 + PERF_COUNTER_COUNT];
+    if (::read(fds[0], data, sizeof(data)) != (ssize_t)sizeof(data) || data[0] != PERF_COUNTER_COUNT)
+        return false;
+    double scale = (data[2] > 0 && data[2] < data[1]) ? (double)data[1] / data[2] : 1.0;
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i)
+        values[i] = (uint64_t)(data[3 + i] * scale);
+    return true;
+}
+#else
+bool PerfCounters::open() { return false; }
+PerfCounters::~PerfCounters() {}
+bool PerfCounters::read(uint64_t values[PERF_COUNTER_COUNT]) { return false; }
+#endif
+
+PerfCounters* PerfCounters::thread()
+{
+    thread_local PerfCounters counters;
+    thread_local int state = 0;         // 0 = not tried, 1 = open, -1 = unavailable
+    if (state == 0)
+    {
+        state = counters.open() ? 1 : -1;
+        static std::atomic<bool> reported{false};
+        if (state < 0 && !reported.exchange(true))
+            std::cout << "Hardware counters unavailable (perf_event_open failed; check perf_event_paranoid)" << std::endl;
+    }
+    return state > 0 ? &counters : nullptr;
+}
+
+PerfZone::PerfZone(PerfStage& stage) : stage(stage), counters(nullptr)
+{
+    if (!perfCountersEnabled)
+        return;
+    counters = PerfCounters::thread();
+    if (counters && !counters->read(start))
+        counters = nullptr;
+}
+
+PerfZone::~PerfZone()
+{
+    uint64_t end[PERF_COUNTER_COUNT];
+    if (!counters || !counters->read(end))
+        return;
+    uint64_t delta[PERF_COUNTER_COUNT];
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        delta[i] = end[i] - start[i];
+        stage.totals[i].fetch_add(delta[i], std::memory_order_relaxed);
+    }
+    stage.calls.fetch_add(1, std::memory_order_relaxed);
+    if (delta[PERF_CYCLES])
+        profiler.counter(stage.ipcTrack.c_str(), (double)delta[PERF_INSTRUCTIONS] / delta[PERF_CYCLES]);
+    profiler.counter(stage.cacheTrack.c_str(), (double)delta[PERF_CACHE_MISSES]);
+    profiler.counter(stage.branchTrack.c_str(), (double)delta[PERF_BRANCH_MISSES]);
+}
+
+void printPerfStats(std::ostream& out)
+{
+    int count = perfStageCount.load();
+    for (int i = 0; i < count; ++i)
+    {
+        const PerfStage& stage = perfStages[i];
+        uint64_t calls = stage.calls.load();
+        if (calls == 0)
+            continue;
+        uint64_t cycles = stage.totals[PERF_CYCLES].load(), instructions = stage.totals[PERF_INSTRUCTIONS].load();
+        out << "[perf] " << stage.name << ": " << calls << " calls, " << cycles / calls << " cycles/call, IPC "
+            << (cycles ? (double)instructions / cycles : 0.0) << ", " << stage.totals[PERF_CACHE_MISSES].load() / calls << " cache misses/call, "
+            << stage.totals[PERF_BRANCH_MISSES].load() / calls << " branch misses/call" << std::endl;
+    }
+}
+
+
+// --- metrics ---------------------------------------------------------------
+int Histogram::bucketOf(uint64_t value)
+{
+    if (value < (uint64_t)SUB_BUCKETS)
+        return (int)value;
+    int exponent = 63;
+    while (!(value >> exponent))
+        --exponent;
+    int sub = (int)(value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// largest value that falls into the bucket
+uint64_t Histogram::bucketUpper(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return (uint64_t)bucket;
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void Histogram::record(uint64_t value)
+{
+    buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    valueSum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void Histogram::snapshot(uint64_t counts[BUCKETS]) const
+{
+    for (int i = 0; i < BUCKETS; ++i)
+        counts[i] = buckets[i].load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::percentile(const uint64_t counts[BUCKETS], double p)
+{
+    uint64_t n = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+        n += counts[i];
+    if (n == 0)
+        return 0;
+    uint64_t rank = (uint64_t)std::ceil(p * n), seen = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        seen += counts[i];
+        if (seen >= std::max<uint64_t>(rank, 1))
+            return bucketUpper(i);
+    }
+    return bucketUpper(BUCKETS - 1);
+}
+
+// Prometheus text exposition format 0.0.4; histograms become summaries
+std::string formatMetrics()
+{
+    std::ostringstream out;
+    auto counter = [&](const char* name, const char* help, uint64_t value)
+    {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n" << name << " " << value << "\n";
+    };
+    auto gauge = [&](const char* name, const char* help, double value)
+    {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n" << name << " " << value << "\n";
+    };
+    auto summary = [&](const char* name, const char* help, const Histogram& h)
+    {
+        uint64_t counts[Histogram::BUCKETS];
+        h.snapshot(counts);
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " summary\n";
+        for (double q : { 0.5, 0.9, 0.99, 0.999 })
+            out << name << "{quantile=\"" << q << "\"} " << Histogram::percentile(counts, q) * 1e-6 << "\n";
+        out << name << "_sum " << h.sum() * 1e-6 << "\n" << name << "_count " << h.count() << "\n";
+    };
+
+    summary("terrain_sim_frame_seconds", "Simulation frame time.", metrics.simFrameUs);
+    summary("terrain_render_frame_seconds", "Render thread CPU time per frame.", metrics.renderFrameUs);
+    summary("terrain_tile_generate_seconds", "Height tile generation time.", metrics.tileGenerateUs);
+    summary("terrain_chunk_build_seconds", "Chunk mesh build time.", metrics.chunkBuildUs);
+    summary("terrain_input_to_submit_seconds", "Input to the submission of the first frame showing it.", metrics.inputToSubmitUs);
+    summary("terrain_input_to_swap_seconds", "Input to the return of that frame's swap.", metrics.inputToSwapUs);
+    summary("terrain_input_to_gpu_seconds", "Input to that frame's fence signalling (upper bound).", metrics.inputToGpuUs);
+    counter("terrain_frames_total", "Simulation frames.", metrics.frames.load());
+    counter("terrain_frames_skipped_total", "Frames not redrawn because nothing changed.", metrics.framesSkipped.load());
+    counter("terrain_upload_bytes_total", "Vertex bytes uploaded to the GPU.", metrics.uploadBytes.load());
+    counter("terrain_draw_calls_total", "Terrain draw calls.", metrics.drawCalls.load());
+    counter("terrain_triangles_total", "Terrain triangles submitted.", metrics.triangles.load());
+    counter("terrain_tile_memory_hits_total", "Tile requests served from resident tiles.", metrics.tileMemoryHits.load());
+    counter("terrain_tile_disk_hits_total", "Tile requests served from the disk cache.", metrics.tileDiskHits.load());
+    counter("terrain_tiles_generated_total", "Tiles generated from noise.", metrics.tilesGenerated.load());
+    gauge("terrain_tiles_resident", "Resident height tiles.", (double)tileTable.size());
+
+    MemoryStats memory[MEM_SUBSYSTEM_COUNT];
+    memoryBudget.snapshot(memory);
+    out << "# HELP terrain_memory_bytes Memory held per subsystem.\n# TYPE terrain_memory_bytes gauge\n";
+    for (const MemoryStats& m : memory)
+        out << "terrain_memory_bytes{subsystem=\"" << m.name << "\"} " << m.used << "\n";
+    out << "# HELP terrain_memory_budget_bytes Budget per subsystem (0 = unlimited).\n# TYPE terrain_memory_budget_bytes gauge\n";
+    for (const MemoryStats& m : memory)
+        out << "terrain_memory_budget_bytes{subsystem=\"" << m.name << "\"} " << m.budget << "\n";
+    return out.str();
+}
+
+// one line per input-to-photon stage, when there was input
+void printLatencyStats(std::ostream& out)
+{
+    const struct { const char* name; const Histogram& histogram; } stages[] =
+    {
+        { "input -> sim", metrics.inputToSimUs },
+        { "input -> submit", metrics.inputToSubmitUs },
+        { "input -> swap", metrics.inputToSwapUs },
+        { "input -> gpu done", metrics.inputToGpuUs },
+    };
+    char line[200];
+    for (const auto& stage : stages)
+    {
+        if (stage.histogram.count() == 0)
+            continue;
+        uint64_t counts[Histogram::BUCKETS];
+        stage.histogram.snapshot(counts);
+        std::snprintf(line, sizeof(line), "[latency] %-17s p50 %7.2f ms  p95 %7.2f ms  p99 %7.2f ms  (%llu frames)", stage.name,
+                      Histogram::percentile(counts, 0.5) * 1e-3, Histogram::percentile(counts, 0.95) * 1e-3,
+                      Histogram::percentile(counts, 0.99) * 1e-3, (unsigned long long)stage.histogram.count());
+        out << line << std::endl;
+    }
+}
+
+// frame percentiles over the last interval, from bucket deltas
+void updateMetricsOverlay(GLFWwindow* window)
+{
+    static double lastUpdate = 0.0;
+    static uint64_t previous[Histogram::BUCKETS];
+    static uint64_t previousDraws = 0, previousFrames = 0;
+    double now = glfwGetTime();
+    if (now - lastUpdate < METRICS_OVERLAY_INTERVAL)
+        return;
+    lastUpdate = now;
+
+    static uint64_t counts[Histogram::BUCKETS];
+    metrics.simFrameUs.snapshot(counts);
+    for (int i = 0; i < Histogram::BUCKETS; ++i)
+    {
+        uint64_t current = counts[i];
+        counts[i] = current - previous[i];
+        previous[i] = current;
+    }
+    uint64_t frames = metrics.frames.load(), draws = metrics.drawCalls.load();
+    uint64_t lookups = metrics.tileMemoryHits.load() + metrics.tileDiskHits.load() + metrics.tilesGenerated.load();
+    double hitRate = lookups ? 100.0 * (lookups - metrics.tilesGenerated.load()) / lookups : 100.0;
+
+    char title[160];
+    std::snprintf(title, sizeof(title), "3D Kinetic Terrain | frame p50 %.1f ms p99 %.1f ms | %.0f draws/frame | %zu tiles, %.0f%% cached",
+                  Histogram::percentile(counts, 0.5) * 1e-3, Histogram::percentile(counts, 0.99) * 1e-3,
+                  frames > previousFrames ? (double)(draws - previousDraws) / (frames - previousFrames) : 0.0, tileTable.size(), hitRate);
+    glfwSetWindowTitle(window, title);
+    previousDraws = draws;
+    previousFrames = frames;
+}
+
+#ifndef _WIN32
+// blocking accept loop on its own thread: costs nothing until scraped
+bool MetricsServer::start(int port)
+{
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0)
+        return false;
+    int yes = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 4) != 0)
+    {
+        std::cout << "Metrics: cannot listen on 127.0.0.1:" << port << std::endl;
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+    quit = false;
+    thread = std::thread(&MetricsServer::serve, this);
+    return true;
+}
+
+void MetricsServer::stop()
+{
+    if (listenFd < 0)
+        return;
+    quit = true;
+    shutdown(listenFd, SHUT_RDWR);      // wakes the blocked accept
+    thread.join();
+    close(listenFd);
+    listenFd = -1;
+}
+
+void MetricsServer::serve()
+{
+    PROFILE_THREAD("metrics");
+    for (;;)
+    {
+        int client = accept(listenFd, nullptr, nullptr);
+        if (quit)
+        {
+            if (client >= 0)
+                close(client);
+            return;
+        }
+        if (client < 0)
+            continue;
+
+        // any request gets the metrics; the request itself is drained, not
+        // parsed. a client that sends nothing must not hold up the next
+        // scrape or stop()
+        pollfd ready = { client, POLLIN, 0 };
+        char request[1024];
+        if (poll(&ready, 1, METRICS_REQUEST_TIMEOUT_MS) <= 0 || recv(client, request, sizeof(request), 0) <= 0)
+        {
+            close(client);
+            continue;
+        }
+        std::string body = formatMetrics();
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        for (size_t sent = 0; sent < response.size();)
+        {
+            ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += (size_t)n;
+        }
+        close(client);
+    }
+}
+#else
+bool MetricsServer::start(int port)
+{
+    std::cout << "Metrics endpoint is not available on this platform" << std::endl;
+    return false;
+}
+
+void MetricsServer::stop() {}
+void MetricsServer::serve() {}
+#endif
+
+
+// --- job system ------------------------------------------------------------
+void JobSystem::start(unsigned count)
+{
+    quit = false;
+    for (unsigned i = 0; i < count; ++i)
+        workers.emplace_back(&JobSystem::workerMain, this);
+}
+
+void JobSystem::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        quit = true;
+    }
+    queueReady.notify_all();
+    for (std::thread& t : workers)
+        t.join();
+    workers.clear();
+}
+
+void JobSystem::submit(std::function<void()> job)
+{
+    if (workers.empty())
+    {
+        job();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push_back(std::move(job));
+    }
+    queueReady.notify_one();
+}
+
+void JobSystem::workerMain()
+{
+    PROFILE_THREAD("worker");
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueReady.wait(lock, [this] { return quit || !queue.empty(); });
+            if (queue.empty())
+                return;
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        job();
+    }
+}
+
+// runs fn(0..count-1) on the workers and the calling thread; returns when
+// every index is done
+void JobSystem::parallelFor(int count, const std::function<void(int)>& fn)
+{
+    struct State
+    {
+        std::atomic<int> next{0};
+        std::atomic<int> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+    const std::function<void(int)>* body = &fn;
+    auto drain = [state, body, count]
+    {
+        int i;
+        while ((i = state->next.fetch_add(1)) < count)
+        {
+            (*body)(i);
+            if (state->done.fetch_add(1) + 1 == count)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished.notify_all();
+            }
+        }
+    };
+
+    int helpers = std::min<int>(count - 1, (int)workers.size());
+    for (int i = 0; i < helpers; ++i)
+        submit(drain);
+    drain();
+
+    // helpers that start late find no index left and never touch fn
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&] { return state->done.load() == count; });
+}
+
+
+// --- epoch reclamation -----------------------------------------------------
+struct ThreadSlotRelease
+{
+    std::atomic<bool>* used = nullptr;
+    ~ThreadSlotRelease() { if (used) used->store(false); }
+};
+
+EpochManager::ThreadSlot& EpochManager::threadSlot()
+{
+    thread_local ThreadSlot* slot = nullptr;
+    thread_local ThreadSlotRelease release;
+    if (!slot)
+    {
+        for (int i = 0; i < MAX_THREADS && !slot; ++i)
+        {
+            bool expected = false;
+            if (slots[i].used.compare_exchange_strong(expected, true))
+                slot = &slots[i];
+        }
+        if (!slot)
+        {
+            std::cout << "EpochManager: more than " << MAX_THREADS << " threads" << std::endl;
+            std::abort();
+        }
+        release.used = &slot->used;
+    }
+    return *slot;
+}
+
+void EpochManager::enter()
+{
+    ThreadSlot& slot = threadSlot();
+    if (slot.depth++ == 0)
+        slot.epoch.store(globalEpoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+}
+
+void EpochManager::exit()
+{
+    ThreadSlot& slot = threadSlot();
+    if (--slot.depth == 0)
+        slot.epoch.store(0, std::memory_order_release);
+}
+
+// p must already be unreachable for new readers
+void EpochManager::retire(void* p, void (*deleter)(void*))
+{
+    uint64_t epoch = globalEpoch.fetch_add(1, std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> lock(retiredMutex);
+    retired.push_back({ p, deleter, epoch });
+}
+
+void EpochManager::collect()
+{
+    uint64_t oldest = globalEpoch.load(std::memory_order_seq_cst);
+    for (int i = 0; i < MAX_THREADS; ++i)
+    {
+        uint64_t e = slots[i].epoch.load(std::memory_order_seq_cst);
+        if (e != 0 && e < oldest)
+            oldest = e;
+    }
+
+    std::vector<Retired> ready;
+    {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        auto it = std::partition(retired.begin(), retired.end(), [oldest](const Retired& r) { return r.epoch >= oldest; });
+        ready.assign(it, retired.end());
+        retired.erase(it, retired.end());
+    }
+    for (const Retired& r : ready)
+        r.deleter(r.p);
+}
+
+// at shutdown nobody is reading any more
+EpochManager::~EpochManager()
+{
+    for (const Retired& r : retired)
+        r.deleter(r.p);
+}
+
+EpochGuard::EpochGuard() { tileEpochs.enter(); }
+EpochGuard::~EpochGuard() { tileEpochs.exit(); }
+
+
+// --- height tiles ----------------------------------------------------------
+TileTable::TileTable()
+{
+    current.store(makeSlots(TILE_TABLE_CAPACITY));
+}
+
+TileTable::~TileTable()
+{
+    SlotArray* slots = current.load();
+    for (size_t i = 0; i <= slots->mask; ++i)
+        if (HeightTile* tile = slots->slots[i].tile.load())
+            releaseTile(tile);
+    delete slots;
+}
+
+// level in the top byte, biased 28-bit coordinates below; levels stay
+// under 16 so a packed key never reaches the sentinels
+uint64_t TileTable::packKey(int level, int tileX, int tileZ)
+{
+    const uint64_t coordMask = (1ull << 28) - 1;
+    return ((uint64_t)level << 56) | (((uint64_t)(tileX + (1 << 27)) & coordMask) << 28) | ((uint64_t)(tileZ + (1 << 27)) & coordMask);
+}
+
+size_t TileTable::hashKey(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+TileTable::SlotArray* TileTable::makeSlots(size_t capacity)
+{
+    SlotArray* slots = new SlotArray;
+    slots->mask = capacity - 1;
+    slots->slots.reset(new Slot[capacity]);
+    return slots;
+}
+
+const HeightTile* TileTable::find(int level, int tileX, int tileZ) const
+{
+    const uint64_t key = packKey(level, tileX, tileZ);
+    const SlotArray* slots = current.load(std::memory_order_seq_cst);
+    for (size_t i = hashKey(key) & slots->mask;; i = (i + 1) & slots->mask)
+    {
+        uint64_t k = slots->slots[i].key.load(std::memory_order_seq_cst);
+        if (k == EMPTY_KEY)
+            return nullptr;
+        if (k == key)
+        {
+            // the slot may have been evicted and reused since the key was
+            // read, so confirm the tile is still the one asked for
+            const HeightTile* tile = slots->slots[i].tile.load(std::memory_order_seq_cst);
+            return (tile && tile->level == level && tile->tileX == tileX && tile->tileZ == tileZ) ? tile : nullptr;
+        }
+    }
+}
+
+// takes ownership of tile; if another writer won the race the resident tile
+// is returned and ours is deleted
+const HeightTile* TileTable::insert(HeightTile* tile)
+{
+    const uint64_t key = packKey(tile->level, tile->tileX, tile->tileZ);
+    std::lock_guard<std::mutex> lock(writeMutex);
+    SlotArray* slots = current.load();
+    if ((usedSlots + 1) * 2 > slots->mask + 1)
+    {
+        // grow when live tiles fill half the table, otherwise just sweep tombstones
+        size_t capacity = slots->mask + 1;
+        rebuild(liveCount.load() * 4 > capacity ? capacity * 2 : capacity);
+        slots = current.load();
+    }
+
+    Slot* target = nullptr;
+    for (size_t i = hashKey(key) & slots->mask;; i = (i + 1) & slots->mask)
+    {
+        uint64_t k = slots->slots[i].key.load();
+        if (k == key)
+        {
+            delete tile;
+            return slots->slots[i].tile.load();
+        }
+        if (k == TOMBSTONE_KEY && !target)
+            target = &slots->slots[i];
+        if (k == EMPTY_KEY)
+        {
+            if (!target)
+            {
+                target = &slots->slots[i];
+                ++usedSlots;
+            }
+            break;
+        }
+    }
+
+    // publish the tile before the key so a reader matching the key sees it
+    target->tile.store(tile, std::memory_order_seq_cst);
+    target->key.store(key, std::memory_order_seq_cst);
+    liveCount.fetch_add(1);
+    memoryBudget.charge(MEM_TILE_CACHE, sizeof(HeightTile));
+    return tile;
+}
+
+// swaps an edited copy in for the resident tile with the same key and
+// retires the old one; false (and the copy deleted) if none is resident
+bool TileTable::replace(HeightTile* tile)
+{
+    const uint64_t key = packKey(tile->level, tile->tileX, tile->tileZ);
+    std::lock_guard<std::mutex> lock(writeMutex);
+    SlotArray* slots = current.load();
+    for (size_t i = hashKey(key) & slots->mask;; i = (i + 1) & slots->mask)
+    {
+        uint64_t k = slots->slots[i].key.load();
+        if (k == EMPTY_KEY)
+        {
+            delete tile;
+            return false;
+        }
+        if (k == key)
+        {
+            HeightTile* old = slots->slots[i].tile.exchange(tile, std::memory_order_seq_cst);
+            tileEpochs.retire(old, [](void* p) { releaseTile(static_cast<HeightTile*>(p)); });
+            return true;
+        }
+    }
+}
+
+// caller holds writeMutex
+void TileTable::evictSlot(Slot& slot)
+{
+    HeightTile* tile = slot.tile.load();
+    slot.key.store(TOMBSTONE_KEY, std::memory_order_seq_cst);
+    slot.tile.store(nullptr, std::memory_order_seq_cst);
+    liveCount.fetch_sub(1);
+    memoryBudget.release(MEM_TILE_CACHE, sizeof(HeightTile));
+    tileEpochs.retire(tile, [](void* p) { releaseTile(static_cast<HeightTile*>(p)); });
+}
+
+// drops up to count tiles, farthest from (centerX, centerZ) first; tiles
+// overlapping the keep rectangle are never dropped. coordinates are level
+// 0 tiles. returns the number of tiles evicted
+size_t TileTable::evictFarthest(int centerX, int centerZ, int minX, int minZ, int maxX, int maxZ, size_t count)
+{
+    struct Candidate
+    {
+        long long distance;
+        Slot* slot;
+    };
+    std::lock_guard<std::mutex> lock(writeMutex);
+    SlotArray* slots = current.load();
+    std::vector<Candidate> candidates;
+    for (size_t i = 0; i <= slots->mask; ++i)
+    {
+        Slot& slot = slots->slots[i];
+        HeightTile* tile = slot.tile.load();
+        if (!tile)
+            continue;
+        int x0 = tile->tileX << tile->level, x1 = ((tile->tileX + 1) << tile->level) - 1;
+        int z0 = tile->tileZ << tile->level, z1 = ((tile->tileZ + 1) << tile->level) - 1;
+        if (x1 >= minX && x0 <= maxX && z1 >= minZ && z0 <= maxZ)
+            continue;
+        long long dx = (long long)x0 + x1 - 2ll * centerX, dz = (long long)z0 + z1 - 2ll * centerZ;
+        candidates.push_back({ dx * dx + dz * dz, &slot });
+    }
+
+    size_t evict = std::min(count, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + evict, candidates.end(),
+                      [](const Candidate& a, const Candidate& b) { return a.distance > b.distance; });
+    for (size_t i = 0; i < evict; ++i)
+        evictSlot(*candidates[i].slot);
+    return evict;
+}
+
+// copies live tiles into a fresh array (dropping tombstones); readers still
+// probing the old array finish safely because it is retired, not deleted
+void TileTable::rebuild(size_t capacity)
+{
+    SlotArray* old = current.load();
+    SlotArray* slots = makeSlots(capacity);
+    usedSlots = 0;
+    for (size_t i = 0; i <= old->mask; ++i)
+    {
+        HeightTile* tile = old->slots[i].tile.load();
+        if (!tile)
+            continue;
+        uint64_t key = packKey(tile->level, tile->tileX, tile->tileZ);
+        size_t j = hashKey(key) & slots->mask;
+        while (slots->slots[j].key.load() != EMPTY_KEY)
+            j = (j + 1) & slots->mask;
+        slots->slots[j].tile.store(tile);
+        slots->slots[j].key.store(key);
+        ++usedSlots;
+    }
+    current.store(slots, std::memory_order_seq_cst);
+    tileEpochs.retire(old, [](void* p) { delete static_cast<SlotArray*>(p); });
+}
+
+void releaseTile(HeightTile* tile)
+{
+    if (tile->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete tile;
+}
+
+TileRef::TileRef(const TileRef& other) : tile(other.tile)
+{
+    if (tile)
+        tile->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+// inside the guard the table's own reference cannot have been dropped yet
+TileRef TileRef::acquire(const HeightTile* tile)
+{
+    TileRef ref;
+    if (tile)
+    {
+        ref.tile = const_cast<HeightTile*>(tile);
+        ref.tile->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    return ref;
+}
+
+HeightTile* generateHeightTile(int level, int tileX, int tileZ)
+{
+    PROFILE_PERF_ZONE("generate tile");
+    HeightTile* tile = new HeightTile;
+    tile->level = level;
+    tile->tileX = tileX;
+    tile->tileZ = tileZ;
+    const float spacing = terrainScale * (float)(1 << level);
+    if (tileNoiseBatch)
+    {
+        float x[TILE_N];
+        for (int i = 0; i < TILE_N; ++i)
+            x[i] = (float)(tileX * TILE_N + i) * spacing;
+        for (int z = 0; z < TILE_N; ++z)
+            sampleHeightRow(tileNoiseBatch, x, (float)(tileZ * TILE_N + z) * spacing, &tile->heights[z * TILE_N]);
+        return tile;
+    }
+    for (int z = 0; z < TILE_N; ++z)
+    {
+        float wz = (float)(tileZ * TILE_N + z);
+        for (int x = 0; x < TILE_N; ++x)
+        {
+            float wx = (float)(tileX * TILE_N + x);
+            tile->heights[z * TILE_N + x] = sampleHeight(wx * spacing, wz * spacing, 0.0f, 0.0f, terrainAmplitude, terrainFreq);
+        }
+    }
+    return tile;
+}
+
+// a tile row through a batch noise backend: the octave sum of sampleHeight
+// in the same order, so the heights match the scalar path bit for bit
+void sampleHeightRow(NoiseBatchFn batch, const float* x, float z, float* heights)
+{
+    float fx[TILE_N], fz[TILE_N], noise[TILE_N], raw[TILE_N] = {};
+    float amp = 1.0f, f = terrainFreq;
+    for (int octave = 0; octave < TERRAIN_OCTAVES; ++octave)
+    {
+        for (int i = 0; i < TILE_N; ++i)
+        {
+            fx[i] = x[i] * f;
+            fz[i] = z * f;
+        }
+        batch(fx, fz, TILE_N, 0.0f, noise);
+        for (int i = 0; i < TILE_N; ++i)
+            raw[i] += noise[i] * amp;
+        amp *= TERRAIN_PERSISTENCE;
+        f *= TERRAIN_LACUNARITY;
+    }
+    for (int i = 0; i < TILE_N; ++i)
+        heights[i] = shapeHeight(raw[i], terrainAmplitude);
+}
+
+// fills heights (N x N) for world samples starting at (originX, originZ);
+// missing tiles are generated in parallel on the job system first
+void assembleTerrainHeights(float* heights, int N, int originX, int originZ)
+{
+    PROFILE_PERF_ZONE("assemble heights");
+    int minX = floorDiv(originX, TILE_N), maxX = floorDiv(originX + N - 1, TILE_N);
+    int minZ = floorDiv(originZ, TILE_N), maxZ = floorDiv(originZ + N - 1, TILE_N);
+
+    // missing tiles come through the async tile API (disk cache, shared
+    // with in-flight prefetches); keep references until they are copied
+    AllowAllocations streaming;
+    std::vector<TileRef> loaded;
+    {
+        std::vector<std::pair<int, int>> missing;
+        {
+            EpochGuard guard;
+            for (int tz = minZ; tz <= maxZ; ++tz)
+                for (int tx = minX; tx <= maxX; ++tx)
+                    if (!tileTable.find(0, tx, tz))
+                        missing.push_back({ tx, tz });
+        }
+        loaded.resize(missing.size());
+        std::atomic<int> remaining{(int)missing.size()};
+        std::mutex doneMutex;
+        std::condition_variable done;
+        auto fetch = [&](int i) -> DetachedTask
+        {
+            loaded[i] = co_await terrainTiles.tile(0, missing[i].first, missing[i].second);
+            std::lock_guard<std::mutex> lock(doneMutex);
+            if (remaining.fetch_sub(1) == 1)
+                done.notify_one();
+        };
+        for (int i = 0; i < (int)missing.size(); ++i)
+            fetch(i);
+        std::unique_lock<std::mutex> lock(doneMutex);
+        done.wait(lock, [&] { return remaining.load() == 0; });
+    }
+
+    EpochGuard guard;
+    for (int tz = minZ; tz <= maxZ; ++tz)
+    {
+        for (int tx = minX; tx <= maxX; ++tx)
+        {
+            const HeightTile* tile = tileTable.find(0, tx, tz);
+            for (size_t i = 0; !tile && i < loaded.size(); ++i)
+                if (loaded[i] && loaded[i]->tileX == tx && loaded[i]->tileZ == tz)
+                    tile = loaded[i].get();
+            if (!tile)
+                continue;
+            int x0 = std::max(originX, tx * TILE_N), x1 = std::min(originX + N, tx * TILE_N + TILE_N);
+            int z0 = std::max(originZ, tz * TILE_N), z1 = std::min(originZ + N, tz * TILE_N + TILE_N);
+            for (int z = z0; z < z1; ++z)
+            {
+                const float* src = &tile->heights[(z - tz * TILE_N) * TILE_N + (x0 - tx * TILE_N)];
+                std::copy(src, src + (x1 - x0), &heights[(z - originZ) * N + (x0 - originX)]);
+            }
+        }
+    }
+}
+
+// bilinear height at terrain-space (x, z); reads resident tiles without
+// locking and falls back to sampling the noise where none is resident
+float terrainHeightAt(float x, float z)
+{
+    float sx = x / terrainScale, sz = z / terrainScale;
+    int ix = (int)std::floor(sx), iz = (int)std::floor(sz);
+    float fx = sx - ix, fz = sz - iz;
+
+    EpochGuard guard;
+    auto sample = [](int wx, int wz)
+    {
+        int tx = floorDiv(wx, TILE_N), tz = floorDiv(wz, TILE_N);
+        if (const HeightTile* tile = tileTable.find(0, tx, tz))
+            return tile->heights[(wz - tz * TILE_N) * TILE_N + (wx - tx * TILE_N)];
+        return sampleHeight(wx * terrainScale, wz * terrainScale, 0.0f, 0.0f, terrainAmplitude, terrainFreq);
+    };
+    float h00 = sample(ix, iz), h10 = sample(ix + 1, iz);
+    float h01 = sample(ix, iz + 1), h11 = sample(ix + 1, iz + 1);
+    float h0 = h00 + (h10 - h00) * fx;
+    float h1 = h01 + (h11 - h01) * fx;
+    return h0 + (h1 - h0) * fz;
+}
+
+
+// --- async tile requests ---------------------------------------------------
+bool TileRequest::await_ready()
+{
+    EpochGuard guard;
+    result = TileRef::acquire(tileTable.find(level, tileX, tileZ));
+    if (result)
+        metrics.tileMemoryHits.fetch_add(1, std::memory_order_relaxed);
+    return (bool)result || stop.stop_requested();
+}
+
+// the stop callback is armed before the request becomes visible, so a
+// cancellation either prevents registration or finds the request queued
+bool TileRequest::await_suspend(std::coroutine_handle<> h)
+{
+    handle = h;
+    if (stop.stop_possible())
+        onStop.emplace(stop, CancelRequest{ this });
+    return tiles.enqueue(this);
+}
+
+void TileRequest::CancelRequest::operator()() const
+{
+    request->tiles.cancel(request);
+}
+
+// returns false if the request was cancelled before it could be queued
+bool TerrainTiles::enqueue(TileRequest* request)
+{
+    bool first = false;
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        if (request->cancelled)
+            return false;
+        uint64_t key = TileTable::packKey(request->level, request->tileX, request->tileZ);
+        auto it = pending.find(key);
+        if (it == pending.end())
+        {
+            it = pending.emplace(key, Pending()).first;
+            first = true;
+        }
+        it->second.waiters.push_back(request);
+        request->registered = true;
+        ++suspended;
+    }
+    if (first)
+    {
+        int level = request->level, tileX = request->tileX, tileZ = request->tileZ;
+        jobSystem.submit([this, level, tileX, tileZ] { run(level, tileX, tileZ); });
+    }
+    return true;
+}
+
+void TerrainTiles::cancel(TileRequest* request)
+{
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        request->cancelled = true;
+        if (!request->registered)
+            return;
+        auto it = pending.find(TileTable::packKey(request->level, request->tileX, request->tileZ));
+        if (it == pending.end())
+            return;
+        std::vector<TileRequest*>& waiters = it->second.waiters;
+        auto w = std::find(waiters.begin(), waiters.end(), request);
+        if (w == waiters.end())
+            return;     // already handed its tile
+        waiters.erase(w);
+    }
+    // resume elsewhere: this may run inside request_stop() on any thread
+    std::coroutine_handle<> handle = request->handle;
+    jobSystem.submit([this, handle]
+    {
+        handle.resume();
+        resumed();
+    });
+}
+
+// the request's frame may be gone by now; only the count is touched
+void TerrainTiles::resumed()
+{
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    if (--suspended == 0)
+        drained.notify_all();
+}
+
+// requests that are never cancelled or finished would block this, so it is
+// called after their stop sources were triggered, with the workers running
+void TerrainTiles::drain()
+{
+    std::unique_lock<std::mutex> lock(pendingMutex);
+    drained.wait(lock, [this] { return suspended == 0; });
+}
+
+void TerrainTiles::run(int level, int tileX, int tileZ)
+{
+    const uint64_t key = TileTable::packKey(level, tileX, tileZ);
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        auto it = pending.find(key);
+        if (it->second.waiters.empty())
+        {
+            pending.erase(it);
+            return;
+        }
+    }
+
+    TileRef ref;
+    {
+        EpochGuard guard;
+        const HeightTile* tile = tileTable.find(level, tileX, tileZ);
+        if (!tile)
+        {
+            HeightTile* fresh = tileDiskCache ? readCachedTile(level, tileX, tileZ) : nullptr;
+            if (fresh)
+            {
+                metrics.tileDiskHits.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                auto start = std::chrono::steady_clock::now();
+                fresh = generateHeightTile(level, tileX, tileZ);
+                metrics.tileGenerateUs.record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+                metrics.tilesGenerated.fetch_add(1, std::memory_order_relaxed);
+                if (tileDiskCache)
+                    writeCachedTile(*fresh);
+            }
+            applyTerrainStamps(fresh->heights, TILE_N, tileX * (TILE_N << level), tileZ * (TILE_N << level), 1 << level);
+            if (level == 0)
+                editLayer.apply(fresh->heights, TILE_N, tileX * TILE_N, tileZ * TILE_N);
+            tile = tileTable.insert(fresh);
+        }
+        ref = TileRef::acquire(tile);
+    }
+
+    std::vector<TileRequest*> waiters;
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        auto it = pending.find(key);
+        waiters.swap(it->second.waiters);
+        pending.erase(it);
+    }
+    for (TileRequest* request : waiters)
+    {
+        request->result = ref;
+        request->handle.resume();
+        resumed();
+    }
+}
+
+// warm the caches; the result is dropped, the table keeps the tile
+DetachedTask prefetchTile(int level, int tileX, int tileZ, std::stop_token stop)
+{
+    co_await terrainTiles.tile(level, tileX, tileZ, stop);
+}
+
+
+// --- tile disk cache -------------------------------------------------------
+// one file per tile: header, then TILE_N * TILE_N raw floats. the header
+// carries the generator parameters so stale files are ignored
+struct TileFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t tileN;
+    int32_t octaves;
+    float scale, amplitude, freq;
+};
+const uint32_t TILE_FILE_MAGIC = 0x4c495454;    // "TTIL"
+const uint32_t TILE_FILE_VERSION = 1;
+
+static TileFileHeader currentTileHeader()
+{
+    return { TILE_FILE_MAGIC, TILE_FILE_VERSION, TILE_N, TERRAIN_OCTAVES, terrainScale, terrainAmplitude, terrainFreq };
+}
+
+static std::string tileCachePath(int level, int tileX, int tileZ)
+{
+    return std::string(TILE_CACHE_DIR) + "/" + std::to_string(level) + "_" + std::to_string(tileX) + "_" + std::to_string(tileZ) + ".tile";
+}
+
+HeightTile* readCachedTile(int level, int tileX, int tileZ)
+{
+    PROFILE_ZONE("read cached tile");
+    std::ifstream file(tileCachePath(level, tileX, tileZ), std::ios::binary);
+    if (!file)
+        return nullptr;
+    TileFileHeader header, expected = currentTileHeader();
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file || std::memcmp(&header, &expected, sizeof(header)) != 0)
+        return nullptr;
+
+    HeightTile* tile = new HeightTile;
+    tile->level = level;
+    tile->tileX = tileX;
+    tile->tileZ = tileZ;
+    file.read(reinterpret_cast<char*>(tile->heights), sizeof(tile->heights));
+    if (!file)
+    {
+        delete tile;
+        return nullptr;
+    }
+    return tile;
+}
+
+// written to a temporary name and renamed so readers never see half a tile
+void writeCachedTile(const HeightTile& tile)
+{
+    PROFILE_ZONE("write cached tile");
+    std::error_code ec;
+    std::filesystem::create_directories(TILE_CACHE_DIR, ec);
+    std::string path = tileCachePath(tile.level, tile.tileX, tile.tileZ);
+    std::string tmp = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream file(tmp, std::ios::binary);
+        if (!file)
+            return;
+        TileFileHeader header = currentTileHeader();
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(tile.heights), sizeof(tile.heights));
+        if (!file)
+            return;
+    }
+    std::filesystem::rename(tmp, path, ec);
+}
+
+
+// --- edit layer ------------------------------------------------------------
+void EditLayer::record(int tileX, int tileZ, const float* before, const float* after)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<Block>& block = blocks[TileTable::packKey(0, tileX, tileZ)];
+    if (!block)
+    {
+        block.reset(new Block());
+        memoryBudget.charge(MEM_EDITS, sizeof(Block));
+    }
+    float* delta = block->delta;
+    for (int i = 0; i < TILE_N * TILE_N; ++i)
+        delta[i] += after[i] - before[i];
+}
+
+// dst += src over a row; SSE2 is part of x86-64, so no dispatch
+static void addHeightRow(float* dst, const float* src, int count)
+{
+    int i = 0;
+#if defined(__GNUC__) && defined(__x86_64__)
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+#endif
+    for (; i < count; ++i)
+        dst[i] += src[i];
+}
+
+// a row add per tile row; tiles without edits cost one lookup
+void EditLayer::apply(float* heights, int N, int originX, int originZ) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (blocks.empty())
+        return;
+    int minX = floorDiv(originX, TILE_N), maxX = floorDiv(originX + N - 1, TILE_N);
+    int minZ = floorDiv(originZ, TILE_N), maxZ = floorDiv(originZ + N - 1, TILE_N);
+    for (int tz = minZ; tz <= maxZ; ++tz)
+    {
+        for (int tx = minX; tx <= maxX; ++tx)
+        {
+            auto it = blocks.find(TileTable::packKey(0, tx, tz));
+            if (it == blocks.end())
+                continue;
+            int x0 = std::max(originX, tx * TILE_N), x1 = std::min(originX + N, tx * TILE_N + TILE_N);
+            int z0 = std::max(originZ, tz * TILE_N), z1 = std::min(originZ + N, tz * TILE_N + TILE_N);
+            for (int z = z0; z < z1; ++z)
+            {
+                const float* src = &it->second->delta[(z - tz * TILE_N) * TILE_N + (x0 - tx * TILE_N)];
+                addHeightRow(&heights[(size_t)(z - originZ) * N + (x0 - originX)], src, x1 - x0);
+            }
+        }
+    }
+}
+
+size_t EditLayer::tileCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return blocks.size();
+}
+
+bool EditLayer::get(int tileX, int tileZ, float* delta) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = blocks.find(TileTable::packKey(0, tileX, tileZ));
+    if (it == blocks.end())
+    {
+        std::fill(delta, delta + TILE_N * TILE_N, 0.0f);
+        return false;
+    }
+    std::memcpy(delta, it->second->delta, sizeof(Block::delta));
+    return true;
+}
+
+// replaces a tile's deltas; a tile set back to all zeros is forgotten
+void EditLayer::set(int tileX, int tileZ, const float* delta)
+{
+    bool edited = false;
+    for (int i = 0; i < TILE_N * TILE_N && !edited; ++i)
+        edited = delta[i] != 0.0f || std::signbit(delta[i]);
+    std::lock_guard<std::mutex> lock(mutex);
+    const uint64_t key = TileTable::packKey(0, tileX, tileZ);
+    if (!edited)
+    {
+        if (blocks.erase(key))
+            memoryBudget.release(MEM_EDITS, sizeof(Block));
+        return;
+    }
+    std::unique_ptr<Block>& block = blocks[key];
+    if (!block)
+    {
+        block.reset(new Block());
+        memoryBudget.charge(MEM_EDITS, sizeof(Block));
+    }
+    std::memcpy(block->delta, delta, sizeof(Block::delta));
+}
+
+static void putVarint(std::vector<uint8_t>& out, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+static bool getVarint(const uint8_t*& p, const uint8_t* end, uint32_t& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7)
+    {
+        uint8_t b = *p++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// tokens: an even varint 2n is a run of n zero words, an odd one 2n + 1 is
+// followed by n XOR varints. words are TILE_N x TILE_N 32-bit values of
+// any type, read and written by copy
+static void encodeWords(const void* words, std::vector<uint8_t>& out)
+{
+    const int COUNT = TILE_N * TILE_N;
+    const uint8_t* src = static_cast<const uint8_t*>(words);
+    auto word = [src](int i)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, src + 4 * i, 4);
+        return bits;
+    };
+    uint32_t previous = 0;
+    for (int i = 0; i < COUNT;)
+    {
+        int end = i + 1;
+        if (word(i) == 0)
+        {
+            while (end < COUNT && word(end) == 0)
+                ++end;
+            putVarint(out, (uint32_t)(end - i) << 1);
+        }
+        else
+        {
+            while (end < COUNT && word(end) != 0)
+                ++end;
+            putVarint(out, (uint32_t)(end - i) << 1 | 1);
+            for (int k = i; k < end; ++k)
+            {
+                uint32_t bits = word(k);
+                putVarint(out, bits ^ previous);
+                previous = bits;
+            }
+        }
+        i = end;
+    }
+}
+
+static bool decodeWords(const uint8_t* data, size_t size, void* words)
+{
+    const int COUNT = TILE_N * TILE_N;
+    uint8_t* dst = static_cast<uint8_t*>(words);
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    uint32_t previous = 0;
+    int i = 0;
+    while (i < COUNT)
+    {
+        uint32_t token;
+        if (!getVarint(p, end, token) || (token >> 1) == 0 || (token >> 1) > (uint32_t)(COUNT - i))
+            return false;
+        int run = (int)(token >> 1);
+        if (!(token & 1))
+        {
+            std::memset(dst + 4 * i, 0, 4 * run);
+            i += run;
+            continue;
+        }
+        for (int k = 0; k < run; ++k, ++i)
+        {
+            uint32_t x;
+            if (!getVarint(p, end, x))
+                return false;
+            previous ^= x;
+            std::memcpy(dst + 4 * i, &previous, 4);
+        }
+    }
+    return p == end;
+}
+
+void EditLayer::encode(const float* delta, std::vector<uint8_t>& out)
+{
+    encodeWords(delta, out);
+}
+
+bool EditLayer::decode(const uint8_t* data, size_t size, float* delta)
+{
+    return decodeWords(data, size, delta);
+}
+
+// "TEDT", u32 version, i32 TILE_N, f32 scale, amplitude, freq, i32 stamp
+// density (deltas only fit the terrain they were made on), u32 tiles, then
+// per tile i32 x, i32 z, u32 bytes and the encoded deltas. version 1 files
+// predate stamps and fit only unstamped terrain
+const uint32_t EDIT_FILE_VERSION = 2;
+
+// written beside the target and renamed over it, so a crash mid-write
+// leaves the previous file intact
+bool EditLayer::save(const char* path, size_t& bytes) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const std::string tmp = std::string(path) + ".tmp";
+    std::ofstream file(tmp, std::ios::binary);
+    if (!file)
+        return false;
+    auto put = [&](const void* data, size_t size) { file.write(static_cast<const char*>(data), size); };
+    const int32_t tileN = TILE_N;
+    const uint32_t count = (uint32_t)blocks.size();
+    const float params[3] = { terrainScale, terrainAmplitude, terrainFreq };
+    put("TEDT", 4);
+    put(&EDIT_FILE_VERSION, 4);
+    put(&tileN, 4);
+    put(params, sizeof(params));
+    put(&stampDensity, 4);
+    put(&count, 4);
+    std::vector<uint8_t> encoded;
+    for (const auto& entry : blocks)
+    {
+        const uint64_t coordMask = (1ull << 28) - 1;
+        int32_t tileX = (int32_t)((entry.first >> 28) & coordMask) - (1 << 27);
+        int32_t tileZ = (int32_t)(entry.first & coordMask) - (1 << 27);
+        encoded.clear();
+        encode(entry.second->delta, encoded);
+        const uint32_t size = (uint32_t)encoded.size();
+        put(&tileX, 4);
+        put(&tileZ, 4);
+        put(&size, 4);
+        put(encoded.data(), encoded.size());
+    }
+    bytes = (size_t)file.tellp();
+    file.close();
+    std::error_code ec;
+    if (!file)
+    {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
+
+bool EditLayer::load(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+    auto get = [&](void* data, size_t size) { return (bool)file.read(static_cast<char*>(data), size); };
+    char magic[4];
+    uint32_t version = 0, count = 0;
+    int32_t tileN = 0, stamps = 0;
+    float params[3];
+    if (!get(magic, 4) || std::memcmp(magic, "TEDT", 4) != 0 || !get(&version, 4) || version < 1 || version > EDIT_FILE_VERSION ||
+        !get(&tileN, 4) || tileN != TILE_N || !get(params, sizeof(params)) || (version >= 2 && !get(&stamps, 4)) || !get(&count, 4))
+        return false;
+    if (params[0] != terrainScale || params[1] != terrainAmplitude || params[2] != terrainFreq || stamps != stampDensity)
+        return false;
+
+    std::unordered_map<uint64_t, std::unique_ptr<Block>> loaded;
+    std::vector<uint8_t> encoded;
+    for (uint32_t n = 0; n < count; ++n)
+    {
+        int32_t tileX, tileZ;
+        uint32_t size;
+        if (!get(&tileX, 4) || !get(&tileZ, 4) || !get(&size, 4) || size > TILE_N * TILE_N * 10)
+            return false;
+        encoded.resize(size);
+        std::unique_ptr<Block> block(new Block());
+        if (!get(encoded.data(), size) || !decode(encoded.data(), size, block->delta))
+            return false;
+        loaded[TileTable::packKey(0, tileX, tileZ)] = std::move(block);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    memoryBudget.release(MEM_EDITS, blocks.size() * sizeof(Block));
+    blocks.swap(loaded);
+    memoryBudget.charge(MEM_EDITS, blocks.size() * sizeof(Block));
+    return true;
+}
+
+
+// --- edit history ----------------------------------------------------------
+void EditHistory::touch(int tileX, int tileZ)
+{
+    Snapshot& snapshot = snapshots[TileTable::packKey(0, tileX, tileZ)];
+    if (!snapshot.delta.empty())
+        return;
+    snapshot.tileX = tileX;
+    snapshot.tileZ = tileZ;
+    snapshot.delta.resize(TILE_N * TILE_N);
+    editLayer.get(tileX, tileZ, snapshot.delta.data());
+}
+
+// a finished stroke becomes one step; it replaces whatever was undone
+void EditHistory::endStroke()
+{
+    if (snapshots.empty())
+        return;
+    AllowAllocations allocating;
+    ArenaScope scratch(threadArena());
+    float* delta = threadArena().alloc<float>(TILE_N * TILE_N);
+    uint32_t* words = threadArena().alloc<uint32_t>(TILE_N * TILE_N);
+    Step step;
+    for (const auto& entry : snapshots)
+    {
+        const Snapshot& snapshot = entry.second;
+        editLayer.get(snapshot.tileX, snapshot.tileZ, delta);
+        uint32_t changed = 0;
+        for (int i = 0; i < TILE_N * TILE_N; ++i)
+        {
+            uint32_t before, after;
+            std::memcpy(&before, &snapshot.delta[i], 4);
+            std::memcpy(&after, &delta[i], 4);
+            words[i] = before ^ after;
+            changed |= words[i];
+        }
+        if (!changed)
+            continue;
+        TileStep tile{ snapshot.tileX, snapshot.tileZ, {} };
+        encodeWords(words, tile.bits);
+        step.bytes += tile.bits.size();
+        step.tiles.push_back(std::move(tile));
+    }
+    snapshots.clear();
+    if (step.tiles.empty())
+        return;
+
+    while (history.size() > cursor)
+        drop(false);
+    historyBytes += step.bytes;
+    memoryBudget.charge(MEM_EDITS, step.bytes);
+    history.push_back(std::move(step));
+    ++cursor;
+    while (history.size() > 1 && (history.size() > UNDO_MAX_STEPS || historyBytes > UNDO_MAX_BYTES))
+        drop(true);
+}
+
+void EditHistory::drop(bool oldest)
+{
+    Step& step = oldest ? history.front() : history.back();
+    historyBytes -= step.bytes;
+    memoryBudget.release(MEM_EDITS, step.bytes);
+    if (oldest)
+    {
+        history.pop_front();
+        --cursor;
+    }
+    else
+    {
+        history.pop_back();
+    }
+}
+
+bool EditHistory::undo(TerrainView& view)
+{
+    if (cursor == 0)
+        return false;
+    apply(view, history[--cursor]);
+    return true;
+}
+
+bool EditHistory::redo(TerrainView& view)
+{
+    if (cursor == history.size())
+        return false;
+    apply(view, history[cursor++]);
+    return true;
+}
+
+// the edit layer takes the XOR exactly; resident tiles move by the change in
+// delta, so they match what a reload of the tile would produce
+void EditHistory::apply(TerrainView& view, const Step& step)
+{
+    PROFILE_ZONE("edit history");
+    AllowAllocations edit;
+    ArenaScope scratch(threadArena());
+    uint32_t* words = threadArena().alloc<uint32_t>(TILE_N * TILE_N);
+    float* before = threadArena().alloc<float>(TILE_N * TILE_N);
+    float* after = threadArena().alloc<float>(TILE_N * TILE_N);
+    int ex0 = INT_MAX, ez0 = INT_MAX, ex1 = INT_MIN, ez1 = INT_MIN;
+    for (const TileStep& tile : step.tiles)
+    {
+        if (!decodeWords(tile.bits.data(), tile.bits.size(), words))
+            continue;
+        editLayer.get(tile.tileX, tile.tileZ, before);
+        for (int i = 0; i < TILE_N * TILE_N; ++i)
+        {
+            uint32_t bits;
+            std::memcpy(&bits, &before[i], 4);
+            bits ^= words[i];
+            std::memcpy(&after[i], &bits, 4);
+            if (!words[i])
+                continue;
+            int x = tile.tileX * TILE_N + i % TILE_N, z = tile.tileZ * TILE_N + i / TILE_N;
+            ex0 = std::min(ex0, x);
+            ex1 = std::max(ex1, x);
+            ez0 = std::min(ez0, z);
+            ez1 = std::max(ez1, z);
+        }
+        editLayer.set(tile.tileX, tile.tileZ, after);
+
+        HeightTile* copy = new HeightTile;
+        copy->tileX = tile.tileX;
+        copy->tileZ = tile.tileZ;
+        {
+            EpochGuard guard;
+            const HeightTile* resident = tileTable.find(0, tile.tileX, tile.tileZ);
+            if (!resident)
+            {
+                delete copy;
+                continue;
+            }
+            std::memcpy(copy->heights, resident->heights, sizeof(copy->heights));
+            for (int i = 0; i < TILE_N * TILE_N; ++i)
+                if (words[i])
+                    copy->heights[i] += after[i] - before[i];
+        }
+        tileTable.replace(copy);
+    }
+    tileEpochs.collect();
+    if (ex0 > ex1 || view.preview)
+        return;
+
+    // a step can span many tiles, so each touched chunk re-reads only the
+    // heights around itself
+    const int B = 2;
+    const int N = TILE_N + 1 + 2 * B;
+    float* heights = threadArena().alloc<float>(N * N);
+    for (int i = 0; i < view.chunkCount; ++i)
+    {
+        const TerrainMesh& chunk = *view.chunks[i].get();
+        if (ex1 + 1 < chunk.originX || ex0 - 1 >= chunk.originX + chunk.size ||
+            ez1 + 1 < chunk.originZ || ez0 - 1 >= chunk.originZ + chunk.size)
+            continue;
+        assembleTerrainHeights(heights, N, chunk.originX - B, chunk.originZ - B);
+        updateEditedChunk(view, i, heights, N, chunk.originX - B, chunk.originZ - B, ex0, ez0, ex1, ez1);
+    }
+}
+
+// --- heightmap stamps ------------------------------------------------------
+#if defined(__GNUC__) && defined(__x86_64__)
+static bool cpuHasAvx2()
+{
+    static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has;
+}
+#endif
+
+// h += (target - h) * weight per sample: the scalar path, and the tail of
+// the AVX2 one. mul and add stay separate so both paths round alike
+template <StampBlend MODE>
+static inline void blendStampKernel(float* dst, const float* value, const float* weight, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        float h = dst[i], target;
+        if constexpr (MODE == STAMP_ADD)
+            target = h + value[i];
+        else if constexpr (MODE == STAMP_MAX)
+            target = h > value[i] ? h : value[i];
+        else if constexpr (MODE == STAMP_MIN)
+            target = h < value[i] ? h : value[i];
+        else
+            target = value[i];
+        dst[i] = h + (target - h) * weight[i];
+    }
+}
+
+template <StampBlend MODE>
+static void blendStampRow(float* dst, const float* value, const float* weight, int count)
+{
+    blendStampKernel<MODE>(dst, value, weight, count);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+// eight samples per step; max and min return value for a NaN operand, as
+// the scalar compares do. no fma target: the compiler would contract the
+// scalar tail and round it differently
+template <StampBlend MODE>
+__attribute__((target("avx2"))) static void blendStampRowAvx2(float* dst, const float* value, const float* weight, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 h = _mm256_loadu_ps(dst + i), v = _mm256_loadu_ps(value + i);
+        __m256 target;
+        if constexpr (MODE == STAMP_ADD)
+            target = _mm256_add_ps(h, v);
+        else if constexpr (MODE == STAMP_MAX)
+            target = _mm256_max_ps(h, v);
+        else if constexpr (MODE == STAMP_MIN)
+            target = _mm256_min_ps(h, v);
+        else
+            target = v;
+        __m256 step = _mm256_mul_ps(_mm256_sub_ps(target, h), _mm256_loadu_ps(weight + i));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(h, step));
+    }
+    blendStampKernel<MODE>(dst + i, value + i, weight + i, count - i);
+}
+#endif
+
+template <StampBlend MODE>
+static StampBlendFn stampBlendRow()
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (cpuHasAvx2())
+        return &blendStampRowAvx2<MODE>;
+#endif
+    return &blendStampRow<MODE>;
+}
+
+// source patches in [-1, 1]^2, all zero at the border so a stamp never
+// leaves a seam: a rough peak, a bowl with a rim, a trough along u and a
+// flat top with steep shoulders
+StampLibrary::StampLibrary()
+{
+    for (int j = 0; j < STAMP_N; ++j)
+    {
+        for (int i = 0; i < STAMP_N; ++i)
+        {
+            float u = i * 2.0f / (STAMP_N - 1) - 1.0f, v = j * 2.0f / (STAMP_N - 1) - 1.0f;
+            float r2 = u * u + v * v, r = std::sqrt(r2);
+            float disc = r2 < 1.0f ? (1.0f - r2) * (1.0f - r2) : 0.0f;
+            float edge = std::clamp((1.0f - r) * 5.0f, 0.0f, 1.0f);
+            float detail = stb_perlin_noise3(u * 3.0f, 0.5f, v * 3.0f, 0, 0, 0);
+            float rim = (r - 0.68f) / 0.12f;
+            float across = std::min(1.0f, std::abs(v) * 2.0f);
+
+            const int k = j * STAMP_N + i;
+            shapes[STAMP_MOUNTAIN][k] = disc * (0.8f + 0.2f * detail);
+            shapes[STAMP_CRATER][k] = edge * ((r < 0.6f ? r2 / 0.36f - 1.0f : 0.0f) + 0.35f * std::exp(-rim * rim));
+            shapes[STAMP_VALLEY][k] = -(1.0f - across * across) * (1.0f - across * across) * (1.0f - u * u * u * u);
+            shapes[STAMP_MESA][k] = std::clamp((1.0f - r) * 3.0f, 0.0f, 1.0f);
+        }
+    }
+    blendRow[STAMP_ADD] = stampBlendRow<STAMP_ADD>();
+    blendRow[STAMP_MAX] = stampBlendRow<STAMP_MAX>();
+    blendRow[STAMP_MIN] = stampBlendRow<STAMP_MIN>();
+    blendRow[STAMP_LERP] = stampBlendRow<STAMP_LERP>();
+}
+
+// columns [begin, end) of a row where (u, v) + k (du, dv) lies inside the
+// patch; empty when begin >= end
+static void stampRowSpan(float u, float v, float du, float dv, int count, int& begin, int& end)
+{
+    float lo = -1.0f, hi = (float)count;    // open bounds
+    auto clip = [&](float p, float d)
+    {
+        if (std::abs(d) < 1e-12f)
+        {
+            if (std::abs(p) >= 1.0f)
+                hi = lo;
+            return;
+        }
+        float a = (-1.0f - p) / d, b = (1.0f - p) / d;
+        lo = std::max(lo, std::min(a, b));
+        hi = std::min(hi, std::max(a, b));
+    };
+    clip(u, du);
+    clip(v, dv);
+    begin = std::max(0, (int)std::floor(lo) + 1);
+    end = std::min(count, (int)std::ceil(hi));
+}
+
+// one target row of a stamp over [begin, end): the patch sampled
+// bilinearly, then the blend's value and weight
+static void resampleStampRow(const float* patch, const Stamp& stamp, float u, float v, float du, float dv, int begin, int end, float* value, float* weight)
+{
+    const float half = (STAMP_N - 1) * 0.5f;
+    for (int k = begin; k < end; ++k)
+    {
+        float fx = (u + k * du + 1.0f) * half, fz = (v + k * dv + 1.0f) * half;
+        int ix = std::clamp((int)fx, 0, STAMP_N - 2), iz = std::clamp((int)fz, 0, STAMP_N - 2);
+        float tx = fx - ix, tz = fz - iz;
+        const float* p = &patch[iz * STAMP_N + ix];
+        float top = p[0] + (p[1] - p[0]) * tx;
+        float bottom = p[STAMP_N] + (p[STAMP_N + 1] - p[STAMP_N]) * tx;
+        value[k] = top + (bottom - top) * tz;
+    }
+    const float level = stamp.blend == STAMP_ADD ? 0.0f : stamp.level;
+    for (int k = begin; k < end; ++k)
+    {
+        float pu = u + k * du, pv = v + k * dv;
+        float d2 = pu * pu + pv * pv;
+        value[k] = level + stamp.height * value[k];
+        if (stamp.blend == STAMP_ADD)
+            weight[k] = 1.0f;
+        else if (stamp.blend == STAMP_LERP)
+            weight[k] = d2 < 1.0f ? (1.0f - d2) * (1.0f - d2) : 0.0f;
+        else
+            weight[k] = std::clamp((1.0f - d2) * STAMP_EDGE, 0.0f, 1.0f);
+    }
+}
+
+// stamps in order, each over the rows and columns of its rotated bounding
+// box; the cost follows the stamps' area, not their number
+void StampLibrary::apply(float* heights, int N, int originX, int originZ, int step, const Stamp* stamps, int count) const
+{
+    if (count == 0)
+        return;
+    PROFILE_ZONE("apply stamps");
+    ArenaScope scratch(threadArena());
+    float* value = threadArena().alloc<float>(N);
+    float* weight = threadArena().alloc<float>(N);
+    const float half = (STAMP_N - 1) * 0.5f;
+    for (int n = 0; n < count; ++n)
+    {
+        const Stamp& stamp = stamps[n];
+        const float c = std::cos(stamp.rotation), s = std::sin(stamp.rotation);
+        const float extent = half * stamp.scale * (std::abs(c) + std::abs(s));
+        const int i0 = std::max(0, (int)std::ceil((stamp.x - extent - originX) / step));
+        const int i1 = std::min(N - 1, (int)std::floor((stamp.x + extent - originX) / step));
+        const int j0 = std::max(0, (int)std::ceil((stamp.z - extent - originZ) / step));
+        const int j1 = std::min(N - 1, (int)std::floor((stamp.z + extent - originZ) / step));
+        if (i0 > i1 || j0 > j1)
+            continue;
+
+        // patch coordinates: world offsets rotated into the patch and scaled
+        // to [-1, 1]; one target column moves them by (du, dv)
+        const float inv = 1.0f / (half * stamp.scale);
+        const float du = c * step * inv, dv = -s * step * inv;
+        const int width = i1 - i0 + 1;
+        for (int j = j0; j <= j1; ++j)
+        {
+            float dx = (float)(originX + i0 * step) - stamp.x, dz = (float)(originZ + j * step) - stamp.z;
+            float u = (c * dx + s * dz) * inv, v = (c * dz - s * dx) * inv;
+            int begin, end;
+            stampRowSpan(u, v, du, dv, width, begin, end);
+            if (begin >= end)
+                continue;
+            resampleStampRow(shapes[stamp.shape], stamp, u, v, du, dv, begin, end, value, weight);
+            blendRow[stamp.blend](&heights[(size_t)j * N + i0 + begin], value + begin, weight + begin, end - begin);
+        }
+    }
+}
+
+// world stamps: each STAMP_CELL square holds stampDensity of them, drawn
+// from a hash of the cell and the index, so every tile and level that
+// overlaps a stamp sees the same one. max, min and lerp stamps sit on the
+// procedural height at their centre. returns the stamps of the cells that
+// reach into [x0, x1] x [z0, z1]
+int scatterStamps(int x0, int z0, int x1, int z1, Stamp* out, int capacity)
+{
+    int count = 0;
+    for (int cz = floorDiv(z0 - STAMP_REACH, STAMP_CELL); cz <= floorDiv(z1 + STAMP_REACH, STAMP_CELL); ++cz)
+    {
+        for (int cx = floorDiv(x0 - STAMP_REACH, STAMP_CELL); cx <= floorDiv(x1 + STAMP_REACH, STAMP_CELL); ++cx)
+        {
+            for (int n = 0; n < stampDensity && count < capacity; ++n)
+            {
+                uint64_t state = ((uint64_t)(uint32_t)cx << 32 | (uint32_t)cz) ^ (uint64_t)n * 0x9e3779b97f4a7c15ull;
+                auto next = [&state]
+                {
+                    state = state * 6364136223846793005ull + 1442695040888963407ull;
+                    return (float)(state >> 40) * (1.0f / (1 << 24));
+                };
+                next();
+                Stamp stamp;
+                stamp.x = (cx + next()) * STAMP_CELL;
+                stamp.z = (cz + next()) * STAMP_CELL;
+                stamp.rotation = next() * 6.2831853f;
+                stamp.scale = STAMP_MIN_SCALE + next() * (STAMP_MAX_SCALE - STAMP_MIN_SCALE);
+                stamp.shape = (StampShape)std::min((int)(next() * (int)STAMP_SHAPE_COUNT), (int)STAMP_SHAPE_COUNT - 1);
+                // mesas flatten towards their top; half the peaks and
+                // craters replace the terrain instead of adding to it
+                const bool replace = next() < 0.5f;
+                if (stamp.shape == STAMP_MESA)
+                    stamp.blend = STAMP_LERP;
+                else if (replace && stamp.shape == STAMP_MOUNTAIN)
+                    stamp.blend = STAMP_MAX;
+                else if (replace && stamp.shape == STAMP_CRATER)
+                    stamp.blend = STAMP_MIN;
+                stamp.height = terrainAmplitude * (0.15f + 0.35f * next()) * stamp.scale;
+                stamp.level = sampleHeight(stamp.x * terrainScale, stamp.z * terrainScale, 0.0f, 0.0f, terrainAmplitude, terrainFreq);
+                float extent = stamp.scale * (STAMP_N - 1) * 0.5f * 1.4143f;  // rotated corner
+                if (stamp.x + extent < x0 || stamp.x - extent > x1 || stamp.z + extent < z0 || stamp.z - extent > z1)
+                    continue;
+                out[count++] = stamp;
+            }
+        }
+    }
+    return count;
+}
+
+void applyTerrainStamps(float* heights, int N, int originX, int originZ, int step)
+{
+    if (stampDensity <= 0)
+        return;
+    const int x1 = originX + (N - 1) * step, z1 = originZ + (N - 1) * step;
+    const int cells = (floorDiv(x1 + STAMP_REACH, STAMP_CELL) - floorDiv(originX - STAMP_REACH, STAMP_CELL) + 1) *
+                      (floorDiv(z1 + STAMP_REACH, STAMP_CELL) - floorDiv(originZ - STAMP_REACH, STAMP_CELL) + 1);
+    ArenaScope scratch(threadArena());
+    Stamp* stamps = threadArena().alloc<Stamp>(cells * stampDensity);
+    int count = scatterStamps(originX, originZ, x1, z1, stamps, cells * stampDensity);
+    stampLibrary.apply(heights, N, originX, originZ, step, stamps, count);
+}
+
+// --- benchmarks ------------------------------------------------------------
+volatile float benchSink;               // keeps results observable
+
+void collectBenchmarks(std::vector<BenchCase>& cases)
+{
+    static std::vector<float> vertices, heights, halo;
+    static std::vector<unsigned int> indices;
+
+    const int S = 64;
+    cases.push_back({ "sampleHeight", S * S, []
+    {
+        float sum = 0.0f;
+        for (int z = 0; z < S; ++z)
+            for (int x = 0; x < S; ++x)
+                sum += sampleHeight(x * 0.37f, z * 0.37f, 0.0f, 0.0f, terrainAmplitude, terrainFreq);
+        benchSink = sum;
+    } });
+
+    // noise entry points; the scalar form goes through the function pointer
+    // like a swapped-in backend would
+    static float rowX[S], rowZ[S], rowOut[S];
+    for (int i = 0; i < S; ++i)
+        rowX[i] = i * 0.05f;
+    for (int b = 0; b < noiseBackendCount; ++b)
+    {
+        const NoiseBackend* backend = &noiseBackends[b];
+        std::string name = std::string("noise/") + backend->name;
+        cases.push_back({ name, S * S, [backend]
+        {
+            float sum = 0.0f;
+            for (int z = 0; z < S; ++z)
+                for (int x = 0; x < S; ++x)
+                    sum += backend->sample(x * 0.05f, 0.0f, z * 0.05f);
+            benchSink = sum;
+        } });
+        auto batchCase = [](NoiseBatchFn batch)
+        {
+            return [batch]
+            {
+                float sum = 0.0f;
+                for (int z = 0; z < S; ++z)
+                {
+                    std::fill(rowZ, rowZ + S, z * 0.05f);
+                    batch(rowX, rowZ, S, 0.0f, rowOut);
+                    sum += rowOut[z];
+                }
+                benchSink = sum;
+            };
+        };
+        cases.push_back({ name + "/batch", S * S, batchCase(backend->batch) });
+        if (backend->batchAvx2)
+            cases.push_back({ name + "/batch-avx2", S * S, batchCase(backend->batchAvx2) });
+    }
+    for (int N : { 64, 128, 256, 512 })
+    {
+        cases.push_back({ "generateTerrain/" + std::to_string(N), (double)N * N, [N]
+        {
+            generateTerrain(vertices, indices, N, terrainScale, 0.0f, 0.0f, terrainAmplitude, terrainFreq);
+            benchSink = vertices[1];
+        } });
+    }
+    cases.push_back({ "generateHeightTile", TILE_N * TILE_N, []
+    {
+        HeightTile* tile = generateHeightTile(0, 3, 5);
+        benchSink = tile->heights[0];
+        delete tile;
+    } });
+
+    // meshing from fixed heights: normals and vertex layout, then indices
+    heights.resize(GRID_MAX_N * GRID_MAX_N);
+    for (int i = 0; i < GRID_MAX_N * GRID_MAX_N; ++i)
+        heights[i] = sampleHeight((i % GRID_MAX_N) * terrainScale, (i / GRID_MAX_N) * terrainScale, 0.0f, 0.0f, terrainAmplitude, terrainFreq);
+    halo.assign(heights.begin(), heights.begin() + (TILE_N + 3) * (TILE_N + 3));
+    cases.push_back({ "buildTerrainVertices/" + std::to_string(GRID_MAX_N), (double)GRID_MAX_N * GRID_MAX_N, []
+    {
+        buildTerrainVertices(heights.data(), GRID_MAX_N, terrainScale, vertices);
+        benchSink = vertices[4];
+    } });
+    cases.push_back({ "buildChunkVertices/" + std::to_string(TILE_N + 1), (double)(TILE_N + 1) * (TILE_N + 1), []
+    {
+        buildChunkVertices(halo.data(), TILE_N + 1, terrainScale, vertices);
+        benchSink = vertices[4];
+    } });
+    cases.push_back({ "buildTerrainIndices/" + std::to_string(GRID_MAX_N), (double)(GRID_MAX_N - 1) * (GRID_MAX_N - 1) * 6, []
+    {
+        buildTerrainIndices(GRID_MAX_N, indices);
+        benchSink = (float)indices[7];
+    } });
+
+    // copying out of resident tiles (loaded by the first run)
+    cases.push_back({ "assembleTerrainHeights/" + std::to_string(GRID_MAX_N), (double)GRID_MAX_N * GRID_MAX_N, []
+    {
+        assembleTerrainHeights(heights.data(), GRID_MAX_N, 17, -23);
+        benchSink = heights[5];
+    } });
+
+    // sculpting over the chunks of a grid at the origin (built by the first
+    // run); strokes alternate raise and lower so the heights stay put
+    static TerrainView sculptView;
+    for (float radius : { 4.0f, 12.0f, BRUSH_MAX_RADIUS })
+    {
+        double samples = 3.14159 * (radius / terrainScale) * (radius / terrainScale);
+        cases.push_back({ "applyBrush/r" + std::to_string((int)radius), samples, [radius]
+        {
+            static bool lower = false;
+            if (sculptView.originX == INT_MIN)
+            {
+                sculptView.originX = sculptView.originZ = 0;
+                updateVisibleChunks(sculptView);
+            }
+            BrushStroke stroke;
+            stroke.mode = lower ? BRUSH_LOWER : BRUSH_RAISE;
+            stroke.radius = radius;
+            stroke.centerX = stroke.centerZ = GRID_MAX_N / 2 + 0.3f;
+            lower = !lower;
+            benchSink = applyBrush(sculptView, stroke, FIXED_TIMESTEP) ? 1.0f : 0.0f;
+        } });
+    }
+    // edit layer compression of a tile a brush has covered in part
+    static float editDelta[TILE_N * TILE_N], editDecoded[TILE_N * TILE_N];
+    static std::vector<uint8_t> editEncoded;
+    for (int z = 0; z < TILE_N; ++z)
+    {
+        for (int x = 0; x < TILE_N; ++x)
+        {
+            float d2 = ((x - 40) * (x - 40) + (z - 24) * (z - 24)) / 400.0f;
+            editDelta[z * TILE_N + x] = d2 < 1.0f ? 3.7f * (1.0f - d2) * (1.0f - d2) : 0.0f;
+        }
+    }
+    cases.push_back({ "editLayer/encode", TILE_N * TILE_N, []
+    {
+        editEncoded.clear();
+        EditLayer::encode(editDelta, editEncoded);
+        benchSink = (float)editEncoded.size();
+    } });
+    cases.push_back({ "editLayer/decode", TILE_N * TILE_N, []
+    {
+        if (editEncoded.empty())
+            EditLayer::encode(editDelta, editEncoded);
+        EditLayer::decode(editEncoded.data(), editEncoded.size(), editDecoded);
+        benchSink = editDecoded[24 * TILE_N + 40];
+    } });
+    // undo then redo of one largest-brush stroke over the sculpting chunks
+    cases.push_back({ "editHistory/undo+redo", 2, []
+    {
+        static bool stroked = false;
+        if (!stroked)
+        {
+            if (sculptView.originX == INT_MIN)
+            {
+                sculptView.originX = sculptView.originZ = 0;
+                updateVisibleChunks(sculptView);
+            }
+            editHistory.endStroke();
+            BrushStroke stroke;
+            stroke.radius = BRUSH_MAX_RADIUS;
+            stroke.centerX = stroke.centerZ = GRID_MAX_N / 2 + 0.3f;
+            applyBrush(sculptView, stroke, FIXED_TIMESTEP);
+            editHistory.endStroke();
+            stroked = true;
+        }
+        benchSink = editHistory.undo(sculptView) && editHistory.redo(sculptView) ? 1.0f : 0.0f;
+    } });
+    // stamps: the blend kernels over a tile of rows, then 256 stamps of
+    // mixed shape, mode, rotation and scale over one chunk
+    static float stampDst[TILE_N * TILE_N], stampValue[TILE_N * TILE_N], stampWeight[TILE_N * TILE_N];
+    for (int i = 0; i < TILE_N * TILE_N; ++i)
+    {
+        stampDst[i] = std::sin(i * 0.01f) * 10.0f;
+        stampValue[i] = std::cos(i * 0.013f) * 10.0f;
+        stampWeight[i] = (i % TILE_N) / (float)TILE_N;
+    }
+    const char* const blendNames[STAMP_BLEND_COUNT] = { "add", "max", "min", "lerp" };
+    const StampBlendFn blendScalar[STAMP_BLEND_COUNT] = { blendStampRow<STAMP_ADD>, blendStampRow<STAMP_MAX>, blendStampRow<STAMP_MIN>, blendStampRow<STAMP_LERP> };
+    for (int mode = 0; mode < STAMP_BLEND_COUNT; ++mode)
+    {
+        auto blendCase = [](StampBlendFn blend)
+        {
+            return [blend]
+            {
+                for (int row = 0; row < TILE_N; ++row)
+                    blend(&stampDst[row * TILE_N], &stampValue[row * TILE_N], &stampWeight[row * TILE_N], TILE_N);
+                benchSink = stampDst[TILE_N + 1];
+            };
+        };
+        std::string name = std::string("stamps/") + blendNames[mode];
+        cases.push_back({ name, TILE_N * TILE_N, blendCase(blendScalar[mode]) });
+#if defined(__GNUC__) && defined(__x86_64__)
+        const StampBlendFn blendAvx2[STAMP_BLEND_COUNT] = { blendStampRowAvx2<STAMP_ADD>, blendStampRowAvx2<STAMP_MAX>, blendStampRowAvx2<STAMP_MIN>, blendStampRowAvx2<STAMP_LERP> };
+        if (cpuHasAvx2())
+            cases.push_back({ name + "-avx2", TILE_N * TILE_N, blendCase(blendAvx2[mode]) });
+#endif
+    }
+    static std::vector<Stamp> chunkStamps;
+    for (int n = 0; n < 256; ++n)
+    {
+        Stamp stamp;
+        stamp.shape = (StampShape)(n % STAMP_SHAPE_COUNT);
+        stamp.blend = (StampBlend)(n / STAMP_SHAPE_COUNT % STAMP_BLEND_COUNT);
+        stamp.x = (n * 37 % 64) + 0.5f;
+        stamp.z = (n * 23 % 64) + 0.25f;
+        stamp.rotation = n * 0.7f;
+        stamp.scale = STAMP_MIN_SCALE + (n % 7) / 6.0f * (STAMP_MAX_SCALE - STAMP_MIN_SCALE);
+        stamp.level = 5.0f;
+        stamp.height = 8.0f * stamp.scale;
+        chunkStamps.push_back(stamp);
+    }
+    cases.push_back({ "stamps/chunk x256", 256, []
+    {
+        static float chunk[(TILE_N + 1) * (TILE_N + 1)];
+        std::fill(chunk, chunk + (TILE_N + 1) * (TILE_N + 1), 0.0f);
+        stampLibrary.apply(chunk, TILE_N + 1, 0, 0, 1, chunkStamps.data(), (int)chunkStamps.size());
+        benchSink = chunk[TILE_N / 2 * (TILE_N + 1) + TILE_N / 2];
+    } });
+    cases.push_back({ "raycastTerrain", 1, []
+    {
+        static bool resident = false;
+        if (!resident)
+            assembleTerrainHeights(heights.data(), GRID_MAX_N, 0, 0);
+        resident = true;
+        glm::vec3 hit(0.0f);
+        raycastTerrain(glm::vec3(0.0f, 50.0f, 0.0f), glm::normalize(glm::vec3(0.3f, -0.4f, -1.0f)), BRUSH_RAY_DISTANCE, hit);
+        benchSink = hit.y;
+    } });
+}
 
-// settings
-const unsigned int SCR_WIDTH = 1280;
-const unsigned int SCR_HEIGHT = 720;
+// adapters with the parameters the terrain would use
+static float noisePlain(float x, float y, float z) { return stb_perlin_noise3(x, y, z, 0, 0, 0); }
+static float noiseSeeded(float x, float y, float z) { return stb_perlin_noise3_seed(x, y, z, 0, 0, 0, 7); }
+static float noiseRidge(float x, float y, float z) { return stb_perlin_ridge_noise3(x, y, z, 2.0f, 0.5f, 1.0f, TERRAIN_OCTAVES); }
+static float noiseFbm(float x, float y, float z) { return stb_perlin_fbm_noise3(x, y, z, 2.0f, 0.5f, TERRAIN_OCTAVES); }
+static float noiseTurbulence(float x, float y, float z) { return stb_perlin_turbulence_noise3(x, y, z, 2.0f, 0.5f, TERRAIN_OCTAVES); }
+static float noiseWrapped(float x, float y, float z) { return stb_perlin_noise3_wrap_nonpow2(x, y, z, 100, 100, 100, 7); }
 
-// camera
-Camera camera(glm::vec3(0.0f, 50.0f, 100.0f));
-float lastX = SCR_WIDTH / 2.0f;
-float lastY = SCR_HEIGHT / 2.0f;
-bool firstMouse = true;
+template <NoiseFn F>
+static void noiseBatch(const float* x, const float* z, int count, float y, float* out)
+{
+    for (int i = 0; i < count; ++i)
+        out[i] = F(x[i], y, z[i]);
+}
 
-// timing
-float deltaTime = 0.0f;
-float lastFrame = 0.0f;
+#if defined(__GNUC__) && defined(__x86_64__)
+template <NoiseFn F>
+__attribute__((target("avx2,fma"))) static void noiseBatchAvx2(const float* x, const float* z, int count, float y, float* out)
+{
+    for (int i = 0; i < count; ++i)
+        out[i] = F(x[i], y, z[i]);
+}
 
-// terrain state
-const int GRID_N = 256;      
-float terrainScale = 0.5f;              // distance between grid points
-float terrainAmplitude = 30.0f;        // max height
-float terrainFreq = 0.02f;             // base frequency
-float terrainOffsetX = 0.0f;           // moves when pressing WASD/arrows
-float terrainOffsetZ = 0.0f;
+#define NOISE_AVX2(F) (cpuHasAvx2() ? &noiseBatchAvx2<F> : nullptr)
+#else
+#define NOISE_AVX2(F) nullptr
+#endif
 
-// dynamic buffers
-unsigned int terrainVAO = 0, terrainVBO = 0, terrainEBO = 0;
-size_t terrainIndexCount = 0;
+// fbm-style ranges are the geometric sums of their octave amplitudes
+const NoiseBackend noiseBackends[] =
+{
+    { "noise3", noisePlain, noiseBatch<noisePlain>, NOISE_AVX2(noisePlain), -1.0f, 1.0f },
+    { "noise3_seed", noiseSeeded, noiseBatch<noiseSeeded>, NOISE_AVX2(noiseSeeded), -1.0f, 1.0f },
+    { "ridge", noiseRidge, noiseBatch<noiseRidge>, NOISE_AVX2(noiseRidge), 0.0f, 2.0f },
+    { "fbm", noiseFbm, noiseBatch<noiseFbm>, NOISE_AVX2(noiseFbm), -2.0f, 2.0f },
+    { "turbulence", noiseTurbulence, noiseBatch<noiseTurbulence>, NOISE_AVX2(noiseTurbulence), 0.0f, 2.0f },
+    { "wrap_nonpow2", noiseWrapped, noiseBatch<noiseWrapped>, NOISE_AVX2(noiseWrapped), -1.0f, 1.0f },
+};
+const int noiseBackendCount = sizeof(noiseBackends) / sizeof(noiseBackends[0]);
 
-int main()
+NoiseQuality measureNoiseQuality(const NoiseBackend& backend)
 {
-    // glfw: initialize and configure
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-#endif
+    const int N = NOISE_QUALITY_N;
+    std::vector<float> grid(N * N);
+    for (int z = 0; z < N; ++z)
+        for (int x = 0; x < N; ++x)
+            grid[z * N + x] = backend.sample(x * NOISE_QUALITY_STEP + 0.31f, 0.47f, z * NOISE_QUALITY_STEP + 0.73f);
 
-    GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "3D Kinetic Terrain", NULL, NULL);
-    if (window == NULL)
+    NoiseQuality q;
+    q.name = backend.name;
+    double sum = 0.0, sumSq = 0.0;
+    q.minValue = q.maxValue = grid[0];
+    for (float v : grid)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
+        q.minValue = std::min(q.minValue, v);
+        q.maxValue = std::max(q.maxValue, v);
+        sum += v;
+        sumSq += (double)v * v;
     }
-    glfwMakeContextCurrent(window);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-    glfwSetCursorPosCallback(window, mouse_callback);
-    glfwSetScrollCallback(window, scroll_callback);
+    q.mean = (float)(sum / grid.size());
+    q.stddev = (float)std::sqrt(std::max(0.0, sumSq / grid.size() - (double)q.mean * q.mean));
 
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    // directional gradient energy, compared between directions with the same
+    // step length (x against z, diagonal against anti-diagonal) so aliasing of
+    // the finest octaves affects both sides alike
+    double gx = 0.0, gz = 0.0, gd = 0.0, ga = 0.0;
+    for (int z = 0; z + 1 < N; ++z)
+    {
+        for (int x = 0; x + 1 < N; ++x)
+        {
+            float h = grid[z * N + x];
+            float dx = grid[z * N + x + 1] - h;
+            float dz = grid[(z + 1) * N + x] - h;
+            float dd = grid[(z + 1) * N + x + 1] - h;
+            float da = grid[(z + 1) * N + x] - grid[z * N + x + 1];
+            gx += dx * dx;
+            gz += dz * dz;
+            gd += dd * dd;
+            ga += da * da;
+        }
+    }
+    auto balance = [](double a, double b) { return std::max(a, b) > 0.0 ? std::min(a, b) / std::max(a, b) : 0.0; };
+    q.isotropy = (float)std::min(balance(gx, gz), balance(gd, ga));
 
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    // power spectrum of the rows (mean removed), summed into octave bands of
+    // frequency bins [1,2), [2,4), ... [N/4, N/2]
+    double bands[NOISE_BANDS] = {};
+    double total = 0.0;
+    std::vector<double> re(N / 2 + 1), im(N / 2 + 1);
+    for (int z = 0; z < N; ++z)
     {
-        std::cout << "Failed to initialize GLAD" << std::endl;
-        return -1;
+        const float* row = &grid[z * N];
+        double rowMean = 0.0;
+        for (int x = 0; x < N; ++x)
+            rowMean += row[x];
+        rowMean /= N;
+        for (int k = 1; k <= N / 2; ++k)
+        {
+            double r = 0.0, i = 0.0;
+            for (int x = 0; x < N; ++x)
+            {
+                double angle = 2.0 * 3.14159265358979 * k * x / N;
+                r += (row[x] - rowMean) * std::cos(angle);
+                i -= (row[x] - rowMean) * std::sin(angle);
+            }
+            double power = r * r + i * i;
+            int band = std::min(NOISE_BANDS - 1, (int)std::log2((double)k));
+            bands[band] += power;
+            total += power;
+        }
     }
+    for (int b = 0; b < NOISE_BANDS; ++b)
+        q.bands[b] = total > 0.0 ? (float)(bands[b] / total) : 0.0f;
 
-    glEnable(GL_DEPTH_TEST);
+    const float slack = 1e-3f;
+    if (q.minValue < backend.rangeMin - slack || q.maxValue > backend.rangeMax + slack)
+        q.problem = "out of range";
+    else if (q.stddev < 0.02f * (backend.rangeMax - backend.rangeMin))
+        q.problem = "degenerate (no variance)";
+    else if (q.isotropy < NOISE_MIN_ISOTROPY)
+        q.problem = "anisotropic";
+    else if (q.bands[NOISE_BANDS - 1] > NOISE_MAX_TOP_BAND)
+        q.problem = "high-frequency energy";
+    return q;
+}
 
-    // shaders
-    Shader lightingShader("6.multiple_lights.vs", "6.multiple_lights.fs");
+// two-sided 95% quantile of Student's t for small sample counts
+static double studentT95(int df)
+{
+    static const double table[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086 };
+    return (df >= 1 && df <= 20) ? table[df - 1] : 1.96;
+}
 
-    // create terrain buffers
-    glGenVertexArrays(1, &terrainVAO);
-    glGenBuffers(1, &terrainVBO);
-    glGenBuffers(1, &terrainEBO);
+BenchResult measureBenchmark(const BenchCase& bench)
+{
+    using clock = std::chrono::steady_clock;
+    auto seconds = [](clock::duration d) { return std::chrono::duration<double>(d).count(); };
 
-    // initial terrain data
-    std::vector<float> terrainVertices;
-    std::vector<unsigned int> terrainIndices;
-    generateTerrain(terrainVertices, terrainIndices, GRID_N, terrainScale, terrainOffsetX, terrainOffsetZ, terrainAmplitude, terrainFreq);
-    terrainIndexCount = terrainIndices.size();
+    // warm-up, which also sizes a sample
+    int warmRuns = 0;
+    auto start = clock::now();
+    while (warmRuns < 3 || seconds(clock::now() - start) < BENCH_WARMUP_SECONDS)
+    {
+        bench.body();
+        ++warmRuns;
+    }
+    double perRun = seconds(clock::now() - start) / warmRuns;
+    int reps = std::max(1, (int)std::ceil(BENCH_SAMPLE_SECONDS / perRun));
 
-    glBindVertexArray(terrainVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
-    glBufferData(GL_ARRAY_BUFFER, terrainVertices.size() * sizeof(float), terrainVertices.data(), GL_DYNAMIC_DRAW);
+    BenchResult result;
+    result.name = bench.name;
+    result.samples = BENCH_SAMPLES;
+    PerfCounters* counters = perfCountersEnabled ? PerfCounters::thread() : nullptr;
+    uint64_t before[PERF_COUNTER_COUNT], after[PERF_COUNTER_COUNT];
+    result.counters = counters && counters->read(before);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainEBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, terrainIndices.size() * sizeof(unsigned int), terrainIndices.data(), GL_STATIC_DRAW);
+    double sum = 0.0, sumSq = 0.0, best = 1e300;
+    for (int s = 0; s < BENCH_SAMPLES; ++s)
+    {
+        auto t0 = clock::now();
+        for (int r = 0; r < reps; ++r)
+            bench.body();
+        double ns = seconds(clock::now() - t0) * 1e9 / (reps * bench.items);
+        sum += ns;
+        sumSq += ns * ns;
+        best = std::min(best, ns);
+    }
 
-    // layout
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
-    glEnableVertexAttribArray(2);
+    if (result.counters && counters->read(after))
+    {
+        double items = (double)BENCH_SAMPLES * reps * bench.items;
+        uint64_t cycles = after[PERF_CYCLES] - before[PERF_CYCLES];
+        result.ipc = cycles ? (double)(after[PERF_INSTRUCTIONS] - before[PERF_INSTRUCTIONS]) / cycles : 0.0;
+        result.cacheMissesPerItem = (after[PERF_CACHE_MISSES] - before[PERF_CACHE_MISSES]) / items;
+        result.branchMissesPerItem = (after[PERF_BRANCH_MISSES] - before[PERF_BRANCH_MISSES]) / items;
+    }
+    else
+    {
+        result.counters = false;
+    }
+
+    int n = BENCH_SAMPLES;
+    double mean = sum / n;
+    double variance = std::max(0.0, (sumSq - n * mean * mean) / (n - 1));
+    result.nsPerItem = mean;
+    result.ci95 = studentT95(n - 1) * std::sqrt(variance / n);
+    result.minNsPerItem = best;
+    return result;
+}
+
+// one result per line, so baselines can be read back without a JSON library
+static bool writeBenchResults(const char* path, const std::vector<BenchResult>& results, const std::vector<NoiseQuality>& quality)
+{
+    std::ofstream file(path);
+    if (!file)
+        return false;
+    file << "{\"threads\":" << std::thread::hardware_concurrency() << ",\"avx2\":" << (noiseBackends[0].batchAvx2 ? "true" : "false")
+         << ",\"benchmarks\":[\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& r = results[i];
+        file << "{\"name\":\"" << r.name << "\",\"unit\":\"ns/item\",\"nsPerItem\":" << r.nsPerItem << ",\"ci95\":" << r.ci95
+             << ",\"min\":" << r.minNsPerItem << ",\"samples\":" << r.samples;
+        if (r.counters)
+            file << ",\"ipc\":" << r.ipc << ",\"cacheMissesPerItem\":" << r.cacheMissesPerItem << ",\"branchMissesPerItem\":" << r.branchMissesPerItem;
+        file << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    file << "],\"noiseQuality\":[\n";
+    for (size_t i = 0; i < quality.size(); ++i)
+    {
+        const NoiseQuality& q = quality[i];
+        file << "{\"name\":\"quality/" << q.name << "\",\"min\":" << q.minValue << ",\"max\":" << q.maxValue << ",\"mean\":" << q.mean
+             << ",\"stddev\":" << q.stddev << ",\"isotropy\":" << q.isotropy;
+        for (int b = 0; b < NOISE_BANDS; ++b)
+            file << ",\"band" << b << "\":" << q.bands[b];
+        file << "}" << (i + 1 < quality.size() ? "," : "") << "\n";
+    }
+    file << "]}\n";
+    return (bool)file;
+}
 
-    // setup point lights positions
-    glm::vec3 pointLightPositions[] = {
-        glm::vec3( 50.0f,  60.0f,  50.0f),
-        glm::vec3( 100.0f,  80.0f, -40.0f),
-        glm::vec3(-60.0f,  70.0f, -120.0f),
-        glm::vec3( 0.0f,   65.0f, -50.0f)
+static bool readBenchBaseline(const char* path, std::vector<BenchResult>& results, std::vector<NoiseQuality>& quality)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+    auto number = [](const std::string& line, const char* key, double& value)
+    {
+        size_t at = line.find(key);
+        if (at == std::string::npos)
+            return false;
+        value = std::atof(line.c_str() + at + std::strlen(key));
+        return true;
     };
+    std::string line;
+    while (std::getline(file, line))
+    {
+        size_t at = line.find("\"name\":\"");
+        if (at == std::string::npos)
+            continue;
+        at += 8;
+        std::string name = line.substr(at, line.find('"', at) - at);
+        if (name.compare(0, 8, "quality/") == 0)
+        {
+            NoiseQuality q;
+            q.name = name.substr(8);
+            double value = 0.0;
+            bool complete = number(line, "\"stddev\":", value);
+            q.stddev = (float)value;
+            for (int b = 0; b < NOISE_BANDS && complete; ++b)
+            {
+                std::string key = "\"band" + std::to_string(b) + "\":";
+                complete = number(line, key.c_str(), value);
+                q.bands[b] = (float)value;
+            }
+            if (complete)
+                quality.push_back(q);
+            continue;
+        }
+        BenchResult r;
+        r.name = name;
+        if (number(line, "\"nsPerItem\":", r.nsPerItem) && number(line, "\"ci95\":", r.ci95))
+            results.push_back(r);
+    }
+    return true;
+}
 
-    // shader configuration
-    lightingShader.use();
-    lightingShader.setFloat("material.shininess", 32.0f);
+// returns 1 if a noise backend fails its quality checks, or a baseline was
+// given and any benchmark regressed
+int runBenchmarks()
+{
+    // tiles are always generated, so timings do not depend on what an
+    // earlier run left on disk, and the working directory stays clean
+    tileDiskCache = false;
+
+    // same worker layout as the interactive run
+    unsigned cores = std::thread::hardware_concurrency();
+    jobSystem.start(cores > 3 ? cores - 2 : 1);
 
-    // render loop
-    while (!glfwWindowShouldClose(window))
+    std::vector<BenchCase> cases;
+    collectBenchmarks(cases);
+    std::vector<BenchResult> baseline;
+    std::vector<NoiseQuality> baselineQuality;
+    if (benchBaselinePath && !readBenchBaseline(benchBaselinePath, baseline, baselineQuality))
     {
-        float currentFrame = static_cast<float>(glfwGetTime());
-        deltaTime = currentFrame - lastFrame;
-        lastFrame = currentFrame;
+        std::cout << "Cannot read baseline " << benchBaselinePath << std::endl;
+        jobSystem.stop();
+        return 1;
+    }
 
-        processInput(window);
+    std::vector<BenchResult> results;
+    int regressions = 0;
+    for (const BenchCase& bench : cases)
+    {
+        if (benchFilter && bench.name.find(benchFilter) == std::string::npos)
+            continue;
+        BenchResult r = measureBenchmark(bench);
+        results.push_back(r);
 
-        // update terrain if offsets changed
-        static float lastOffsetX = terrainOffsetX;
-        static float lastOffsetZ = terrainOffsetZ;
-        if (std::abs(lastOffsetX - terrainOffsetX) > 1e-6f || std::abs(lastOffsetZ - terrainOffsetZ) > 1e-6f)
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-32s %10.3f ns/item +- %.3f (min %.3f)", r.name.c_str(), r.nsPerItem, r.ci95, r.minNsPerItem);
+        std::cout << line;
+        if (r.counters)
         {
-            generateTerrain(terrainVertices, terrainIndices, GRID_N, terrainScale, terrainOffsetX, terrainOffsetZ, terrainAmplitude, terrainFreq);
-            glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
-            glBufferSubData(GL_ARRAY_BUFFER, 0, terrainVertices.size() * sizeof(float), terrainVertices.data());
-            lastOffsetX = terrainOffsetX;
-            lastOffsetZ = terrainOffsetZ;
+            std::snprintf(line, sizeof(line), "  IPC %.2f, %.3f cache / %.3f branch misses per item", r.ipc, r.cacheMissesPerItem, r.branchMissesPerItem);
+            std::cout << line;
         }
+        for (const BenchResult& old : baseline)
+        {
+            if (old.name != r.name)
+                continue;
+            double change = (r.nsPerItem - old.nsPerItem) / old.nsPerItem;
+            bool regressed = change > BENCH_REGRESSION && r.nsPerItem - r.ci95 > old.nsPerItem + old.ci95;
+            std::snprintf(line, sizeof(line), "  [baseline %.3f, %+.1f%%%s]", old.nsPerItem, change * 100.0, regressed ? ", REGRESSION" : "");
+            std::cout << line;
+            regressions += regressed ? 1 : 0;
+        }
+        std::cout << std::endl;
+    }
 
-        // render
-        glClearColor(0.2f, 0.25f, 0.3f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        // use lighting shader
-        lightingShader.use();
-        lightingShader.setVec3("viewPos", camera.Position);
-
-        // directional light
-        lightingShader.setVec3("dirLight.direction", -0.2f, -1.0f, -0.3f);
-        lightingShader.setVec3("dirLight.ambient", 0.05f, 0.05f, 0.05f);
-        lightingShader.setVec3("dirLight.diffuse", 0.4f, 0.4f, 0.4f);
-        lightingShader.setVec3("dirLight.specular", 0.5f, 0.5f, 0.5f);
+    jobSystem.stop();
 
-        // point lights
-        for (int i = 0; i < 4; ++i) {
-            std::string idx = std::to_string(i);
-            lightingShader.setVec3(("pointLights[" + idx + "].position").c_str(), pointLightPositions[i]);
-            lightingShader.setVec3(("pointLights[" + idx + "].ambient").c_str(), 0.05f, 0.05f, 0.05f);
-            lightingShader.setVec3(("pointLights[" + idx + "].diffuse").c_str(), 0.8f, 0.8f, 0.8f);
-            lightingShader.setVec3(("pointLights[" + idx + "].specular").c_str(), 1.0f, 1.0f, 1.0f);
-            lightingShader.setFloat(("pointLights[" + idx + "].constant").c_str(), 1.0f);
-            lightingShader.setFloat(("pointLights[" + idx + "].linear").c_str(), 0.002f);
-            lightingShader.setFloat(("pointLights[" + idx + "].quadratic").c_str(), 0.0002f);
+    // quality of every noise backend whose benchmarks were selected
+    std::vector<NoiseQuality> quality;
+    int failures = 0;
+    for (int b = 0; b < noiseBackendCount; ++b)
+    {
+        std::string name = std::string("noise/") + noiseBackends[b].name;
+        if (benchFilter && name.find(benchFilter) == std::string::npos)
+            continue;
+        NoiseQuality q = measureNoiseQuality(noiseBackends[b]);
+        for (const NoiseQuality& old : baselineQuality)
+        {
+            if (old.name != q.name || !q.problem.empty())
+                continue;
+            if (std::abs(q.stddev - old.stddev) > NOISE_STDDEV_TOLERANCE * old.stddev)
+                q.problem = "stddev drifted from baseline";
+            for (int i = 0; i < NOISE_BANDS; ++i)
+                if (std::abs(q.bands[i] - old.bands[i]) > NOISE_BAND_TOLERANCE)
+                    q.problem = "spectrum drifted from baseline";
         }
+        quality.push_back(q);
 
-        // view/projection
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 200.0f);
-        glm::mat4 view = camera.GetViewMatrix();
-        lightingShader.setMat4("projection", projection);
-        lightingShader.setMat4("view", view);
+        char line[256];
+        std::snprintf(line, sizeof(line), "quality/%-23s range [%.3f, %.3f] mean %.3f stddev %.3f isotropy %.2f bands",
+                      q.name.c_str(), q.minValue, q.maxValue, q.mean, q.stddev, q.isotropy);
+        std::cout << line;
+        for (int i = 0; i < NOISE_BANDS; ++i)
+        {
+            std::snprintf(line, sizeof(line), " %.2f", q.bands[i]);
+            std::cout << line;
+        }
+        if (!q.problem.empty())
+            std::cout << "  FAILED: " << q.problem;
+        std::cout << std::endl;
+        failures += q.problem.empty() ? 0 : 1;
+    }
 
-        // model for terrain
-        glm::mat4 model = glm::mat4(1.0f);
-        lightingShader.setMat4("model", model);
+    if (benchOutputPath && !writeBenchResults(benchOutputPath, results, quality))
+        std::cout << "Cannot write " << benchOutputPath << std::endl;
+    if (regressions)
+        std::cout << regressions << " benchmark(s) regressed by more than " << BENCH_REGRESSION * 100.0 << "%" << std::endl;
+    if (failures)
+        std::cout << failures << " noise backend(s) failed quality checks" << std::endl;
+    return (regressions || failures) ? 1 : 0;
+}
 
-        // terrain material
-        lightingShader.setVec3("material.diffuse", 0.2f, 0.7f, 0.2f);
-        lightingShader.setVec3("material.specular", 0.2f, 0.2f, 0.2f);
-        lightingShader.setFloat("material.shininess", 32.0f);
 
-        // draw terrain
-        glBindVertexArray(terrainVAO);
-        glDrawElements(GL_TRIANGLES, (GLsizei)terrainIndexCount, GL_UNSIGNED_INT, 0);
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+// --- calibration -----------------------------------------------------------
+std::string hardwareFingerprint()
+{
+    std::string cpu = "unknown cpu";
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    for (std::string line; std::getline(cpuinfo, line);)
+    {
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos)
+        {
+            cpu = line.substr(line.find(':') + 2);
+            break;
+        }
     }
+    return cpu + " | " + std::to_string(std::thread::hardware_concurrency()) + " threads | " +
+           (noiseBackends[0].batchAvx2 ? "avx2" : "no avx2");
+}
 
-    // cleanup
-    glDeleteVertexArrays(1, &terrainVAO);
-    glDeleteBuffers(1, &terrainVBO);
-    glDeleteBuffers(1, &terrainEBO);
+// FNV-1a of the fingerprint; the fingerprint itself is checked on load
+std::string calibrationPath(const std::string& fingerprint)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : fingerprint)
+        hash = (hash ^ c) * 1099511628211ull;
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.txt", (unsigned long long)hash);
+    return std::string(CALIBRATION_DIR) + "/" + name;
+}
 
-    glfwTerminate();
-    return 0;
+bool CalibrationProfile::load(const std::string& path, const std::string& fingerprint)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+    bool matches = false;
+    for (std::string line; std::getline(file, line);)
+    {
+        size_t eq = line.find('=');
+        if (line.empty() || line[0] == '#' || eq == std::string::npos)
+            continue;
+        std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+        if (key == "fingerprint")
+            matches = value == fingerprint;
+        else if (key == "worker_threads")
+            workerThreads = (unsigned)std::atoi(value.c_str());
+        else if (key == "noise")
+            noise = value;
+        else if (key == "grid_n")
+            gridN = std::atoi(value.c_str());
+        else if (key == "lod_pixel_error")
+            lodPixelError = (float)std::atof(value.c_str());
+        else if (key == "renderer")
+            renderer = value;
+    }
+    return matches;
 }
 
+bool CalibrationProfile::save(const std::string& path, const std::string& fingerprint) const
+{
+    std::error_code error;
+    std::filesystem::create_directories(CALIBRATION_DIR, error);
+    std::ofstream file(path);
+    if (!file)
+        return false;
+    file << "# written by --calibrate; delete to fall back to the defaults\n"
+         << "fingerprint=" << fingerprint << "\n"
+         << "worker_threads=" << workerThreads << "\n"
+         << "noise=" << noise << "\n"
+         << "grid_n=" << gridN << "\n"
+         << "lod_pixel_error=" << lodPixelError << "\n"
+         << "renderer=" << renderer << "\n";
+    return (bool)file;
+}
 
-// --- terrain generator -----------------------------------------------------
-void generateTerrain(std::vector<float>& vertices, std::vector<unsigned int>& indices, int N, float scale, float offsetX, float offsetZ, float amplitude, float freq)
+static NoiseBatchFn calibrationNoisePath(const std::string& name)
 {
-    vertices.clear();
-    indices.clear();
-    vertices.reserve(N * N * 8);
-    indices.reserve((N - 1) * (N - 1) * 6);
+    if (name == "batch")
+        return noiseBackends[0].batch;
+    if (name == "avx2")
+        return noiseBackends[0].batchAvx2;
+    return nullptr;
+}
 
-    // heights grid
-    std::vector<float> heights(N * N);
-    for (int z = 0; z < N; ++z)
+// tiles on disk are shared between noise paths, so a path is only usable
+// while it reproduces the per-sample heights bit for bit
+static bool noisePathIsExact(NoiseBatchFn path)
+{
+    NoiseBatchFn saved = tileNoiseBatch;
+    tileNoiseBatch = nullptr;
+    std::unique_ptr<HeightTile> reference(generateHeightTile(0, 4096, 4096));
+    tileNoiseBatch = path;
+    std::unique_ptr<HeightTile> tile(generateHeightTile(0, 4096, 4096));
+    tileNoiseBatch = saved;
+    return std::memcmp(tile->heights, reference->heights, sizeof(tile->heights)) == 0;
+}
+
+// values out of range fall back to the defaults rather than failing; so
+// does a noise path that no longer matches, as the profile may predate
+// this build
+void applyCalibration(const CalibrationProfile& profile)
+{
+    workerThreads = std::min(profile.workerThreads, std::max(1u, std::thread::hardware_concurrency()));
+    tileNoiseBatch = calibrationNoisePath(profile.noise);
+    if (tileNoiseBatch && !noisePathIsExact(tileNoiseBatch))
     {
-        for (int x = 0; x < N; ++x)
-        {
-            float wx = (float)x;
-            float wz = (float)z;
-            float h = sampleHeight(wx * scale, wz * scale, offsetX, offsetZ, amplitude, freq);
-            heights[z * N + x] = h;
-        }
+        std::cout << "Calibration noise path " << profile.noise << " differs from scalar, using scalar" << std::endl;
+        tileNoiseBatch = nullptr;
     }
+    gridN = profile.gridN >= 2 * TILE_N && profile.gridN <= GRID_MAX_N ? profile.gridN : GRID_MAX_N;
+    const QualityLadder& ladder = QUALITY_LADDERS[QUALITY_LOD_ERROR];
+    int level = 0;
+    while (level + 1 < ladder.levels && ladder.values[level] < profile.lodPixelError)
+        ++level;
+    qualityGovernor.setLevel(QUALITY_LOD_ERROR, level);
+}
 
-    // build vertices with normals computed via central differences
-    for (int z = 0; z < N; ++z)
+// best of CALIBRATE_REPEATS runs of CALIBRATE_TILES tiles on the job system
+static double timeTileGeneration()
+{
+    double best = 0.0;
+    for (int repeat = 0; repeat < CALIBRATE_REPEATS; ++repeat)
     {
-        for (int x = 0; x < N; ++x)
+        auto start = std::chrono::steady_clock::now();
+        jobSystem.parallelFor(CALIBRATE_TILES, [repeat](int i)
         {
-            float px = (x - N/2) * scale; // center grid around origin
-            float pz = (z - N/2) * scale;
-            float py = heights[z * N + x];
-
-            // compute normals by sampling neighbors
-            float hl = (x > 0) ? heights[z * N + (x - 1)] : heights[z * N + x];
-            float hr = (x < N-1) ? heights[z * N + (x + 1)] : heights[z * N + x];
-            float hd = (z > 0) ? heights[(z - 1) * N + x] : heights[z * N + x];
-            float hu = (z < N-1) ? heights[(z + 1) * N + x] : heights[z * N + x];
-
-            glm::vec3 normal;
-            normal.x = hl - hr; // -dh/dx approx
-            normal.y = 2.0f * scale; // arbitrary to keep y positive
-            normal.z = hd - hu; // -dh/dz approx
-            normal = glm::normalize(normal);
+            // far from the origin, so no cached tile is being reproduced
+            HeightTile* tile = generateHeightTile(0, 4096 + i, 4096 + repeat);
+            benchSink = tile->heights[0];
+            delete tile;
+        });
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        best = repeat == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+}
 
-            // texcoords
-            float u = (float)x / (N - 1);
-            float v = (float)z / (N - 1);
+void calibrateGeneration(CalibrationProfile& profile)
+{
+    char line[200];
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
 
-            // push: pos(3), normal(3), tex(2)
-            vertices.push_back(px);
-            vertices.push_back(py);
-            vertices.push_back(pz);
-            vertices.push_back(normal.x);
-            vertices.push_back(normal.y);
-            vertices.push_back(normal.z);
-            vertices.push_back(u);
-            vertices.push_back(v);
+    // noise path: only exact paths; a path must win by 3% to count
+    tileNoiseBatch = nullptr;
+    std::unique_ptr<HeightTile> reference(generateHeightTile(0, 4096, 4096));
+    double bestMs = 0.0;
+    for (const char* name : { "scalar", "batch", "avx2" })
+    {
+        tileNoiseBatch = calibrationNoisePath(name);
+        if (!tileNoiseBatch && std::strcmp(name, "scalar") != 0)
+            continue;
+        if (tileNoiseBatch && !noisePathIsExact(tileNoiseBatch))
+        {
+            std::cout << "[calibrate] noise " << name << ": heights differ from scalar, skipped" << std::endl;
+            continue;
+        }
+        double ms = timeTileGeneration() / CALIBRATE_TILES;
+        std::snprintf(line, sizeof(line), "[calibrate] noise %-6s %8.3f ms/tile", name, ms);
+        std::cout << line << std::endl;
+        if (bestMs == 0.0 || ms < bestMs * 0.97)
+        {
+            bestMs = ms;
+            profile.noise = name;
         }
     }
+    tileNoiseBatch = calibrationNoisePath(profile.noise);
 
-    // indices (two triangles per quad)
-    for (int z = 0; z < N - 1; ++z)
+    // workers: powers of two and the default up to one per core; more
+    // threads must win by 5%, as they take cores from the rest of the host
+    std::vector<unsigned> counts;
+    for (unsigned t = 1; t <= cores; t *= 2)
+        counts.push_back(t);
+    for (unsigned t : { cores > 3 ? cores - 2 : 1u, cores })
+        if (std::find(counts.begin(), counts.end(), t) == counts.end())
+            counts.push_back(t);
+    std::sort(counts.begin(), counts.end());
+    double bestTilesPerMs = 0.0;
+    for (unsigned t : counts)
     {
-        for (int x = 0; x < N - 1; ++x)
+        jobSystem.start(t);
+        double tilesPerMs = CALIBRATE_TILES / timeTileGeneration();
+        jobSystem.stop();
+        std::snprintf(line, sizeof(line), "[calibrate] workers %-4u %8.2f tiles/ms", t, tilesPerMs);
+        std::cout << line << std::endl;
+        if (tilesPerMs > bestTilesPerMs * 1.05)
         {
-            unsigned int i0 = z * N + x;
-            unsigned int i1 = z * N + (x + 1);
-            unsigned int i2 = (z + 1) * N + x;
-            unsigned int i3 = (z + 1) * N + (x + 1);
+            bestTilesPerMs = tilesPerMs;
+            profile.workerThreads = t;
+        }
+    }
 
-            // triangle 1
-            indices.push_back(i0);
-            indices.push_back(i2);
-            indices.push_back(i1);
-            // triangle 2
-            indices.push_back(i1);
-            indices.push_back(i2);
-            indices.push_back(i3);
+    // grid extent: the largest grid whose full rebuild after a jump (every
+    // tile on the workers, then every chunk mesh on the sim thread) fits
+    const int H = TILE_N + 3;
+    std::vector<float> halo(H * H);
+    for (int i = 0; i < H * H; ++i)
+        halo[i] = reference->heights[(i / H % TILE_N) * TILE_N + i % H % TILE_N];
+    TerrainMesh mesh;
+    double chunkMs = 0.0;
+    for (int repeat = 0; repeat < CALIBRATE_REPEATS; ++repeat)
+    {
+        auto start = std::chrono::steady_clock::now();
+        buildChunkVertices(halo.data(), TILE_N + 1, terrainScale, mesh.vertices);
+        mesh.size = TILE_N + 1;
+        computeLodErrors(mesh);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        chunkMs = repeat == 0 ? ms : std::min(chunkMs, ms);
+    }
+    profile.gridN = 2 * TILE_N;
+    for (int n = GRID_MAX_N; n > 2 * TILE_N; n -= TILE_N)
+    {
+        int chunks = (n - 2) / TILE_N + 2, tiles = chunks + 2;
+        double rebuildMs = tiles * tiles / bestTilesPerMs + chunks * chunks * chunkMs;
+        if (rebuildMs <= CALIBRATE_GRID_BUDGET_MS)
+        {
+            profile.gridN = n;
+            break;
         }
     }
+    std::snprintf(line, sizeof(line), "[calibrate] chunk mesh %.3f ms, grid %d", chunkMs, profile.gridN);
+    std::cout << line << std::endl;
 }
 
-float sampleHeight(float x, float z, float offsetX, float offsetZ, float amplitude, float freq)
+int calibrationSweepFrames()
 {
-    x += offsetX;
-    z += offsetZ;
-
-    int octaves = 6;
-    float persistence = 0.5f;
-    float lacunarity = 2.0f;
+    return CALIBRATE_WARMUP_FRAMES + QUALITY_LADDERS[QUALITY_LOD_ERROR].levels * CALIBRATE_LEVEL_FRAMES;
+}
 
-    float height = 0.0f;
-    float amp = 1.0f; // start with 1, scale later
-    float f = freq;
+// warmup at the best level, then each level in turn
+int calibrationLodLevel(unsigned long long frame)
+{
+    if (frame <= (unsigned long long)CALIBRATE_WARMUP_FRAMES)
+        return 0;
+    return (int)((frame - CALIBRATE_WARMUP_FRAMES - 1) / CALIBRATE_LEVEL_FRAMES);
+}
 
-    for (int i = 0; i < octaves; ++i)
+// the finest LOD error whose median frame fits the budget, else the coarsest
+float pickCalibratedLod(double budgetMs)
+{
+    const QualityLadder& ladder = QUALITY_LADDERS[QUALITY_LOD_ERROR];
+    char line[200];
+    float chosen = 0.0f;
+    for (int level = 0; level < ladder.levels; ++level)
     {
-        float n = stb_perlin_noise3(x * f, 0.0f, z * f, 0, 0, 0); // [-1,1]
-        height += n * amp;
-        amp *= persistence;
-        f *= lacunarity;
+        auto first = calibrationFrameMs.begin() + CALIBRATE_WARMUP_FRAMES + level * CALIBRATE_LEVEL_FRAMES;
+        std::vector<float> frames(first, first + CALIBRATE_LEVEL_FRAMES);
+        std::nth_element(frames.begin(), frames.begin() + frames.size() / 2, frames.end());
+        float median = frames[frames.size() / 2];
+        std::snprintf(line, sizeof(line), "[calibrate] lod pixel error %-4g median %8.2f ms (budget %.2f)", ladder.values[level], median, budgetMs);
+        std::cout << line << std::endl;
+        if (chosen == 0.0f && median <= budgetMs)
+            chosen = ladder.values[level];
     }
+    return chosen > 0.0f ? chosen : ladder.values[ladder.levels - 1];
+}
 
-    // normalize to [0,1]
-    height = (height + 1.0f) / 2.0f;
+// process input
+InputFrame processInput(GLFWwindow *window)
+{
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
 
-    // non-linear shaping: exaggerate peaks
-    height = pow(height, 1.5f); // >1 → taller mountains, <1 → flatter
+    InputFrame input = pendingInput;
+    input.keys = (uint8_t)readMoveKeys(window);
+    readBrushInput(window, input);
+    pendingInput = InputFrame();
 
-    return height * amplitude;
+    // latency stamp: the frame's first event, or now for keys or buttons held down
+    frameInputNs = pendingInputNs ? pendingInputNs : input.keys || input.brush || input.history ? profiler.now() : 0;
+    pendingInputNs = 0;
+    return input;
+}
+
+// everything a frame's input does; the same for live, recorded and replayed input
+void applyInput(const InputFrame& input, float dt)
+{
+    if (input.mouseX != 0.0f || input.mouseY != 0.0f)
+        camera.ProcessMouseMovement(input.mouseX, input.mouseY);
+    if (input.scroll != 0.0f)
+        camera.ProcessMouseScroll(input.scroll);
+    applyMovement(input.keys, dt);
 }
 
+unsigned readMoveKeys(GLFWwindow* window)
+{
+    static const int keys[] = { GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_A, GLFW_KEY_D, GLFW_KEY_UP, GLFW_KEY_DOWN, GLFW_KEY_LEFT, GLFW_KEY_RIGHT };
+    unsigned held = 0;
+    for (int i = 0; i < 8; ++i)
+        if (glfwGetKey(window, keys[i]) == GLFW_PRESS)
+            held |= 1u << i;
+    return held;
+}
 
-// process input
-void processInput(GLFWwindow *window)
+// brush mode (1-4), radius ([ and ]) and undo/redo, once per press; while
+// a mouse button is held the frame carries a stroke: the left button
+// applies the mode, the right one the opposite of raise or lower
+void readBrushInput(GLFWwindow* window, InputFrame& input)
 {
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+    static const int modeKeys[BRUSH_MODE_COUNT] = { GLFW_KEY_1, GLFW_KEY_2, GLFW_KEY_3, GLFW_KEY_4 };
+    for (int i = 0; i < BRUSH_MODE_COUNT; ++i)
+        if (glfwGetKey(window, modeKeys[i]) == GLFW_PRESS)
+            brushMode = (BrushMode)i;
+
+    static bool shrinkHeld = false, growHeld = false;
+    bool shrink = glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS;
+    bool grow = glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS;
+    if (shrink && !shrinkHeld)
+        brushRadius = std::max(brushRadius / BRUSH_RADIUS_STEP, BRUSH_MIN_RADIUS);
+    if (grow && !growHeld)
+        brushRadius = std::min(brushRadius * BRUSH_RADIUS_STEP, BRUSH_MAX_RADIUS);
+    shrinkHeld = shrink;
+    growHeld = grow;
 
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        camera.ProcessKeyboard(FORWARD, deltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        camera.ProcessKeyboard(BACKWARD, deltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        camera.ProcessKeyboard(LEFT, deltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        camera.ProcessKeyboard(RIGHT, deltaTime);
+    static bool undoHeld = false, redoHeld = false;
+    bool ctrl = glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_RIGHT_CONTROL) == GLFW_PRESS;
+    bool shift = glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_RIGHT_SHIFT) == GLFW_PRESS;
+    bool z = glfwGetKey(window, GLFW_KEY_Z) == GLFW_PRESS;
+    bool undo = ctrl && z && !shift;
+    bool redo = ctrl && (glfwGetKey(window, GLFW_KEY_Y) == GLFW_PRESS || (z && shift));
+    if (undo && !undoHeld)
+        input.history = HISTORY_UNDO;
+    else if (redo && !redoHeld)
+        input.history = HISTORY_REDO;
+    undoHeld = undo;
+    redoHeld = redo;
+
+    bool left = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+    bool right = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
+    if (!left && !right)
+        return;
+    BrushMode mode = brushMode;
+    if (right && !left && (mode == BRUSH_RAISE || mode == BRUSH_LOWER))
+        mode = mode == BRUSH_RAISE ? BRUSH_LOWER : BRUSH_RAISE;
+    input.brush = (uint8_t)(mode + 1);
+    input.brushRadius = brushRadius;
+}
+
+// camera and terrain movement for the held keys, without touching glfw
+void applyMovement(unsigned keys, float dt)
+{
+    if (keys & KEY_W)
+        camera.ProcessKeyboard(FORWARD, dt);
+    if (keys & KEY_S)
+        camera.ProcessKeyboard(BACKWARD, dt);
+    if (keys & KEY_A)
+        camera.ProcessKeyboard(LEFT, dt);
+    if (keys & KEY_D)
+        camera.ProcessKeyboard(RIGHT, dt);
 
     // move terrain patch around (these modify the sample offsets used by height function)
     float moveSpeed = 20.0f * (terrainAmplitude / 10.0f); // scale speed by height if you want
-    if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        terrainOffsetZ -= moveSpeed * deltaTime;
-    if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        terrainOffsetZ += moveSpeed * deltaTime;
-    if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        terrainOffsetX -= moveSpeed * deltaTime;
-    if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        terrainOffsetX += moveSpeed * deltaTime;
+    if (keys & (KEY_UP | KEY_W))
+        terrainOffsetZ -= moveSpeed * dt;
+    if (keys & (KEY_DOWN | KEY_S))
+        terrainOffsetZ += moveSpeed * dt;
+    if (keys & (KEY_LEFT | KEY_A))
+        terrainOffsetX -= moveSpeed * dt;
+    if (keys & (KEY_RIGHT | KEY_D))
+        terrainOffsetX += moveSpeed * dt;
 }
 
+// runs on the main thread without a context; the render thread applies it
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
-    glViewport(0, 0, width, height);
+    framebufferWidth = width;
+    framebufferHeight = height;
+}
+
+// the window system lost the contents (expose, restore): redraw even if unchanged
+void window_refresh_callback(GLFWwindow* window)
+{
+    redrawRequested = true;
 }
 
 void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
@@ -368,12 +7756,18 @@ void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
     lastX = xpos;
     lastY = ypos;
 
-    camera.ProcessMouseMovement(xoffset, yoffset);
+    // applied with the frame's other input
+    pendingInput.mouseX += xoffset;
+    pendingInput.mouseY += yoffset;
+    if (!pendingInputNs)
+        pendingInputNs = profiler.now();
 }
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
-    camera.ProcessMouseScroll(static_cast<float>(yoffset));
+    pendingInput.scroll += static_cast<float>(yoffset);
+    if (!pendingInputNs)
+        pendingInputNs = profiler.now();
 }
 
 unsigned int loadTexture(char const * path)
@@ -396,6 +7790,7 @@ unsigned int loadTexture(char const * path)
         glBindTexture(GL_TEXTURE_2D, textureID);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
+        memoryBudget.charge(MEM_TEXTURES, (size_t)width * height * nrComponents * 4 / 3);     // with mips
 
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);